@@ -13,21 +13,97 @@
 #include <sstream>
 #include <algorithm>
 #include <limits>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <csignal>
+#include <cerrno>
+#include <iterator>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include <unordered_map>
+#include <queue>
+#include <set>
+#include <shared_mutex>
+#include <pthread.h>
+#include <functional>
+#include <numeric>
+#include <array>
+#include <memory_resource>
+#include <charconv>
+#include <string_view>
+#include <cstdint>
+#include <coroutine>
+#include <optional>
+#include <climits>
+#include <utility>
 
 using namespace std;
 
 // Energy types our company provides
-enum class EnergyType { CRUDE_OIL, SOLAR, NUCLEAR, NATURAL_GAS };
+enum class EnergyType : uint8_t { CRUDE_OIL, SOLAR, NUCLEAR, NATURAL_GAS };
+
+// Everything we know about each energy type, in enum order. A new type (wind,
+// hydro...) goes in the enum and gets one line here - the rate tables, report
+// sums and test data all size themselves off this list. The snapshot stores a
+// rate per type, so bump snapshot::VERSION when the count changes.
+struct EnergyTypeInfo {
+    EnergyType type;
+    string_view name;
+    double defaultRate;    // per unit (kWh, barrel, etc.)
+};
+
+constexpr EnergyTypeInfo ENERGY_TYPES[] = {
+    {EnergyType::CRUDE_OIL, "Crude Oil", 1.25},
+    {EnergyType::SOLAR, "Solar", 0.18},
+    {EnergyType::NUCLEAR, "Nuclear", 0.22},
+    {EnergyType::NATURAL_GAS, "Natural Gas", 0.85},
+};
+constexpr size_t ENERGY_TYPE_COUNT = size(ENERGY_TYPES);
+
+constexpr bool energyTypesInOrder() {
+    for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++)
+        if (static_cast<size_t>(ENERGY_TYPES[t].type) != t) return false;
+    return true;
+}
+static_assert(energyTypesInOrder(), "ENERGY_TYPES has to list the types in enum order");
+
+// One value per energy type, indexed by typeIndex()
+template <typename T>
+using PerType = array<T, ENERGY_TYPE_COUNT>;
+
+constexpr size_t typeIndex(EnergyType t) { return static_cast<size_t>(t); }
+
+constexpr EnergyType typeAt(size_t i) { return ENERGY_TYPES[i].type; }
+
+// Energy type from a stored byte - anything out of range becomes the first type
+constexpr EnergyType toEnergyType(uint8_t v) {
+    return v < ENERGY_TYPE_COUNT ? static_cast<EnergyType>(v) : ENERGY_TYPES[0].type;
+}
 
 // Convert energy type to readable string - needed for reports
-string getEnergyName(EnergyType t) {
-    switch (t) {
-        case EnergyType::CRUDE_OIL: return "Crude Oil";
-        case EnergyType::SOLAR: return "Solar";
-        case EnergyType::NUCLEAR: return "Nuclear";
-        case EnergyType::NATURAL_GAS: return "Natural Gas";
-        default: return "Unknown";
-    }
+constexpr string_view getEnergyName(EnergyType t) {
+    return typeIndex(t) < ENERGY_TYPE_COUNT ? ENERGY_TYPES[typeIndex(t)].name : "Unknown";
 }
 
 // Keeps track of billing info
@@ -35,27 +111,65 @@ struct Payment {
     double amount;
     time_t date;
     bool isPaid;
+    bool overdue = false;   // set by the overdue scheduler when the bill goes past due
+    int number = 0;         // position in the customer's bill history (Bill #number+1)
+    double paid = 0;        // received so far - a bill can be paid in parts
     
-    Payment(double amt) : amount(amt), isPaid(false), date(time(nullptr)) {}
+    Payment(double amt, time_t when = time(nullptr)) : amount(amt), date(when), isPaid(false) {}
     
     // How many days since we sent the bill
-    int getDaysSince() const { 
-        return difftime(time(nullptr), date) / (60*60*24); 
+    int getDaysSince(time_t now) const { 
+        return difftime(now, date) / (60*60*24); 
     }
     
+    // An unpaid bill goes overdue once it's more than 30 days old
+    time_t dueTime() const { return date + 31 * 60*60*24; }
+    
     // Past 30 days and still not paid? It's overdue
     bool isOverdue() const { 
-        return getDaysSince() > 30 && !isPaid; 
+        return overdue && !isPaid; 
     }
     
+    // What's still to pay
+    double remaining() const { return isPaid ? 0 : amount - paid; }
+    
     // Nicer date format for printing
     string formatDate() const {
         char buffer[80];
-        strftime(buffer, sizeof(buffer), "%Y-%m-%d", localtime(&date));
+        tm local;
+        localtime_r(&date, &local);
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d", &local);
         return string(buffer);
     }
 };
 
+// Local "YYYY-MM-DD" strings, remembered by timestamp. A billing run stamps
+// every bill it makes with the same time, so going down a list of
+// customers mostly hits and localtime hardly gets called.
+class DateCache {
+private:
+    struct Slot {
+        time_t t = 0;
+        bool used = false;
+        uint8_t len = 0;
+        char text[16];
+    };
+    array<Slot, 256> slots;
+
+public:
+    string_view format(time_t t) {
+        Slot& slot = slots[(uint64_t(t) * 0x9E3779B97F4A7C15ULL) >> 56];
+        if (!slot.used || slot.t != t) {
+            tm local;
+            localtime_r(&t, &local);
+            slot.len = strftime(slot.text, sizeof(slot.text), "%Y-%m-%d", &local);
+            slot.t = t;
+            slot.used = true;
+        }
+        return string_view(slot.text, slot.len);
+    }
+};
+
 // For tracking our imports and exports
 struct ImportExport {
     EnergyType type;
@@ -70,442 +184,8043 @@ struct ImportExport {
     double getValue() const { return quantity * price; }
 };
 
-// Our customer class
-class Customer {
-private:
-    int id;
-    string name, province, email, address;
-    EnergyType energyType;
-    double allocated, used = 0;   // How much they're allowed to use & used so far
-    vector<Payment> payments;
-    bool reminderSent = false;
+// One reading from a smart meter feed
+struct MeterReading {
+    int customerId;
+    double amount;
+    time_t timestamp;
+};
+
+// Numbers from an ingestion run - used to size the pipeline
+struct IngestStats {
+    long long received = 0, applied = 0;
+    long long overAllocation = 0;   // rejected, customer ran out of allocation
+    long long unknownId = 0;        // rejected, no customer with that ID
+    double seconds = 0;
+    
+    double readingsPerSec() const { return seconds > 0 ? received / seconds : 0; }
+};
+
+// What a billing run did
+struct BillingSummary {
+    int billsCreated = 0;
+    double totalBilled = 0;
+    double seconds = 0;
+    int threads = 0;
+    long long billsCompacted = 0;   // old paid bills moved to cold storage afterwards
+};
+
+// What makePayment did. NOT_SAVED means the payment was applied but the
+// write-ahead log couldn't get it onto disk - it's not to be sent again,
+// but it's lost if we restart before the next snapshot.
+enum class PaymentResult { REJECTED, PAID, NOT_SAVED };
+
+// One payment from a bank remittance file
+struct Remittance {
+    int customerId;
+    double amount;
+    string reference;       // the bank's, only used in the reconciliation report
+};
+
+// A remittance that didn't just pay off bills exactly
+struct PaymentIssue {
+    enum Kind { UNKNOWN_CUSTOMER, BAD_AMOUNT, NOTHING_OWED, PARTIAL, OVERPAID };
+    size_t line;            // position in the batch
+    Kind kind;
+    int customerId;
+    double amount, applied;
+    string reference;
+    
+    static const char* describe(Kind k) {
+        switch (k) {
+            case UNKNOWN_CUSTOMER: return "unknown customer";
+            case BAD_AMOUNT: return "bad amount";
+            case NOTHING_OWED: return "nothing owed";
+            case PARTIAL: return "partial";
+            case OVERPAID: return "overpaid";
+        }
+        return "?";
+    }
+};
+
+// What posting a remittance batch did - the reconciliation report
+struct PostingReport {
+    size_t payments = 0;
+    size_t matched = 0;             // paid bills off with nothing left over - no issue
+    int billsPaid = 0;
+    int billsPartlyPaid = 0;        // left part paid when the money ran out
+    double received = 0, applied = 0;
+    vector<PaymentIssue> issues;    // in batch order
+    double seconds = 0;
+    int threads = 0;
+    bool durable = true;            // false if the write-ahead log couldn't save them
+    
+    double unapplied() const { return received - applied; }
+};
+
+// Read a remittance file: "customer id,amount,reference" a line, with an
+// optional header line. A line that doesn't parse still goes in the batch
+// (as customer -1 or a NaN amount) so it shows up in the reconciliation
+// instead of going missing.
+bool readRemittances(const string& filename, vector<Remittance>& out) {
+    ifstream in(filename);
+    if (!in) {
+        cerr << "Couldn't open remittance file: " << filename << endl;
+        return false;
+    }
+    string line;
+    for (bool first = true; getline(in, line); first = false) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || (first && !isdigit((unsigned char)line[0]))) continue;
+        
+        Remittance pay{-1, NAN, ""};
+        size_t c1 = line.find(','), c2 = c1 == string::npos ? c1 : line.find(',', c1 + 1);
+        const char* s = line.data();
+        const char* idEnd = s + min(c1, line.size());
+        if (from_chars(s, idEnd, pay.customerId).ptr != idEnd) pay.customerId = -1;
+        if (c1 != string::npos) {
+            string amount = line.substr(c1 + 1, c2 == string::npos ? string::npos : c2 - c1 - 1);
+            char* end = nullptr;
+            double v = strtod(amount.c_str(), &end);
+            if (!amount.empty() && *end == '\0') pay.amount = v;
+        }
+        if (c2 != string::npos) pay.reference = line.substr(c2 + 1);
+        out.push_back(move(pay));
+    }
+    return true;
+}
+
+// The reconciliation summary, with the first 'maxIssues' issues
+void printPostingReport(const PostingReport& r, ostream& out, size_t maxIssues = 20) {
+    out << "Payments posted: " << r.payments << " in " << fixed << setprecision(1) << r.seconds * 1000
+        << " ms (" << r.threads << " threads)\n"
+        << "Matched exactly: " << r.matched << "\n"
+        << "Bills paid off: " << r.billsPaid << ", left part paid: " << r.billsPartlyPaid << "\n"
+        << setprecision(2) << "Received: $" << r.received << ", applied: $" << r.applied
+        << ", unapplied: $" << r.unapplied() << "\n";
+    
+    size_t counts[PaymentIssue::OVERPAID + 1] = {};
+    for (auto& issue : r.issues) counts[issue.kind]++;
+    out << "Needing a look: " << r.issues.size();
+    for (int k = 0; k <= PaymentIssue::OVERPAID; k++)
+        if (counts[k]) out << ", " << counts[k] << " " << PaymentIssue::describe(PaymentIssue::Kind(k));
+    out << "\n";
+    
+    for (size_t n = 0; n < min(maxIssues, r.issues.size()); n++) {
+        const PaymentIssue& issue = r.issues[n];
+        out << "  Line " << issue.line + 1 << ": customer " << issue.customerId << " $" << issue.amount
+            << " (" << issue.reference << ") - " << PaymentIssue::describe(issue.kind)
+            << ", $" << issue.applied << " applied\n";
+    }
+    if (r.issues.size() > maxIssues) out << "  ... and " << r.issues.size() - maxIssues << " more\n";
+    if (!r.durable) out << "Warning: the write-ahead log couldn't save these payments - take a snapshot\n";
+}
+
+// Every issue as CSV, for whoever chases them up
+bool writeReconciliation(const PostingReport& r, const string& filename) {
+    ofstream out(filename);
+    out << "line,customer,reference,amount,applied,unapplied,status\n" << fixed << setprecision(2);
+    for (auto& issue : r.issues) {
+        string ref = issue.reference;
+        for (size_t q = 0; (q = ref.find('"', q)) != string::npos; q += 2) ref.insert(q, 1, '"');
+        out << issue.line + 1 << "," << issue.customerId << ",\"" << ref << "\"," << issue.amount << ","
+            << issue.applied << "," << (isfinite(issue.amount) ? issue.amount - issue.applied : 0) << ","
+            << PaymentIssue::describe(issue.kind) << "\n";
+    }
+    if (!out) {
+        cerr << "Couldn't write reconciliation file: " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+// One what-if for the capacity planner. Changes are shares of what's there
+// now: 0.1 = up 10%, -0.25 = down a quarter.
+struct Scenario {
+    string name = "Baseline";
+    double demandGrowth = 0;                        // everyone's usage
+    vector<pair<string, double>> provinceGrowth;    // on top of that, by province
+    PerType<double> rateChange{};                   // by energy type
+    double priceElasticity = 0;                     // usage change per rate change (-0.2: 10% dearer, 2% less used)
+    double supplyChange = 0;                        // every province's supply
+    vector<pair<string, double>> provinceSupply;    // on top of that, by province
+    PerType<double> typeSupply{};                   // and by energy type
+    double importChange = 0;                        // net imports (-1 = none come in)
+    bool rebalance = true;                          // give over-limit customers spare supply
+};
+
+// A province's month (or everyone's) as a scenario sees it. Units are
+// usage units a month, money is at the scenario's rates.
+struct ProvinceProjection {
+    string province;
+    double demand = 0, supply = 0;
+    double allocated = 0;               // after rebalancing
+    double served = 0, shortfall = 0;   // demand that can / can't be met
+    double revenue = 0, lostRevenue = 0;
+    double raised = 0;                  // allocation rebalancing added
+    long long customers = 0, overLimit = 0, raisedCustomers = 0;
+    
+    void add(const ProvinceProjection& o) {
+        demand += o.demand;
+        supply += o.supply;
+        allocated += o.allocated;
+        served += o.served;
+        shortfall += o.shortfall;
+        revenue += o.revenue;
+        lostRevenue += o.lostRevenue;
+        raised += o.raised;
+        customers += o.customers;
+        overLimit += o.overLimit;
+        raisedCustomers += o.raisedCustomers;
+    }
+};
+
+struct ScenarioResult {
+    string name;
+    vector<ProvinceProjection> provinces;   // ones with customers
+    ProvinceProjection total;
+    size_t chunksCopied = 0;                // allocation chunks the scenario wrote to
+};
+
+struct CapacityPlan {
+    vector<ScenarioResult> scenarios;
+    size_t customers = 0;
+    double seconds = 0;
+    unsigned threads = 0;
+};
+
+// What the menu and --plan run
+vector<Scenario> defaultScenarios() {
+    vector<Scenario> list(7);
+    list[1].name = "Demand +10%";
+    list[1].demandGrowth = 0.1;
+    list[2].name = "Rates +5%, some customers cut back";
+    list[2].rateChange.fill(0.05);
+    list[2].priceElasticity = -0.3;
+    list[3].name = "Supply -15%";
+    list[3].supplyChange = -0.15;
+    list[4].name = "Alberta supply -30%";
+    list[4].provinceSupply = {{"Alberta", -0.3}};
+    list[5].name = "Nuclear outage (-50%)";
+    list[5].typeSupply[typeIndex(EnergyType::NUCLEAR)] = -0.5;
+    list[6].name = "No imports, demand +5%";
+    list[6].importChange = -1;
+    list[6].demandGrowth = 0.05;
+    return list;
+}
+
+// Each scenario's totals, then the provinces worst hit
+void printCapacityPlan(const CapacityPlan& plan, ostream& out, size_t worstProvinces = 3) {
+    out << plan.scenarios.size() << " scenarios over " << plan.customers << " customers in "
+        << fixed << setprecision(1) << plan.seconds * 1000 << " ms (" << plan.threads << " threads)\n";
+    for (auto& r : plan.scenarios) {
+        const ProvinceProjection& t = r.total;
+        out << "\n" << r.name << "\n" << setprecision(0)
+            << "  Demand " << t.demand << " units, supply " << t.supply << ", short " << t.shortfall
+            << " (" << t.overLimit << " customers over their limit)\n" << setprecision(2)
+            << "  Revenue $" << t.revenue << ", lost to shortfall $" << t.lostRevenue << "\n";
+        if (t.raisedCustomers > 0)
+            out << setprecision(0) << "  Rebalancing raised " << t.raisedCustomers << " allocations by "
+                << t.raised << " units (" << r.chunksCopied << " chunks copied)\n";
+        
+        vector<const ProvinceProjection*> worst;
+        for (auto& p : r.provinces)
+            if (p.shortfall > 0.5) worst.push_back(&p);
+        sort(worst.begin(), worst.end(), [](auto* a, auto* b) { return a->shortfall > b->shortfall; });
+        for (size_t k = 0; k < min(worstProvinces, worst.size()); k++)
+            out << setprecision(0) << "    " << worst[k]->province << ": short " << worst[k]->shortfall
+                << " of " << worst[k]->demand << " units, $" << setprecision(2) << worst[k]->lostRevenue << " lost\n";
+    }
+}
+
+// Counters and latency histograms for the hot paths (see Metrics).
+// Build with -DNO_METRICS to compile all of it out.
+#ifndef NO_METRICS
+#define HAVE_METRICS 1
+#endif
+
+enum class Counter { BILLING_RUNS, BILLS_CREATED, SEARCHES, SEARCH_RESULTS, REMINDERS_RENDERED,
+                     REMINDERS_SENT, REMINDERS_FAILED, REPORTS, REPORT_BYTES, READINGS_APPLIED,
+                     READINGS_REJECTED, REQUESTS, REQUEST_ERRORS, CONNECTIONS };
+enum class Timing { BILLING_RUN, SEARCH, REMINDER_PASS, REPORT, INGEST_BATCH, REQUEST };
+
+struct MetricInfo {
+    const char* name;     // Prometheus name
+    const char* help;
+};
+
+// In enum order
+constexpr MetricInfo COUNTERS[] = {
+    {"energy_billing_runs_total", "Billing runs finished"},
+    {"energy_bills_created_total", "Bills created by billing runs"},
+    {"energy_searches_total", "Customer searches"},
+    {"energy_search_results_total", "Customers returned by searches"},
+    {"energy_reminders_rendered_total", "Reminder emails written"},
+    {"energy_reminders_sent_total", "Reminder emails the relay took"},
+    {"energy_reminders_failed_total", "Reminder emails that couldn't be delivered"},
+    {"energy_reports_total", "Reports written"},
+    {"energy_report_bytes_total", "Bytes of report output"},
+    {"energy_readings_applied_total", "Meter readings applied by the ingestion pipeline"},
+    {"energy_readings_rejected_total", "Meter readings rejected (over allocation or unknown customer)"},
+    {"energy_server_requests_total", "Requests the command server answered"},
+    {"energy_server_request_errors_total", "Requests the command server turned down"},
+    {"energy_server_connections_total", "Connections the command server took"},
+};
+constexpr MetricInfo TIMINGS[] = {
+    {"energy_billing_run_seconds", "Time per billing run"},
+    {"energy_search_seconds", "Time per customer search"},
+    {"energy_reminder_pass_seconds", "Time per reminder pass, writing and sending"},
+    {"energy_report_seconds", "Time per report"},
+    {"energy_ingest_batch_seconds", "Time per ingestion batch"},
+    {"energy_server_request_seconds", "Time per command server request, not counting the wait for a worker"},
+};
+constexpr size_t COUNTER_COUNT = size(COUNTERS);
+constexpr size_t TIMING_COUNT = size(TIMINGS);
+
+// Latency buckets laid out like HdrHistogram: exact up to 16ns, then 16
+// steps per power of two, so a bucket is never more than 1/16 (6%) wide.
+// Tops out at 2^43 ns (about 2.4 hours).
+struct LatencyBuckets {
+    static const int SUB_BITS = 4, SUB = 1 << SUB_BITS, MAX_EXP = 42;
+    static const int COUNT = (MAX_EXP - SUB_BITS + 2) * SUB;
     
-    // For tracking maintenance stuff
-    struct MaintRecord { 
-        time_t date; 
-        string desc; 
-        double cost; 
+    static int index(uint64_t ns) {
+        if (ns < SUB) return ns;
+        ns = min<uint64_t>(ns, (2ull << MAX_EXP) - 1);
+        int e = 63 - __builtin_clzll(ns);
+        return (e - SUB_BITS + 1) * SUB + ((ns >> (e - SUB_BITS)) & (SUB - 1));
+    }
+    static uint64_t lowest(int i) {
+        if (i < SUB) return i;
+        int e = i / SUB + SUB_BITS - 1;
+        return uint64_t(SUB + i % SUB) << (e - SUB_BITS);
+    }
+    static uint64_t highest(int i) { return i + 1 < COUNT ? lowest(i + 1) - 1 : UINT64_MAX; }
+};
+
+// Everything Metrics has counted, added up
+struct MetricsSnapshot {
+    uint64_t counters[COUNTER_COUNT] = {};
+    uint64_t sumNs[TIMING_COUNT] = {};
+    uint64_t buckets[TIMING_COUNT][LatencyBuckets::COUNT] = {};
+    
+    uint64_t count(Timing t) const {
+        const uint64_t* b = buckets[int(t)];
+        return accumulate(b, b + LatencyBuckets::COUNT, uint64_t(0));
+    }
+    
+    // Prometheus text format, with the histograms on a 1-2.5-5 ladder from
+    // 1us to 100s
+    void writePrometheus(ostream& out) const {
+        for (size_t c = 0; c < COUNTER_COUNT; c++) {
+            out << "# HELP " << COUNTERS[c].name << " " << COUNTERS[c].help << "\n"
+                << "# TYPE " << COUNTERS[c].name << " counter\n"
+                << COUNTERS[c].name << " " << counters[c] << "\n";
+        }
+        for (size_t t = 0; t < TIMING_COUNT; t++) {
+            const char* name = TIMINGS[t].name;
+            out << "# HELP " << name << " " << TIMINGS[t].help << "\n"
+                << "# TYPE " << name << " histogram\n";
+            const double bounds[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3,
+                                     5e-3, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100};
+            uint64_t below = 0;
+            int i = 0;
+            for (double bound : bounds) {
+                while (i < LatencyBuckets::COUNT && LatencyBuckets::highest(i) <= bound * 1e9)
+                    below += buckets[t][i++];
+                out << name << "_bucket{le=\"" << bound << "\"} " << below << "\n";
+            }
+            uint64_t total = count(Timing(t));
+            out << name << "_bucket{le=\"+Inf\"} " << total << "\n"
+                << name << "_sum " << sumNs[t] / 1e9 << "\n"
+                << name << "_count " << total << "\n";
+        }
+    }
+};
+
+#ifdef HAVE_METRICS
+// Process-wide metrics. Every thread counts into its own slots, which are
+// only added up when someone asks for a snapshot - so recording is a few
+// plain adds, with no locks or cache lines shared between threads. A
+// thread's slots go back on a spare list when it exits and the next new
+// thread carries on counting in them, so nothing is lost and short-lived
+// threads (like billing's) don't make the list grow.
+class Metrics {
+private:
+    struct Slots {
+        atomic<uint64_t> counters[COUNTER_COUNT];
+        atomic<uint64_t> sumNs[TIMING_COUNT];
+        atomic<uint64_t> buckets[TIMING_COUNT][LatencyBuckets::COUNT];
     };
-    vector<MaintRecord> maintenance;
+    mutex lock;
+    deque<Slots> all;           // never shrinks, so slot pointers stay good
+    vector<Slots*> spare;
+    
+    // Only the owning thread writes its slots, so no read-modify-write needed
+    static void bump(atomic<uint64_t>& a, uint64_t n) {
+        a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+    
+    Slots& mine();
+    
+    Slots* acquire() {
+        lock_guard<mutex> guard(lock);
+        if (!spare.empty()) {
+            Slots* s = spare.back();
+            spare.pop_back();
+            return s;
+        }
+        return &all.emplace_back();     // value-initialized, so all zero
+    }
+    void release(Slots* s) {
+        lock_guard<mutex> guard(lock);
+        spare.push_back(s);
+    }
     
 public:
-    Customer(int id, string name, string prov, string mail, string addr, EnergyType type, double alloc)
-        : id(id), name(name), province(prov), email(mail), address(addr), 
-          energyType(type), allocated(alloc) {}
-          
-    // Record energy usage - returns false if they try to use too much
-    bool useEnergy(double amt) {
-        if (amt <= allocated - used) {
-            used += amt;
-            return true;
+    void add(Counter c, uint64_t n = 1) { bump(mine().counters[int(c)], n); }
+    
+    void observe(Timing t, uint64_t ns) {
+        Slots& s = mine();
+        bump(s.buckets[int(t)][LatencyBuckets::index(ns)], 1);
+        bump(s.sumNs[int(t)], ns);
+    }
+    void observe(Timing t, chrono::steady_clock::duration d) {
+        observe(t, uint64_t(max<int64_t>(0, chrono::duration_cast<chrono::nanoseconds>(d).count())));
+    }
+    
+    MetricsSnapshot snapshot() {
+        MetricsSnapshot snap;
+        lock_guard<mutex> guard(lock);
+        for (auto& s : all) {
+            for (size_t c = 0; c < COUNTER_COUNT; c++) snap.counters[c] += s.counters[c].load(memory_order_relaxed);
+            for (size_t t = 0; t < TIMING_COUNT; t++) {
+                snap.sumNs[t] += s.sumNs[t].load(memory_order_relaxed);
+                for (int i = 0; i < LatencyBuckets::COUNT; i++)
+                    snap.buckets[t][i] += s.buckets[t][i].load(memory_order_relaxed);
+            }
+        }
+        return snap;
+    }
+};
+
+Metrics& metrics() {
+    static Metrics m;
+    return m;
+}
+
+Metrics::Slots& Metrics::mine() {
+    struct Owner {
+        Slots* slots = nullptr;
+        ~Owner() { if (slots) metrics().release(slots); }
+    };
+    static thread_local Owner owner;
+    if (!owner.slots) owner.slots = acquire();
+    return *owner.slots;
+}
+#else
+class Metrics {
+public:
+    void add(Counter, uint64_t = 1) {}
+    void observe(Timing, uint64_t) {}
+    void observe(Timing, chrono::steady_clock::duration) {}
+    MetricsSnapshot snapshot() { return {}; }
+};
+
+Metrics& metrics() {
+    static Metrics m;
+    return m;
+}
+#endif
+
+// Write the metrics to 'path' in the Prometheus text format. Goes through
+// a temp file and a rename, so whoever reads it never sees half a dump.
+bool writeMetrics(const string& path) {
+    string temp = path + ".tmp";
+    {
+        ofstream out(temp);
+        metrics().snapshot().writePrometheus(out);
+        if (!out) {
+            cerr << "Couldn't write metrics to " << temp << endl;
+            return false;
         }
+    }
+    if (rename(temp.c_str(), path.c_str()) != 0) {
+        cerr << "Couldn't move metrics into " << path << endl;
         return false;
     }
+    return true;
+}
+
+// Rewrites the metrics file every 'every' on a thread of its own, e.g. for
+// node_exporter's textfile collector to pick up. Writes once more on the
+// way out.
+class MetricsDumper {
+private:
+    string path;
+    chrono::milliseconds every;
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;
+    thread worker;
+    
+    void loop() {
+        unique_lock<mutex> l(lock);
+        while (!wake.wait_for(l, every, [&] { return stopping; })) {
+            l.unlock();
+            writeMetrics(path);
+            l.lock();
+        }
+    }
+    
+public:
+    MetricsDumper(string file, chrono::milliseconds interval)
+        : path(move(file)), every(interval), worker(&MetricsDumper::loop, this) {}
+    ~MetricsDumper() {
+        {
+            lock_guard<mutex> l(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+        writeMetrics(path);
+    }
+};
+
+// Times the scope it's in into one of the histograms
+class MetricTimer {
+private:
+#ifdef HAVE_METRICS
+    Timing timing;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    
+public:
+    explicit MetricTimer(Timing t) : timing(t) {}
+    ~MetricTimer() { metrics().observe(timing, chrono::steady_clock::now() - start); }
+#else
+public:
+    explicit MetricTimer(Timing) {}
+#endif
+    MetricTimer(const MetricTimer&) = delete;
+    MetricTimer& operator=(const MetricTimer&) = delete;
+};
+
+// Fixed size queue shared between the feed and the ingestion workers.
+// push() blocks when full so a fast feed can't eat all our memory.
+template <typename T>
+class BoundedQueue {
+private:
+    deque<T> items;
+    size_t capacity;
+    bool closed = false;
+    mutex m;
+    condition_variable notFull, notEmpty;
+    
+public:
+    explicit BoundedQueue(size_t cap) : capacity(cap) {}
+    
+    void push(T item) {
+        unique_lock<mutex> lock(m);
+        notFull.wait(lock, [&] { return items.size() < capacity || closed; });
+        if (closed) return;
+        items.push_back(move(item));
+        notEmpty.notify_one();
+    }
+    
+    // Take up to max items at once - returns 0 only when closed and drained
+    size_t popBatch(vector<T>& out, size_t max) {
+        unique_lock<mutex> lock(m);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+        size_t n = 0;
+        while (!items.empty() && n < max) {
+            out.push_back(move(items.front()));
+            items.pop_front();
+            n++;
+        }
+        notFull.notify_all();
+        return n;
+    }
     
-    // Create a new bill based on current usage
-    void createBill(double rate) {
-        payments.push_back(Payment(used * rate));
-        used = 0; // Reset for next month
+    size_t size() {
+        lock_guard<mutex> lock(m);
+        return items.size();
     }
     
-    // Process a payment for a specific bill
-    bool makePayment(int index, double amt) {
-        if (index >= 0 && index < payments.size() && amt >= payments[index].amount) {
-            payments[index].isPaid = true;
-            reminderSent = false;
+    // No more pushes - workers finish what's left and stop
+    void close() {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+// Thread pool where every worker has its own deque of tasks. A worker runs
+// tasks off the back of its own deque and, once that's empty, steals from
+// the front of someone else's. Tasks a task submits go on its own
+// worker's deque, so they run where their data is warm, and a thread that
+// runs dry takes the oldest work from another instead of sitting idle.
+class WorkStealingPool {
+private:
+    struct Worker {
+        mutex m;
+        deque<function<void()>> tasks;
+    };
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    atomic<size_t> queued{0};           // sitting in a deque
+    atomic<size_t> unfinished{0};       // queued or running
+    atomic<size_t> nextWorker{0};       // submits from outside the pool go round robin
+    bool stopping = false;
+    mutex idle;
+    condition_variable wake, allDone;
+    
+    static inline thread_local WorkStealingPool* current = nullptr;
+    static inline thread_local size_t self = 0;
+    
+    bool take(size_t me, function<void()>& task) {
+        for (size_t k = 0; k < workers.size(); k++) {
+            Worker& w = *workers[(me + k) % workers.size()];
+            lock_guard<mutex> lock(w.m);
+            if (w.tasks.empty()) continue;
+            if (k == 0) {
+                task = move(w.tasks.back());
+                w.tasks.pop_back();
+            } else {
+                task = move(w.tasks.front());
+                w.tasks.pop_front();
+            }
+            queued--;
             return true;
         }
         return false;
     }
     
-    // Add maintenance work to customer's record
-    void addMaintenance(string desc, double cost) {
-        maintenance.push_back({time(nullptr), desc, cost});
-    }
-    
-    // Generate email reminder text for overdue bills
-    string sendReminder() {
-        if (hasOverdue() && !reminderSent) {
-            reminderSent = true;
-            stringstream email;
-            email << "To: " << this->email << "\n"
-                  << "Subject: Your energy payment is overdue\n\n"
-                  << "Hi " << name << ",\n\n"
-                  << "Just a reminder that you have unpaid bills that are now overdue:\n\n";
-            
-            for (auto& p : payments) {
-                if (p.isOverdue()) {
-                    email << "Bill from " << p.formatDate()
-                          << " - Amount: $" << fixed << setprecision(2) << p.amount
-                          << " - " << p.getDaysSince() - 30 << " days overdue\n";
+    void run(size_t me) {
+        current = this;
+        self = me;
+        function<void()> task;
+        while (true) {
+            if (take(me, task)) {
+                task();
+                task = nullptr;
+                if (--unfinished == 0) {
+                    lock_guard<mutex> lock(idle);
+                    allDone.notify_all();
                 }
+                continue;
             }
-            
-            email << "\nPlease pay ASAP to avoid service interruption.\n\n"
-                  << "Thanks,\nCustomer Service Team";
-            
-            return email.str();
+            unique_lock<mutex> lock(idle);
+            wake.wait(lock, [&] { return stopping || queued > 0; });
+            if (stopping && queued == 0) return;
         }
-        return "";
     }
     
-    // Total amount owed across all unpaid bills
-    double getTotalOwed() const {
-        double total = 0;
-        for (auto& p : payments)
-            if (!p.isPaid) total += p.amount;
-        return total;
+public:
+    explicit WorkStealingPool(unsigned threadCount = 0) {
+        if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+        for (unsigned t = 0; t < threadCount; t++) workers.push_back(make_unique<Worker>());
+        for (unsigned t = 0; t < threadCount; t++) threads.emplace_back([this, t] { run(t); });
     }
     
-    // Check if any bills are overdue
-    bool hasOverdue() const {
-        for (auto& p : payments)
-            if (p.isOverdue()) return true;
-        return false;
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lock(idle);
+            stopping = true;
+            wake.notify_all();
+        }
+        for (auto& t : threads) t.join();
     }
     
-    // Print all customer info to console
-    void printDetails() const {
-        cout << "--- Customer Info ---\n"
-             << "ID: " << id << "\nName: " << name
-             << "\nProvince: " << province
-             << "\nEmail: " << email
-             << "\nAddress: " << address
-             << "\nEnergy Type: " << getEnergyName(energyType)
-             << "\nAllocation: " << allocated << " units"
-             << "\nCurrent Usage: " << used << " units"
-             << "\nRemaining: " << (allocated - used) << " units\n\n";
-        
-        if (!payments.empty()) {
-            cout << "Payment History:\n";
-            for (size_t i = 0; i < payments.size(); i++) {
-                cout << "  Bill #" << i+1 << " (" << payments[i].formatDate() << "): $" 
-                     << fixed << setprecision(2) << payments[i].amount
-                     << " - " << (payments[i].isPaid ? "Paid" : "Unpaid") 
-                     << " - " << payments[i].getDaysSince() << " days ago";
-                
-                if (payments[i].isOverdue())
-                    cout << " (OVERDUE!)";
-                cout << "\n";
-            }
-        } else {
-            cout << "No bills yet.\n";
+    size_t size() const { return workers.size(); }
+    
+    void submit(function<void()> task) {
+        Worker& w = *workers[current == this ? self : nextWorker++ % workers.size()];
+        unfinished++;
+        {
+            lock_guard<mutex> lock(w.m);
+            w.tasks.push_back(move(task));
+            queued++;
+        }
+        lock_guard<mutex> lock(idle);
+        wake.notify_one();
+    }
+    
+    // Until every task, and everything they submitted, has run
+    void wait() {
+        unique_lock<mutex> lock(idle);
+        allDone.wait(lock, [&] { return unfinished == 0; });
+    }
+};
+
+// A column in chunks that copies share until one of them writes to a
+// chunk - then that copy gets its own copy of just that chunk. So a
+// what-if that moves a few thousand allocations out of millions costs a
+// few chunks rather than the whole column. Separate copies are fine on
+// separate threads, and so is one copy as long as each thread writes its
+// own chunks.
+template <typename T>
+class CowColumn {
+public:
+    static const size_t CHUNK = 4096;
+    
+private:
+    vector<shared_ptr<vector<T>>> chunks;
+    size_t rows = 0;
+    
+public:
+    CowColumn() = default;
+    explicit CowColumn(const vector<T>& v) : rows(v.size()) {
+        for (size_t i = 0; i < v.size(); i += CHUNK)
+            chunks.push_back(make_shared<vector<T>>(v.begin() + i, v.begin() + min(v.size(), i + CHUNK)));
+    }
+    
+    size_t size() const { return rows; }
+    const T& operator[](size_t i) const { return (*chunks[i / CHUNK])[i % CHUNK]; }
+    
+    T& write(size_t i) {
+        auto& chunk = chunks[i / CHUNK];
+        if (chunk.use_count() > 1) chunk = make_shared<vector<T>>(*chunk);
+        return (*chunk)[i % CHUNK];
+    }
+    
+    // Chunks nobody else shares (the ones this copy wrote to, while the
+    // column it was copied from is still around)
+    size_t ownChunks() const {
+        return count_if(chunks.begin(), chunks.end(), [](const auto& c) { return c.use_count() == 1; });
+    }
+};
+
+// Report kernels. groupedSum adds values[i] into out[group[i]], and when a
+// mask is given only where mask[i] == want. That covers "sum per province"
+// and "imports by energy type" style loops. out has to be zeroed by the
+// caller. The SIMD versions keep one accumulator per group in registers and
+// do a compare per group, so they only pay off for masked sums (no branch per
+// row) or a handful of groups - see groupedSum for how we pick.
+const int MAX_SIMD_GROUPS = 16;
+const int SIMD_UNMASKED_GROUPS = 4;
+
+// Takes 'groups' only so it fits the Kernel type - it doesn't need it
+void groupedSumScalar(const double* values, const uint8_t* group, const uint8_t* mask,
+                      uint8_t want, size_t n, double* out, int /*groups*/) {
+    for (size_t i = 0; i < n; i++)
+        if (!mask || mask[i] == want)
+            out[group[i]] += values[i];
+}
+
+// For lots of groups the compare-per-group trick costs more than it saves.
+// Spreading the rows over 4 separate tables instead lets the CPU work on 4
+// additions at once rather than waiting on the same out[g] over and over.
+void groupedSumWide(const double* values, const uint8_t* group, const uint8_t* mask,
+                    uint8_t want, size_t n, double* out, int groups) {
+    vector<double> tables(4 * groups, 0.0);
+    double* t0 = tables.data();
+    double* t1 = t0 + groups;
+    double* t2 = t1 + groups;
+    double* t3 = t2 + groups;
+    
+    size_t i = 0;
+    if (mask) {
+        for (; i + 4 <= n; i += 4) {
+            if (mask[i] == want) t0[group[i]] += values[i];
+            if (mask[i + 1] == want) t1[group[i + 1]] += values[i + 1];
+            if (mask[i + 2] == want) t2[group[i + 2]] += values[i + 2];
+            if (mask[i + 3] == want) t3[group[i + 3]] += values[i + 3];
+        }
+    } else {
+        for (; i + 4 <= n; i += 4) {
+            t0[group[i]] += values[i];
+            t1[group[i + 1]] += values[i + 1];
+            t2[group[i + 2]] += values[i + 2];
+            t3[group[i + 3]] += values[i + 3];
+        }
+    }
+    for (int g = 0; g < groups; g++)
+        out[g] += (t0[g] + t1[g]) + (t2[g] + t3[g]);
+    groupedSumScalar(values + i, group + i, mask ? mask + i : nullptr, want, n - i, out, groups);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_AVX2_KERNELS 1
+
+// 4 doubles at a time. Each group gets its own accumulator and we add the
+// values with the lanes of other groups zeroed out by a compare mask.
+__attribute__((target("avx2")))
+void groupedSumAVX2(const double* values, const uint8_t* group, const uint8_t* mask,
+                    uint8_t want, size_t n, double* out, int groups) {
+    __m256d acc[MAX_SIMD_GROUPS];
+    __m256i ids[MAX_SIMD_GROUPS];
+    for (int g = 0; g < groups; g++) {
+        acc[g] = _mm256_setzero_pd();
+        ids[g] = _mm256_set1_epi64x(g);
+    }
+    const __m256i wanted = _mm256_set1_epi64x(want);
+    
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        int32_t packed;
+        memcpy(&packed, group + i, 4);
+        __m256i g64 = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+        
+        if (mask) {
+            memcpy(&packed, mask + i, 4);
+            __m256i m64 = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+            v = _mm256_and_pd(v, _mm256_castsi256_pd(_mm256_cmpeq_epi64(m64, wanted)));
         }
         
-        if (!maintenance.empty()) {
-            cout << "\nMaintenance Records:\n";
-            for (auto& m : maintenance) {
-                char buffer[80];
-                strftime(buffer, sizeof(buffer), "%Y-%m-%d", localtime(&m.date));
-                cout << "  " << buffer << ": " << m.desc 
-                     << " - Cost: $" << fixed << setprecision(2) << m.cost << "\n";
-            }
+        for (int g = 0; g < groups; g++) {
+            __m256d sel = _mm256_castsi256_pd(_mm256_cmpeq_epi64(g64, ids[g]));
+            acc[g] = _mm256_add_pd(acc[g], _mm256_and_pd(v, sel));
+        }
+    }
+    
+    for (int g = 0; g < groups; g++) {
+        double lanes[4];
+        _mm256_storeu_pd(lanes, acc[g]);
+        out[g] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+    groupedSumScalar(values + i, group + i, mask ? mask + i : nullptr, want, n - i, out, groups);
+}
+#endif
+
+#if defined(__aarch64__)
+#define HAVE_NEON_KERNELS 1
+
+// Same idea as the AVX2 version, 2 doubles at a time (NEON is always there on arm64)
+void groupedSumNEON(const double* values, const uint8_t* group, const uint8_t* mask,
+                    uint8_t want, size_t n, double* out, int groups) {
+    float64x2_t acc[MAX_SIMD_GROUPS];
+    for (int g = 0; g < groups; g++) acc[g] = vdupq_n_f64(0);
+    
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        uint64x2_t v = vreinterpretq_u64_f64(vld1q_f64(values + i));
+        uint64x2_t g64 = vsetq_lane_u64(group[i + 1], vdupq_n_u64(group[i]), 1);
+        
+        if (mask) {
+            uint64x2_t m64 = vsetq_lane_u64(mask[i + 1], vdupq_n_u64(mask[i]), 1);
+            v = vandq_u64(v, vceqq_u64(m64, vdupq_n_u64(want)));
+        }
+        
+        for (int g = 0; g < groups; g++) {
+            uint64x2_t sel = vceqq_u64(g64, vdupq_n_u64(g));
+            acc[g] = vaddq_f64(acc[g], vreinterpretq_f64_u64(vandq_u64(v, sel)));
         }
-        cout << "\n";
     }
     
-    // Various getters
-    int getID() const { return id; }
-    string getName() const { return name; }
-    string getEmail() const { return email; }
-    string getProvince() const { return province; }
-    EnergyType getEnergyType() const { return energyType; }
-    double getUsed() const { return used; }
-    double getAllocated() const { return allocated; }
+    for (int g = 0; g < groups; g++)
+        out[g] += vgetq_lane_f64(acc[g], 0) + vgetq_lane_f64(acc[g], 1);
+    groupedSumScalar(values + i, group + i, mask ? mask + i : nullptr, want, n - i, out, groups);
+}
+#endif
+
+// Picks the best version for this CPU the first time it's called
+void groupedSum(const double* values, const uint8_t* group, const uint8_t* mask,
+                uint8_t want, size_t n, double* out, int groups) {
+    using Kernel = void (*)(const double*, const uint8_t*, const uint8_t*, uint8_t, size_t, double*, int);
+    static const Kernel best = [] {
+#ifdef HAVE_AVX2_KERNELS
+        if (__builtin_cpu_supports("avx2")) return Kernel(groupedSumAVX2);
+#endif
+#ifdef HAVE_NEON_KERNELS
+        return Kernel(groupedSumNEON);
+#endif
+        return Kernel(groupedSumScalar);
+    }();
+    
+    if (groups > MAX_SIMD_GROUPS || (!mask && groups > SIMD_UNMASKED_GROUPS))
+        groupedSumWide(values, group, mask, want, n, out, groups);
+    else
+        best(values, group, mask, want, n, out, groups);
+}
+
+// Name of the kernel groupedSum will use - for the benchmark output
+const char* groupedSumKernelName() {
+#ifdef HAVE_AVX2_KERNELS
+    if (__builtin_cpu_supports("avx2")) return "AVX2";
+#endif
+#ifdef HAVE_NEON_KERNELS
+    return "NEON";
+#endif
+    return "scalar";
+}
+
+// Rate plans. A plan prices usage in multiples of the customer's energy type
+// rate. Time-of-use: every hour of the week falls in a period, and each
+// period has its own multiplier. Tiered: usage past a threshold within one
+// billing cycle costs an extra multiple on top. Plan 0 is flat - one period
+// at 1x, no tiers - which is what every customer starts on.
+const int MAX_PERIODS = 4;
+const int MAX_TIERS = 4;
+const int HOURS_PER_WEEK = 7 * 24;
+
+struct RatePlan {
+    string name;
+    vector<double> periodRates{1.0};                 // multiplier per period
+    array<uint8_t, HOURS_PER_WEEK> periodOfHour{};  // hour 0 = Monday 00:00 local time
+    
+    // Usage from 'from' units up to the next tier's start costs 'extra' x the
+    // rate more, e.g. {{0, 0}, {500, 0.25}} makes everything past 500 units 1.25x
+    struct Tier { double from, extra; };
+    vector<Tier> tiers{};
+    
+    // Put hours [from, to) of the given days into a period (bit 0 = Monday)
+    RatePlan& setHours(uint8_t days, int from, int to, int period) {
+        for (int d = 0; d < 7; d++)
+            if (days & (1 << d))
+                for (int h = max(0, from); h < min(24, to); h++)
+                    periodOfHour[d * 24 + h] = period;
+        return *this;
+    }
 };
 
-// Main system class that manages everything
-class EnergySystem {
+// A plan flattened into fixed size tables. Unused periods and tiers are
+// zeros, so pricing is the same few multiply-adds whatever plan a customer
+// is on and the billing loop doesn't branch on it.
+struct CompiledPlan {
+    array<uint8_t, HOURS_PER_WEEK> periodOfHour{};
+    array<double, MAX_PERIODS> periodRate{};
+    array<double, MAX_TIERS> tierFrom{}, tierWidth{}, tierExtra{};
+};
+
+class RatePlanBook {
 private:
-    vector<Customer> customers;
-    map<string, vector<int>> provinces; // Maps province to customer indices
-    map<EnergyType, double> rates;      // Pricing for each energy type
-    vector<ImportExport> trades;
-    mt19937 rng{random_device{}()};
+    vector<CompiledPlan> plans;
+    vector<string> names;
+    long utcOffset = 0;    // seconds east of UTC, taken once (DST changes aren't followed)
+    
+public:
+    RatePlanBook() {
+        time_t t = time(nullptr);
+        tm local;
+        localtime_r(&t, &local);
+        utcOffset = local.tm_gmtoff;
+        add(RatePlan{"Flat"});
+    }
+    
+    // Check a plan and compile it - returns its number, or -1 if it's no good
+    int add(const RatePlan& p) {
+        bool ok = !p.periodRates.empty() && p.periodRates.size() <= MAX_PERIODS &&
+                  p.tiers.size() <= MAX_TIERS && plans.size() < 256;
+        for (uint8_t period : p.periodOfHour)
+            ok = ok && period < p.periodRates.size();
+        for (size_t k = 0; k < p.tiers.size(); k++)
+            ok = ok && p.tiers[k].from >= 0 && (k == 0 || p.tiers[k].from > p.tiers[k - 1].from);
+        if (!ok) {
+            cerr << "Rate plan '" << p.name << "' isn't valid (up to " << MAX_PERIODS
+                 << " periods, " << MAX_TIERS << " tiers in increasing order)\n";
+            return -1;
+        }
+        
+        CompiledPlan c;
+        c.periodOfHour = p.periodOfHour;
+        copy(p.periodRates.begin(), p.periodRates.end(), c.periodRate.begin());
+        for (size_t k = 0; k < p.tiers.size(); k++) {
+            c.tierFrom[k] = p.tiers[k].from;
+            c.tierWidth[k] = k + 1 < p.tiers.size() ? p.tiers[k + 1].from - p.tiers[k].from
+                                                     : numeric_limits<double>::infinity();
+            c.tierExtra[k] = p.tiers[k].extra;
+        }
+        plans.push_back(c);
+        names.push_back(p.name);
+        return plans.size() - 1;
+    }
+    
+    size_t size() const { return plans.size(); }
+    const string& name(int plan) const { return names[plan]; }
+    
+    // Which of the plan's periods a moment falls in
+    uint8_t periodAt(int plan, time_t t) const {
+        long long local = (long long)t + utcOffset;
+        long long day = local >= 0 ? local / 86400 : (local - 86399) / 86400;
+        int hour = ((day + 3) % 7 + 7) % 7 * 24 + (local - day * 86400) / 3600;   // day 0 was a Thursday
+        return plans[plan].periodOfHour[hour];
+    }
     
-    // Helper for random numbers
-    double randNum(double min, double max) {
-        return uniform_real_distribution<>(min, max)(rng);
+    // What n customers owe for their usage. periodUsed holds MAX_PERIODS
+    // values per customer; 'used' is their total for the tiers.
+    void price(size_t n, const uint8_t* plan, const double* periodUsed, const double* used,
+               const EnergyType* type, const double* rateFor, double* out) const {
+        const CompiledPlan* compiled = plans.data();
+        for (size_t i = 0; i < n; i++) {
+            const CompiledPlan& c = compiled[plan[i]];
+            const double* pu = periodUsed + i * MAX_PERIODS;
+            double units = 0;
+            for (int k = 0; k < MAX_PERIODS; k++)
+                units += pu[k] * c.periodRate[k];
+            for (int k = 0; k < MAX_TIERS; k++)
+                units += c.tierExtra[k] * min(max(used[i] - c.tierFrom[k], 0.0), c.tierWidth[k]);
+            out[i] = units * rateFor[static_cast<size_t>(type[i])];
+        }
+    }
+};
+
+// Canada's provinces and territories. These always get province IDs 0-12,
+// in this order, so an ID means the same thing in every system and shard.
+// Any other name gets the next free ID the first time it turns up (see
+// CustomerStore::provinceIndex).
+const char* const PROVINCES[] = {
+    "Ontario", "Quebec", "Alberta", "British Columbia", "Manitoba", "Saskatchewan", "Nova Scotia",
+    "New Brunswick", "Newfoundland and Labrador", "Prince Edward Island", "Northwest Territories",
+    "Yukon", "Nunavut"};
+constexpr size_t PROVINCE_COUNT = size(PROVINCES);
+
+// Everything we need to sign up a new customer
+struct CustomerInfo {
+    int id;
+    string name, province, email, address;
+    EnergyType type;
+    double allocated;
+};
+
+// For tracking maintenance stuff
+struct MaintRecord { 
+    time_t date; 
+    string desc; 
+    double cost; 
+};
+
+// Squeezes old paid bills into a few bytes each. A bill is the change in bill
+// number and date from the one before it (as variable length numbers - a
+// month is 3-4 bytes instead of 8), a flags byte and the raw amount.
+struct ColdBills {
+    static void putVarint(pmr::string& out, uint64_t v) {
+        while (v >= 0x80) {
+            out += char(v | 0x80);
+            v >>= 7;
+        }
+        out += char(v);
+    }
+    
+    static uint64_t getVarint(const pmr::string& in, size_t& pos) {
+        uint64_t v = 0;
+        for (int shift = 0; pos < in.size(); shift += 7) {
+            uint8_t b = in[pos++];
+            v |= uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    }
+    
+    // Bills must be in number order
+    static void encode(const vector<Payment>& bills, pmr::string& out) {
+        out.clear();
+        int64_t lastNumber = -1, lastDate = 0;
+        for (auto& b : bills) {
+            putVarint(out, b.number - lastNumber);
+            int64_t dd = (int64_t)b.date - lastDate;
+            putVarint(out, (uint64_t(dd) << 1) ^ uint64_t(dd >> 63));   // zigzag, dates can go backwards
+            out += char(b.isPaid | b.overdue << 1);
+            out.append(reinterpret_cast<const char*>(&b.amount), sizeof(double));
+            lastNumber = b.number;
+            lastDate = b.date;
+        }
+    }
+    
+    static void decode(const pmr::string& in, vector<Payment>& out) {
+        int64_t number = -1, date = 0;
+        size_t pos = 0;
+        while (pos < in.size()) {
+            number += getVarint(in, pos);
+            uint64_t z = getVarint(in, pos);
+            date += int64_t(z >> 1) ^ -int64_t(z & 1);
+            if (pos + 1 + sizeof(double) > in.size()) break;
+            uint8_t flags = in[pos++];
+            double amount;
+            memcpy(&amount, in.data() + pos, sizeof(double));
+            pos += sizeof(double);
+            
+            Payment b(amount, date);
+            b.isPaid = flags & 1;
+            b.overdue = flags & 2;
+            b.number = number;
+            b.paid = b.isPaid ? amount : 0;     // only paid bills go cold
+            out.push_back(b);
+        }
+    }
+};
+
+// Usage per 15 minute interval for one customer, so we still know the shape
+// of a month after billing zeroes 'used'. Amounts are kept in thousandths of
+// a unit (meters don't read finer than that) so sums come out exact in any
+// order. The last couple of hours sit unpacked in a small ring, where late
+// readings can still land in the right interval. Older intervals get packed
+// into a bit stream, one block per UTC day: the gap from the interval before
+// (1 bit when there isn't one) and the change in value (1 bit when it's the
+// same, 1-2 bytes for normal ups and downs). Empty intervals take no space.
+// Each block keeps its own total, so sums per day or longer never unpack
+// anything. A full month at 15 minutes comes to 3-7KB per customer.
+class UsageSeries {
+public:
+    static const int INTERVAL = 15 * 60;                  // seconds
+    static const int PER_DAY = 24 * 60 * 60 / INTERVAL;
+    static const int WINDOW = 8;                          // intervals kept unpacked
+    static constexpr double SCALE = 1000;
+    
+    struct Block {
+        int32_t day;          // days since 1970, UTC
+        uint32_t offset;      // first byte in the bit stream
+        int64_t sum;          // everything in the block, in thousandths
+        uint32_t count, pad;  // intervals in the block
+    };
+    
+    // Everything besides the blocks and bits, for snapshots
+    struct State {
+        int64_t windowStart, lastInterval, lastValue, late;
+        uint64_t bitLen;
+        int64_t window[WINDOW];
+    };
+    
+    static int64_t intervalOf(time_t t) {
+        return t >= 0 ? t / INTERVAL : (t - INTERVAL + 1) / INTERVAL;
+    }
+    static int64_t dayOf(int64_t interval) {
+        return interval >= 0 ? interval / PER_DAY : (interval - PER_DAY + 1) / PER_DAY;
+    }
+    static int64_t toUnits(double amt) { return llround(amt * SCALE); }
+    static double toAmount(int64_t units) { return units / SCALE; }
+    
+private:
+    pmr::vector<uint8_t> bits;
+    pmr::vector<Block> blocks;
+    uint64_t bitLen = 0;
+    int64_t lastInterval = 0, lastValue = 0;  // last one packed, for the deltas
+    int64_t windowStart = -1;                 // oldest interval still in the ring
+    array<int64_t, WINDOW> window{};          // slot is interval % WINDOW
+    int64_t lateUnits = 0;                    // came in after their interval was packed
+    
+    void put(uint64_t v, int n) {
+        for (int done = 0; done < n;) {
+            if (bitLen % 8 == 0) bits.push_back(0);
+            int at = bitLen % 8, take = min(8 - at, n - done);
+            bits.back() |= uint8_t(((v >> done) & ((1u << take) - 1)) << at);
+            done += take;
+            bitLen += take;
+        }
+    }
+    
+    // Zigzag change in value: 0 / 10+8 bits / 110+16 / 1110+32 / 1111+64
+    void putChange(int64_t d) {
+        uint64_t z = (uint64_t(d) << 1) ^ uint64_t(d >> 63);
+        if (z == 0) put(0, 1);
+        else if (z < (1u << 8)) { put(0b01, 2); put(z, 8); }
+        else if (z < (1u << 16)) { put(0b011, 3); put(z, 16); }
+        else if (z < (1ull << 32)) { put(0b0111, 4); put(z, 32); }
+        else { put(0b1111, 4); put(z, 64); }
+    }
+    
+    struct Reader {
+        const uint8_t* data;
+        uint64_t pos, end;
+        
+        uint64_t get(int n) {
+            uint64_t v = 0;
+            for (int done = 0; done < n && pos < end;) {
+                int at = pos % 8, take = min(8 - at, n - done);
+                v |= uint64_t((data[pos / 8] >> at) & ((1u << take) - 1)) << done;
+                done += take;
+                pos += take;
+            }
+            return v;
+        }
+        int64_t getChange() {
+            int ones = 0;
+            while (ones < 4 && get(1)) ones++;
+            static const int width[] = {0, 8, 16, 32, 64};
+            uint64_t z = get(width[ones]);
+            return int64_t(z >> 1) ^ -int64_t(z & 1);
+        }
+    };
+    
+    // Add a finished interval to the bit stream (intervals only go up)
+    void pack(int64_t interval, int64_t value) {
+        int64_t day = dayOf(interval);
+        if (blocks.empty() || blocks.back().day != day) {
+            bitLen = bits.size() * 8;     // blocks start on a byte, so old ones can be cut off
+            blocks.push_back({int32_t(day), uint32_t(bits.size()), 0, 0, 0});
+            put(interval - day * PER_DAY, 7);
+            putChange(value);
+        } else {
+            int64_t gap = interval - lastInterval;
+            if (gap == 1) put(0, 1);
+            else { put(1, 1); put(gap, 7); }
+            putChange(value - lastValue);
+        }
+        blocks.back().sum += value;
+        blocks.back().count++;
+        lastInterval = interval;
+        lastValue = value;
+    }
+    
+    // Call fn(interval, units) for everything in a block
+    template <typename Fn> void unpack(const Block& b, Fn&& fn) const {
+        Reader r{bits.data(), uint64_t(b.offset) * 8, bits.size() * 8};
+        int64_t interval = int64_t(b.day) * PER_DAY + r.get(7);
+        int64_t value = r.getChange();
+        for (uint32_t k = 0; k < b.count; k++) {
+            if (k > 0) {
+                interval += r.get(1) ? r.get(7) : 1;
+                value += r.getChange();
+            }
+            fn(interval, value);
+        }
+    }
+    
+public:
+    explicit UsageSeries(pmr::memory_resource* mr = pmr::get_default_resource())
+        : bits(mr), blocks(mr) {}
+    
+    // Add usage to an interval - false if it came too late to go in one
+    bool add(int64_t interval, int64_t units) {
+        if (units == 0) return true;
+        if (windowStart < 0) windowStart = interval;
+        if (interval < windowStart) {
+            lateUnits += units;
+            return false;
+        }
+        if (interval >= windowStart + WINDOW) {
+            // Pack whatever falls out of the ring
+            int64_t start = interval - WINDOW + 1;
+            for (int64_t k = windowStart; k < min(start, windowStart + WINDOW); k++) {
+                int64_t& slot = window[k % WINDOW];
+                if (slot != 0) pack(k, slot);
+                slot = 0;
+            }
+            windowStart = start;
+        }
+        window[interval % WINDOW] += units;
+        return true;
+    }
+    
+    // Add up intervals [from, to) into out[], 'bucket' intervals to a slot
+    void aggregate(int64_t from, int64_t to, int64_t bucket, int64_t* out) const {
+        auto first = lower_bound(blocks.begin(), blocks.end(), dayOf(from),
+                                 [](const Block& b, int64_t day) { return b.day < day; });
+        for (auto it = first; it != blocks.end() && int64_t(it->day) * PER_DAY < to; ++it) {
+            int64_t start = int64_t(it->day) * PER_DAY, end = start + PER_DAY;
+            if (start >= from && end <= to && (start - from) / bucket == (end - 1 - from) / bucket) {
+                out[(start - from) / bucket] += it->sum;
+                continue;
+            }
+            unpack(*it, [&](int64_t interval, int64_t units) {
+                if (interval >= from && interval < to) out[(interval - from) / bucket] += units;
+            });
+        }
+        if (windowStart < 0) return;
+        for (int64_t k = max(windowStart, from); k < min(windowStart + WINDOW, to); k++)
+            out[(k - from) / bucket] += window[k % WINDOW];
+    }
+    
+    int64_t sum(int64_t from, int64_t to) const {
+        int64_t total = 0;
+        if (to > from) aggregate(from, to, to - from, &total);
+        return total;
+    }
+    
+    // Throw away whole days before this interval's day, and give back the
+    // spare room the vectors grew into
+    void dropBefore(int64_t interval) {
+        int64_t day = dayOf(interval);
+        auto keep = lower_bound(blocks.begin(), blocks.end(), day,
+                                [](const Block& b, int64_t d) { return b.day < d; });
+        if (keep != blocks.begin()) {
+            uint32_t cut = keep == blocks.end() ? bits.size() : keep->offset;
+            blocks.erase(blocks.begin(), keep);
+            for (auto& b : blocks) b.offset -= cut;
+            bits.erase(bits.begin(), bits.begin() + cut);
+            bitLen = blocks.empty() ? 0 : bitLen - uint64_t(cut) * 8;
+        }
+        bits.shrink_to_fit();
+        blocks.shrink_to_fit();
+    }
+    
+    // Usage that arrived too late to be put in its interval
+    int64_t late() const { return lateUnits; }
+    size_t bytes() const { return bits.capacity() + blocks.capacity() * sizeof(Block); }
+    
+    // Raw pieces for snapshots
+    const pmr::vector<uint8_t>& data() const { return bits; }
+    const pmr::vector<Block>& blockList() const { return blocks; }
+    State state() const {
+        State s{windowStart, lastInterval, lastValue, lateUnits, bitLen, {}};
+        copy(window.begin(), window.end(), s.window);
+        return s;
+    }
+    
+    // Put a series back from a snapshot - false if the pieces don't fit together
+    bool restore(const State& s, const uint8_t* data, size_t n, const Block* b, size_t nb) {
+        bool ok = s.bitLen <= n * 8 && (n == 0 || s.bitLen > (n - 1) * 8);
+        for (size_t k = 0; k < nb && ok; k++)
+            ok = b[k].offset < n && b[k].count > 0 && (k == 0 || (b[k].day > b[k - 1].day && b[k].offset > b[k - 1].offset));
+        if (!ok) return false;
+        bits.assign(data, data + n);
+        blocks.assign(b, b + nb);
+        bitLen = s.bitLen;
+        lastInterval = s.lastInterval;
+        lastValue = s.lastValue;
+        windowStart = s.windowStart;
+        lateUnits = s.late;
+        copy(s.window, s.window + WINDOW, window.begin());
+        return true;
+    }
+};
+
+// How many days of daily usage go in the monthly report
+const int REPORT_USAGE_DAYS = 7;
+
+// The parts of a customer we only need for details, emails and searching.
+// Kept apart from the numbers so report loops don't pull it through the cache.
+// Bill and maintenance histories come out of the store's shared pool
+// (see CustomerStore::historyPool) rather than their own heap blocks.
+// Bills are split in two: 'payments' holds the open and recent ones, in
+// bill number order, and paid bills past the tiering age get packed into
+// 'coldBills' (see ColdBills). Billing, payments and overdue checks only
+// ever look at 'payments'.
+struct CustomerProfile {
+    string name, email, address;      // province is CustomerStore::province
+    pmr::vector<Payment> payments;
+    pmr::string coldBills;
+    int coldCount = 0;            // bills in coldBills
+    int billCount = 0;            // all bills ever - the next bill's number
+    pmr::vector<MaintRecord> maintenance;
+    bool reminderSent = false;
+    int overdueBills = 0;         // How many unpaid bills are marked overdue
+    
+    explicit CustomerProfile(pmr::memory_resource* mr = pmr::get_default_resource())
+        : payments(mr), coldBills(mr), maintenance(mr) {}
+};
+
+// Reminder email, split into fixed text and fields once up front so each
+// message is just appends into a buffer that gets reused. Fields are
+// {email}, {name} and {bills} (one line per overdue bill).
+class ReminderTemplate {
+private:
+    enum Field { TEXT, EMAIL, NAME, BILLS };
+    struct Part {
+        Field field;
+        string text;
+    };
+    vector<Part> parts;
+    
+    static void appendBill(string& out, const Payment& bill, time_t now) {
+        char buf[64];
+        tm local;
+        localtime_r(&bill.date, &local);
+        out.append("Bill from ");
+        out.append(buf, strftime(buf, sizeof(buf), "%Y-%m-%d", &local));
+        out.append(" - Amount: $");
+        out.append(buf, to_chars(buf, buf + sizeof(buf), bill.amount, chars_format::fixed, 2).ptr - buf);
+        if (bill.paid > 0) {
+            out.append(" ($");
+            out.append(buf, to_chars(buf, buf + sizeof(buf), bill.remaining(), chars_format::fixed, 2).ptr - buf);
+            out.append(" still due)");
+        }
+        out.append(" - ");
+        out.append(buf, to_chars(buf, buf + sizeof(buf), bill.getDaysSince(now) - 30).ptr - buf);
+        out.append(" days overdue\n");
+    }
+    
+public:
+    static constexpr const char* DEFAULT =
+        "To: {email}\n"
+        "Subject: Your energy payment is overdue\n\n"
+        "Hi {name},\n\n"
+        "Just a reminder that you have unpaid bills that are now overdue:\n\n"
+        "{bills}"
+        "\nPlease pay ASAP to avoid service interruption.\n\n"
+        "Thanks,\nCustomer Service Team";
+    
+    explicit ReminderTemplate(const string& text = DEFAULT) {
+        const pair<const char*, Field> fields[] = {{"{email}", EMAIL}, {"{name}", NAME}, {"{bills}", BILLS}};
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t next = string::npos;
+            Field field = TEXT;
+            size_t len = 0;
+            for (auto& [name, f] : fields) {
+                size_t at = text.find(name, pos);
+                if (at < next) {
+                    next = at;
+                    field = f;
+                    len = strlen(name);
+                }
+            }
+            parts.push_back({TEXT, text.substr(pos, next - pos)});
+            if (next == string::npos) break;
+            parts.push_back({field, ""});
+            pos = next + len;
+        }
+    }
+    
+    // Write the email for this customer into out (cleared first)
+    void render(string& out, const CustomerProfile& p, time_t now) const {
+        out.clear();
+        for (auto& part : parts) {
+            switch (part.field) {
+                case TEXT:  out.append(part.text); break;
+                case EMAIL: out.append(p.email); break;
+                case NAME:  out.append(p.name); break;
+                case BILLS:
+                    for (auto& bill : p.payments)
+                        if (bill.isOverdue()) appendBill(out, bill, now);
+                    break;
+            }
+        }
+    }
+};
+
+// Reader/writer lock that lets a waiting writer go first. std::shared_mutex
+// on Linux lets new readers keep jumping the queue, and with searches
+// coming in fifty to one a billing run could wait forever. Works with
+// unique_lock and shared_lock. Don't take it shared twice on one thread -
+// a writer waiting in between would block the second one.
+class RWLock {
+private:
+    pthread_rwlock_t rw;
+    
+public:
+    RWLock() {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&rw, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+    ~RWLock() { pthread_rwlock_destroy(&rw); }
+    RWLock(const RWLock&) = delete;
+    RWLock& operator=(const RWLock&) = delete;
+    
+    void lock() { pthread_rwlock_wrlock(&rw); }
+    void unlock() { pthread_rwlock_unlock(&rw); }
+    void lock_shared() { pthread_rwlock_rdlock(&rw); }
+    void unlock_shared() { pthread_rwlock_unlock(&rw); }
+};
+
+// What a bill compaction pass did
+struct TieringStats {
+    long long billsMoved = 0;
+    size_t hotBytes = 0, coldBytes = 0;   // memory used by each tier afterwards
+    size_t usageBytes = 0;                // interval usage series (after old days are dropped)
+};
+
+// Usage that went into one interval of a customer's series
+struct IntervalUsage {
+    int64_t interval, units;
+    bool late = false;        // too late for the series (see UsageSeries::add)
+};
+
+// What a batch of readings actually added to a customer
+struct UsageAdded {
+    double total = 0;
+    double periods[MAX_PERIODS] = {};
+    vector<IntervalUsage> intervals;  // readings in a row for the same interval are put together
+};
+
+// How much of a customer's history renderDetails shows: a page of bills
+// and a page of maintenance, newest first, skipping 'offset' of each
+struct DetailPage {
+    size_t bills = 10, billOffset = 0;
+    size_t maintenance = 5, maintenanceOffset = 0;
+};
+
+// All our customers, stored column by column - row i of every array is one
+// customer. Billing, stats and reports only read the hot columns, which sit
+// next to each other in memory instead of being spread over big objects.
+//
+// Threads: rows are split into segments of SEGMENT_ROWS customers, each with
+// its own lock. Changing a customer locks their segment, reading one shares
+// it, so a search only waits on the few thousand rows billing is working on
+// right now. Adding rows can move the columns, so that holds 'layout'
+// exclusively and everything else holds it shared. Rows are never removed or
+// reordered, so a row number (and a Customer) stays good until clear().
+class CustomerStore {
+private:
+    map<string, int> provinceLookup;
+    
+    void addKnownProvinces() {
+        for (const char* name : PROVINCES) provinceIndex(name);
+    }
+    
+    // Every customer's bill and maintenance history is carved out of this
+    // pool. It grabs big chunks from the heap and hands out same-sized
+    // blocks from them, so years of monthly bills don't turn into millions
+    // of scattered little allocations. The synchronized version keeps a pool
+    // per thread, so parallel billing doesn't fight over one lock.
+    pmr::synchronized_pool_resource historyPool{pmr::pool_options{0, 64 * 1024}};
+    
+public:
+    // Hot columns
+    vector<int> id;
+    vector<uint8_t> province;         // province ID - index into provinceNames
+    vector<EnergyType> type;
+    vector<double> allocated, used;   // How much they're allowed to use & used so far
+    vector<double> owed;              // Running total of unpaid bills
+    vector<uint8_t> overdue;          // 1 if they have an overdue bill
+    vector<uint8_t> plan;             // rate plan (see RatePlanBook)
+    vector<double> periodUsed;        // this cycle's usage per plan period, MAX_PERIODS per customer
+    
+    // Cold data
+    vector<CustomerProfile> profile;
+    vector<UsageSeries> usage;        // interval history, kept across bills
+    vector<string> provinceNames;     // by province ID, PROVINCES first
+    
+    static const size_t SEGMENT_ROWS = 4096;
+    mutable RWLock layout;
+    mutable deque<RWLock> segments;
+    
+    CustomerStore() { addKnownProvinces(); }
+    
+    RWLock& segmentFor(size_t i) const { return segments[i / SEGMENT_ROWS]; }
+    
+    // Make sure every row has a segment lock (after the columns grew)
+    void growSegments() {
+        while (segments.size() * SEGMENT_ROWS < id.size()) segments.emplace_back();
+    }
+    
+    // Shared hold on one customer, for reading them from any thread
+    struct ReadLock {
+        shared_lock<RWLock> layout, segment;
+    };
+    ReadLock readRow(size_t i) const {
+        shared_lock<RWLock> l(layout);
+        return {move(l), shared_lock<RWLock>(segmentFor(i))};
+    }
+    
+    // Every segment shared, for a view of the whole store that no writer is
+    // halfway through. The caller already holds 'layout'.
+    vector<shared_lock<RWLock>> readAll() const {
+        vector<shared_lock<RWLock>> locks;
+        for (auto& s : segments) locks.emplace_back(s);
+        return locks;
+    }
+    
+    size_t size() const { return id.size(); }
+    
+    void clear() {
+        id.clear(); province.clear(); type.clear();
+        allocated.clear(); used.clear(); owed.clear(); overdue.clear();
+        plan.clear(); periodUsed.clear();
+        profile.clear(); usage.clear(); provinceNames.clear(); provinceLookup.clear();
+        segments.clear();
+        historyPool.release();
+        addKnownProvinces();
+    }
+    
+    // Make room for n customers up front so the columns don't keep regrowing
+    void reserve(size_t n) {
+        id.reserve(n); province.reserve(n); type.reserve(n);
+        allocated.reserve(n); used.reserve(n); owed.reserve(n); overdue.reserve(n);
+        plan.reserve(n); periodUsed.reserve(n * MAX_PERIODS);
+        profile.reserve(n); usage.reserve(n);
+    }
+    
+    // Empty profile and usage series whose histories use our pool
+    CustomerProfile newProfile() { return CustomerProfile(&historyPool); }
+    UsageSeries newSeries() { return UsageSeries(&historyPool); }
+    
+    // Small number for a province name, handing out a new one the first time we see it
+    int provinceIndex(const string& name) {
+        auto it = provinceLookup.find(name);
+        if (it != provinceLookup.end()) return it->second;
+        provinceNames.push_back(name);
+        return provinceLookup[name] = provinceNames.size() - 1;
+    }
+    
+    // ID of a province we already have - -1 if there's no such province
+    int findProvince(const string& name) const {
+        auto it = provinceLookup.find(name);
+        return it == provinceLookup.end() ? -1 : it->second;
+    }
+    
+    // Add a row for a new customer and return its index. The strings are
+    // moved out of 'info'.
+    int add(CustomerInfo&& info) {
+        id.push_back(info.id);
+        province.push_back(provinceIndex(info.province));
+        type.push_back(info.type);
+        allocated.push_back(info.allocated);
+        used.push_back(0);
+        owed.push_back(0);
+        overdue.push_back(0);
+        plan.push_back(0);
+        periodUsed.resize(periodUsed.size() + MAX_PERIODS);
+        
+        CustomerProfile& p = profile.emplace_back(&historyPool);
+        p.name = move(info.name);
+        p.email = move(info.email);
+        p.address = move(info.address);
+        usage.emplace_back(&historyPool);
+        growSegments();
+        return size() - 1;
+    }
+    
+    // Add n empty rows in one go for a bulk load and return the first one.
+    // The caller fills them in (rows don't share anything, so that can be
+    // done from several threads).
+    size_t grow(size_t n) {
+        size_t first = size();
+        reserve(first + n);
+        id.resize(first + n); province.resize(first + n); type.resize(first + n);
+        allocated.resize(first + n); used.resize(first + n); owed.resize(first + n);
+        overdue.resize(first + n); plan.resize(first + n);
+        periodUsed.resize((first + n) * MAX_PERIODS);
+        for (size_t k = 0; k < n; k++) {
+            profile.emplace_back(&historyPool);
+            usage.emplace_back(&historyPool);
+        }
+        growSegments();
+        return first;
+    }
+    
+    // Record a group of readings in one go. Each one is accepted if it still
+    // fits in what's left of the allocation, in order. periods[] and
+    // intervals[] say which plan period and series interval each reading
+    // falls in, and 'added' gets what went where. Returns how many readings
+    // were accepted.
+    int useEnergyBatch(int i, const double* amts, const uint8_t* periods, const int64_t* intervals,
+                       size_t n, UsageAdded& added) {
+        double room = allocated[i] - used[i];
+        int accepted = 0;
+        added.total = 0;
+        fill(begin(added.periods), end(added.periods), 0.0);
+        added.intervals.clear();
+        for (size_t k = 0; k < n; k++) {
+            if (amts[k] <= room - added.total) {
+                added.total += amts[k];
+                added.periods[periods[k]] += amts[k];
+                int64_t units = UsageSeries::toUnits(amts[k]);
+                auto& groups = added.intervals;
+                if (!groups.empty() && groups.back().interval == intervals[k]) groups.back().units += units;
+                else groups.push_back({intervals[k], units, false});
+                accepted++;
+            }
+        }
+        restoreUsage(i, added);
+        return accepted;
+    }
+    
+    // Apply usage that's already been checked against the allocation
+    // (useEnergyBatch, or log replay). Marks the intervals that came too
+    // late to go in the series.
+    void restoreUsage(int i, UsageAdded& added) {
+        used[i] += added.total;
+        for (int p = 0; p < MAX_PERIODS; p++)
+            periodUsed[i * MAX_PERIODS + p] += added.periods[p];
+        for (auto& g : added.intervals)
+            g.late = !usage[i].add(g.interval, g.units);
+    }
+    
+    // Bill the customer 'amount' for this cycle's usage (priced by RatePlanBook)
+    void createBill(int i, double amount, time_t when) {
+        auto& payments = profile[i].payments;
+        payments.push_back(Payment(amount, when));
+        payments.back().number = profile[i].billCount++;
+        owed[i] += payments.back().amount;
+        used[i] = 0; // Reset for next month
+        fill_n(periodUsed.begin() + i * MAX_PERIODS, MAX_PERIODS, 0.0);
+    }
+    
+    // An open or recent bill by its number - nullptr if there's no such
+    // bill or it's been moved to cold storage (only paid bills go there)
+    Payment* findBill(int i, int number) {
+        auto& payments = profile[i].payments;
+        auto it = lower_bound(payments.begin(), payments.end(), number,
+                              [](const Payment& p, int n) { return p.number < n; });
+        return it != payments.end() && it->number == number ? &*it : nullptr;
+    }
+    const Payment* findBill(int i, int number) const {
+        return const_cast<CustomerStore*>(this)->findBill(i, number);
+    }
+    
+    // Every bill the customer has had, oldest first, unpacking cold ones
+    vector<Payment> fullHistory(int i) const {
+        const CustomerProfile& p = profile[i];
+        vector<Payment> all;
+        all.reserve(p.billCount);
+        ColdBills::decode(p.coldBills, all);
+        size_t cold = all.size();
+        all.insert(all.end(), p.payments.begin(), p.payments.end());
+        inplace_merge(all.begin(), all.begin() + cold, all.end(),
+                      [](const Payment& a, const Payment& b) { return a.number < b.number; });
+        return all;
+    }
+    
+    // Pack paid bills dated before 'cutoff' into cold storage.
+    // Returns how many bills moved.
+    int compactHistory(int i, time_t cutoff) {
+        CustomerProfile& p = profile[i];
+        auto old = [&](const Payment& b) { return b.isPaid && b.date < cutoff; };
+        int moving = count_if(p.payments.begin(), p.payments.end(), old);
+        if (moving == 0) return 0;
+        
+        // Merge with what's already cold (a late payment can make an older bill eligible)
+        vector<Payment> cold;
+        cold.reserve(p.coldCount + moving);
+        ColdBills::decode(p.coldBills, cold);
+        size_t before = cold.size();
+        for (auto& b : p.payments)
+            if (old(b)) cold.push_back(b);
+        inplace_merge(cold.begin(), cold.begin() + before, cold.end(),
+                      [](const Payment& a, const Payment& b) { return a.number < b.number; });
+        ColdBills::encode(cold, p.coldBills);
+        p.coldBills.shrink_to_fit();
+        p.coldCount = cold.size();
+        
+        p.payments.erase(remove_if(p.payments.begin(), p.payments.end(), old), p.payments.end());
+        p.payments.shrink_to_fit();
+        return moving;
+    }
+    
+    // Banks pay in cents and bills aren't rounded, so a payment within
+    // half a cent of what's left pays the bill off
+    static constexpr double PAYMENT_SLACK = 0.005;
+    
+    // Put up to 'amt' towards one open bill. Returns how much it took.
+    double payBill(int i, Payment& bill, double amt) {
+        if (bill.isPaid || !(amt > 0)) return 0;
+        double left = bill.amount - bill.paid;
+        if (amt < left - PAYMENT_SLACK) {
+            bill.paid += amt;
+            owed[i] -= amt;
+            return amt;
+        }
+        CustomerProfile& p = profile[i];
+        owed[i] -= left;
+        bill.paid = bill.amount;
+        if (bill.isOverdue()) p.overdueBills--;
+        bill.isPaid = true;
+        p.reminderSent = false;
+        overdue[i] = p.overdueBills > 0;
+        return min(amt, left);
+    }
+    
+    // Process a payment for a specific bill - less than what's owed
+    // leaves it part paid
+    bool makePayment(int i, int index, double amt) {
+        Payment* found = findBill(i, index);
+        return found && payBill(i, *found, amt) > 0;
+    }
+    
+    // Put 'amt' towards the customer's open bills, oldest first. Counts
+    // the bills it paid off and sets 'partial' if it ran out partway
+    // through one. Returns what's left over.
+    double payOldestFirst(int i, double amt, int& billsPaid, bool& partial) {
+        for (Payment& bill : profile[i].payments) {
+            if (amt <= PAYMENT_SLACK) break;
+            if (bill.isPaid) continue;
+            amt -= payBill(i, bill, amt);
+            if (bill.isPaid) billsPaid++;
+            else partial = true;
+        }
+        return amt > PAYMENT_SLACK ? amt : 0;
+    }
+    
+    // Flag a bill as overdue - false if it was already paid or flagged
+    bool markOverdue(int i, int index) {
+        Payment* found = findBill(i, index);
+        if (!found || found->isPaid || found->overdue) return false;
+        Payment& bill = *found;
+        bill.overdue = true;
+        profile[i].overdueBills++;
+        overdue[i] = 1;
+        return true;
+    }
+    
+    // Add maintenance work to customer's record
+    void addMaintenance(int i, const string& desc, double cost, time_t when) {
+        profile[i].maintenance.push_back({when, desc, cost});
+    }
+    
+    // Write the reminder email for overdue bills into out. Returns false
+    // if the customer isn't overdue or already got one.
+    bool sendReminder(int i, time_t now, const ReminderTemplate& tmpl, string& out) {
+        CustomerProfile& p = profile[i];
+        if (!overdue[i] || p.reminderSent) return false;
+        p.reminderSent = true;
+        tmpl.render(out, p, now);
+        return true;
+    }
+    
+    // Write the customer's info into out: who they are, what they owe, then
+    // one page of bills and maintenance. Cold bills only get unpacked if
+    // the page reaches back to them. Returns true if there's older history
+    // past this page.
+    bool renderDetails(int i, time_t now, const DetailPage& page, DateCache& dates, string& out) const {
+        const CustomerProfile& p = profile[i];
+        char buf[64];
+        auto number = [&](double v) {
+            out.append(buf, to_chars(buf, buf + sizeof(buf), v, chars_format::fixed, 2).ptr - buf);
+        };
+        auto count = [&](long long v) { out.append(buf, to_chars(buf, buf + sizeof(buf), v).ptr - buf); };
+        
+        out += "--- Customer Info ---\nID: ";
+        count(id[i]);
+        out.append("\nName: ").append(p.name);
+        out.append("\nProvince: ").append(provinceNames[province[i]]);
+        out.append("\nEmail: ").append(p.email);
+        out.append("\nAddress: ").append(p.address);
+        out.append("\nEnergy Type: ").append(getEnergyName(type[i]));
+        out += "\nAllocation: ";
+        number(allocated[i]);
+        out += " units\nCurrent Usage: ";
+        number(used[i]);
+        out += " units\nRemaining: ";
+        number(allocated[i] - used[i]);
+        out += " units\n";
+        
+        // Only open bills can be unpaid, and they never go cold
+        size_t unpaid = count_if(p.payments.begin(), p.payments.end(), [](const Payment& b) { return !b.isPaid; });
+        out += "Owed: $";
+        number(owed[i]);
+        out += " (";
+        count(unpaid);
+        out += " unpaid, ";
+        count(p.overdueBills);
+        out += " overdue)\n\n";
+        
+        bool more = false;
+        size_t total = p.billCount;
+        size_t skip = min(page.billOffset, total), shown = min(page.bills, total - skip);
+        int hi = total - skip, lo = hi - shown;     // bill numbers on this page
+        if (total == 0) {
+            out += "No bills yet.\n";
+        } else if (shown > 0) {
+            auto byNumber = [](const Payment& b, int n) { return b.number < n; };
+            const Payment *first = nullptr, *last = nullptr;
+            auto from = lower_bound(p.payments.begin(), p.payments.end(), lo, byNumber);
+            auto to = lower_bound(from, p.payments.end(), hi, byNumber);
+            vector<Payment> history;
+            if (size_t(to - from) == shown) {
+                first = &*from;
+                last = first + shown;
+            } else {
+                history = fullHistory(i);
+                auto f = lower_bound(history.begin(), history.end(), lo, byNumber);
+                first = history.data() + (f - history.begin());
+                last = history.data() + (lower_bound(f, history.end(), hi, byNumber) - history.begin());
+            }
+            
+            out += "Payment History (";
+            count(shown);
+            out += " of ";
+            count(total);
+            out += ", newest first):\n";
+            for (const Payment* bill = last; bill-- != first;) {
+                out += "  Bill #";
+                count(bill->number + 1);
+                out += " (";
+                out += dates.format(bill->date);
+                out += "): $";
+                number(bill->amount);
+                out += bill->isPaid ? " - Paid" : " - Unpaid";
+                if (!bill->isPaid && bill->paid > 0) {
+                    out += " ($";
+                    number(bill->paid);
+                    out += " paid so far)";
+                }
+                out += " - ";
+                count(bill->getDaysSince(now));
+                out += " days ago";
+                if (bill->isOverdue()) out += " (OVERDUE!)";
+                out += '\n';
+            }
+            if (lo > 0) {
+                out += "  ... ";
+                count(lo);
+                out += " older bills\n";
+                more = true;
+            }
+        }
+        
+        size_t records = p.maintenance.size();
+        skip = min(page.maintenanceOffset, records);
+        shown = min(page.maintenance, records - skip);
+        if (shown > 0) {
+            out += "\nMaintenance Records (";
+            count(shown);
+            out += " of ";
+            count(records);
+            out += ", newest first):\n";
+            for (size_t k = records - skip; k-- > records - skip - shown;) {
+                const MaintRecord& m = p.maintenance[k];
+                out += "  ";
+                out += dates.format(m.date);
+                out.append(": ").append(m.desc).append(" - Cost: $");
+                number(m.cost);
+                out += '\n';
+            }
+            if (records - skip - shown > 0) {
+                out += "  ... ";
+                count(records - skip - shown);
+                out += " older records\n";
+                more = true;
+            }
+        }
+        out += '\n';
+        return more;
+    }
+};
+
+// Our customer class - a view of one row in the CustomerStore. It holds an
+// index rather than a pointer, so it's cheap to copy and stays valid when
+// the store grows. Every getter shares the row's lock, so it's fine to use
+// one from another thread while billing or ingestion is running.
+class Customer {
+private:
+    const CustomerStore* store = nullptr;
+    int row = -1;
+    
+public:
+    Customer() = default;
+    Customer(const CustomerStore* s, int r) : store(s), row(r) {}
+    
+    // False for a Customer that doesn't point at anyone (e.g. failed lookup)
+    explicit operator bool() const { return store != nullptr; }
+    
+    // Total amount owed across all unpaid bills
+    double getTotalOwed() const {
+        auto lock = store->readRow(row);
+        return store->owed[row];
+    }
+    
+    // Check if any bills are overdue
+    bool hasOverdue() const {
+        auto lock = store->readRow(row);
+        return store->overdue[row];
+    }
+    
+    // Customer info and a page of their history, written into out (see
+    // CustomerStore::renderDetails). True if there's older history.
+    bool renderDetails(string& out, DateCache& dates, const DetailPage& page = DetailPage(),
+                       time_t now = time(nullptr)) const {
+        auto lock = store->readRow(row);
+        return store->renderDetails(row, now, page, dates, out);
+    }
+    
+    // Same, straight to the console
+    void printDetails(time_t now = time(nullptr)) const {
+        string out;
+        DateCache dates;
+        renderDetails(out, dates, DetailPage(), now);
+        cout << out;
+    }
+    
+    // Various getters. Strings come back as copies - the profile they live
+    // in can move when customers are added.
+    int getIndex() const { return row; }
+    int getID() const {
+        auto lock = store->readRow(row);
+        return store->id[row];
+    }
+    string getName() const {
+        auto lock = store->readRow(row);
+        return store->profile[row].name;
+    }
+    string getEmail() const {
+        auto lock = store->readRow(row);
+        return store->profile[row].email;
+    }
+    string getAddress() const {
+        auto lock = store->readRow(row);
+        return store->profile[row].address;
+    }
+    string getProvince() const {
+        auto lock = store->readRow(row);
+        return store->provinceNames[store->province[row]];
+    }
+    int getProvinceId() const {
+        auto lock = store->readRow(row);
+        return store->province[row];
+    }
+    EnergyType getEnergyType() const {
+        auto lock = store->readRow(row);
+        return store->type[row];
+    }
+    int getBillCount() const {
+        auto lock = store->readRow(row);
+        return store->profile[row].billCount;
+    }
+    
+    // Bill by number - unpacks cold storage if it has to
+    Payment getBill(int index) const {
+        auto lock = store->readRow(row);
+        if (const Payment* p = store->findBill(row, index)) return *p;
+        return store->fullHistory(row).at(index);
+    }
+    vector<Payment> getBills() const {
+        auto lock = store->readRow(row);
+        return store->fullHistory(row);
+    }
+    double getUsed() const {
+        auto lock = store->readRow(row);
+        return store->used[row];
+    }
+    double getAllocated() const {
+        auto lock = store->readRow(row);
+        return store->allocated[row];
+    }
+    int getPlan() const {
+        auto lock = store->readRow(row);
+        return store->plan[row];
+    }
+};
+
+// Running totals for a province (or the whole system) so stats and reports
+// don't have to walk every bill of every customer.
+// Amounts are kept in millionths so adding and taking away values never
+// drifts the way doubles would.
+struct Totals {
+    int customers = 0;
+    long long allocated = 0, used = 0, unpaid = 0;
+    int overdueCustomers = 0;
+    long long overdueAmount = 0;   // unpaid total of customers that have an overdue bill
+    
+    static long long toFixed(double v) { return llround(v * 1e6); }
+    static double toDouble(long long v) { return v / 1e6; }
+    
+    void add(const Totals& o, int sign = 1) {
+        customers += sign * o.customers;
+        allocated += sign * o.allocated;
+        used += sign * o.used;
+        unpaid += sign * o.unpaid;
+        overdueCustomers += sign * o.overdueCustomers;
+        overdueAmount += sign * o.overdueAmount;
+    }
+    
+    bool operator==(const Totals& o) const {
+        return customers == o.customers && overdueCustomers == o.overdueCustomers &&
+               allocated == o.allocated && used == o.used &&
+               unpaid == o.unpaid && overdueAmount == o.overdueAmount;
+    }
+};
+
+// Everything the stats screen and the monthly report show, copied out in
+// one go so every number is from the same moment. A sharded setup adds
+// these up across its shards (see ShardRouter).
+struct SystemStats {
+    Totals overall;
+    map<string, Totals> provinces;
+    PerType<double> rates{};            // merge() keeps ours - every shard has the same
+    PerType<double> importsByType{}, exportsByType{};
+    
+    // Usage per UTC day from the interval series (thousandths of a unit),
+    // starting at day 'usageFromDay' - empty unless asked for
+    vector<long long> dailyUsage;
+    int64_t usageFromDay = 0;
+    bool changesOnly = false;           // a delta report - see changesSince
+    
+    void merge(const SystemStats& o) {
+        overall.add(o.overall);
+        if (dailyUsage.empty()) {
+            dailyUsage = o.dailyUsage;
+            usageFromDay = o.usageFromDay;
+        } else {
+            for (size_t d = 0; d < min(dailyUsage.size(), o.dailyUsage.size()); d++)
+                dailyUsage[d] += o.dailyUsage[d];
+        }
+        for (auto& [prov, t] : o.provinces) provinces[prov].add(t);
+        for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+            importsByType[t] += o.importsByType[t];
+            exportsByType[t] += o.exportsByType[t];
+        }
+    }
+};
+
+// The parts of 'now' worth putting in a delta report: overall, trades and
+// daily usage as always, but only the provinces whose totals moved since 'before'
+SystemStats changesSince(const SystemStats& now, const SystemStats& before) {
+    SystemStats out = now;
+    out.changesOnly = true;
+    out.provinces.clear();
+    for (auto& [prov, t] : now.provinces) {
+        auto it = before.provinces.find(prov);
+        if (it == before.provinces.end() || !(it->second == t)) out.provinces[prov] = t;
+    }
+    return out;
+}
+
+// Print general system statistics
+void printStats(const SystemStats& st, ostream& out) {
+    out << "+++ Energy Provider System Stats +++\n";
+    out << "Total Customers: " << st.overall.customers << "\n\n";
+    
+    // By province
+    out << "By Province:\n";
+    for (auto& [prov, t] : st.provinces)
+        out << "  " << prov << ": " << t.customers << " customers\n";
+    
+    // Energy rates
+    out << "\nEnergy Rates:\n";
+    for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++)
+        out << "  " << ENERGY_TYPES[t].name << ": $" 
+            << fixed << setprecision(2) << st.rates[t] << " per unit\n";
+    
+    // Overdue stats
+    int overdueCount = st.overall.overdueCustomers;
+    double overdueAmount = Totals::toDouble(st.overall.overdueAmount);
+    
+    out << "\nOverdue Payments:\n";
+    out << "  Customers with overdue bills: " << overdueCount 
+        << " (" << fixed << setprecision(1) 
+        << (static_cast<double>(overdueCount) / st.overall.customers * 100.0) 
+        << "%)\n";
+    out << "  Total overdue amount: $" << fixed << setprecision(2) << overdueAmount << "\n";
+    
+    // Import/Export numbers
+    double importTotal = 0, exportTotal = 0;
+    for (double v : st.importsByType) importTotal += v;
+    for (double v : st.exportsByType) exportTotal += v;
+    
+    out << "\nImport/Export:\n";
+    out << "  Total imports: $" << fixed << setprecision(2) << importTotal << "\n";
+    out << "  Total exports: $" << fixed << setprecision(2) << exportTotal << "\n";
+    out << "  Balance: $" << (importTotal - exportTotal) << "\n\n";
+}
+
+// Output file with a big buffer in front of it. Numbers are formatted
+// straight into the buffer with to_chars, and it only goes to the file a
+// megabyte at a time, so a report with a line per customer isn't millions
+// of little stream writes.
+class ReportBuffer {
+private:
+    int fd = -1;
+    vector<char> buf;
+    size_t used = 0;
+    uint64_t flushed = 0;       // bytes that have left the buffer
+    uint64_t written = 0;       // of those, the ones write() took
+    bool failed = false;
+
+    void flush() {
+        for (size_t done = 0; done < used && !failed;) {
+            ssize_t w = ::write(fd, buf.data() + done, used - done);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                failed = true;
+                break;
+            }
+            done += w;
+            written += w;
+        }
+        flushed += used;
+        used = 0;
+    }
+
+    // Room for at least n more bytes
+    char* room(size_t n) {
+        if (used + n > buf.size()) flush();
+        if (n > buf.size()) buf.resize(n);
+        return buf.data() + used;
+    }
+
+public:
+    explicit ReportBuffer(size_t size = 1 << 20) : buf(size) {}
+    ~ReportBuffer() { close(); }
+
+    bool open(const string& path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return fd >= 0;
+    }
+
+    void put(string_view s) {
+        if (s.size() > buf.size()) {
+            flush();
+            for (size_t k = 0; k < s.size(); k += buf.size())
+                put(s.substr(k, buf.size()));
+            return;
+        }
+        memcpy(room(s.size()), s.data(), s.size());
+        used += s.size();
+    }
+    void put(char c) {
+        *room(1) = c;
+        used++;
+    }
+    void putRaw(const void* data, size_t n) { put(string_view(static_cast<const char*>(data), n)); }
+
+    // 'precision' digits after the point, or the shortest exact form if it's
+    // negative (whole numbers without an exponent, so 3000000 not 3e+06)
+    void putNumber(double v, int precision = -1) {
+        if (precision < 0 && v == trunc(v) && fabs(v) < 1e15) {
+            putNumber((long long)v);
+            return;
+        }
+        char* p = room(400);   // fixed notation of a huge double runs to 300+ digits
+        auto r = precision < 0 ? to_chars(p, p + 400, v) : to_chars(p, p + 400, v, chars_format::fixed, precision);
+        used += r.ptr - p;
+    }
+    void putNumber(long long v) {
+        char* p = room(24);
+        used += to_chars(p, p + 24, v).ptr - p;
+    }
+    void putNumber(int v) { putNumber((long long)v); }
+
+    // Bytes handed to us so far (written or not)
+    uint64_t position() const { return flushed + used; }
+    
+    // Bytes that actually made it into the file
+    uint64_t bytesWritten() const { return written; }
+
+    // Get the rest onto the file - false if any write failed
+    bool close() {
+        if (fd < 0) return !failed;
+        flush();
+        if (::close(fd) != 0) failed = true;
+        fd = -1;
+        return !failed;
+    }
+};
+
+// One customer's line in a detailed report. The strings point into the
+// store, so they're only good inside the customerRow() call.
+struct CustomerRow {
+    int id;
+    string_view name, province, email;
+    EnergyType type;
+    int plan;
+    double allocated, used, owed;
+    bool overdue;
+    int bills;
+};
+
+// Turns a report into one file format. begin() gets the totals, then
+// customerRow() is called once per customer if the report has details
+// (streamed - nothing has to keep them), then end().
+class ReportWriter {
+protected:
+    ReportBuffer& out;
+
+public:
+    explicit ReportWriter(ReportBuffer& o) : out(o) {}
+    virtual ~ReportWriter() = default;
+    virtual void begin(const SystemStats& st, string_view month) = 0;
+    virtual void customerRow(const CustomerRow& row) = 0;
+    virtual void end() = 0;
+};
+
+enum class ReportFormat { TEXT, CSV, JSON, COLUMNAR };
+
+// Format from a file name's extension - text unless it's .csv, .json or .col
+ReportFormat reportFormatFor(const string& filename) {
+    auto ends = [&](const char* ext) {
+        size_t n = strlen(ext);
+        return filename.size() >= n && filename.compare(filename.size() - n, n, ext) == 0;
+    };
+    if (ends(".csv")) return ReportFormat::CSV;
+    if (ends(".json")) return ReportFormat::JSON;
+    if (ends(".col")) return ReportFormat::COLUMNAR;
+    return ReportFormat::TEXT;
+}
+
+// "YYYY-MM-DD" for a UTC day number
+string_view utcDayName(int64_t day, char (&buf)[16]) {
+    time_t t = day * 24 * 60 * 60;
+    tm utc;
+    gmtime_r(&t, &utc);
+    return string_view(buf, strftime(buf, sizeof(buf), "%Y-%m-%d", &utc));
+}
+
+// The report as people read it
+class TextReport : public ReportWriter {
+private:
+    bool detailsStarted = false;
+
+public:
+    using ReportWriter::ReportWriter;
+
+    void begin(const SystemStats& st, string_view month) override {
+        out.put("Energy Provider Monthly Report - ");
+        out.put(month);
+        out.put(st.changesOnly ? " (changes since the last report)\n\n" : "\n\n");
+
+        // Overall stats
+        int overdueCount = st.overall.overdueCustomers;
+        out.put("Overall Stats:\nTotal Customers: ");
+        out.putNumber(st.overall.customers);
+        out.put("\nTotal Unpaid: $");
+        out.putNumber(Totals::toDouble(st.overall.unpaid), 2);
+        out.put("\nOverdue Customers: ");
+        out.putNumber(overdueCount);
+        out.put(" (");
+        out.putNumber(overdueCount * 100.0 / st.overall.customers, 1);
+        out.put("%)\n\n");
+
+        // Province breakdown
+        out.put("Province Breakdown:\n");
+        if (st.changesOnly && st.provinces.empty()) out.put("  No changes\n\n");
+        for (auto& [prov, t] : st.provinces) {
+            double allocated = Totals::toDouble(t.allocated);
+            double used = Totals::toDouble(t.used);
+            out.put(prov);
+            out.put(":\n  Customers: ");
+            out.putNumber(t.customers);
+            out.put("\n  Energy Allocated: ");
+            out.putNumber(allocated, 2);
+            out.put(" units\n  Energy Used: ");
+            out.putNumber(used, 2);
+            out.put(" (");
+            out.putNumber(used / allocated * 100, 2);
+            out.put("%)\n  Unpaid Bills: $");
+            out.putNumber(Totals::toDouble(t.unpaid), 2);
+            out.put("\n  Overdue: ");
+            out.putNumber(t.overdueCustomers);
+            out.put(" (");
+            out.putNumber(t.overdueCustomers * 100.0 / t.customers, 2);
+            out.put("%)\n\n");
+        }
+
+        // Import/Export summary
+        double imports = 0, exports = 0;
+        for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+            imports += st.importsByType[t];
+            exports += st.exportsByType[t];
+        }
+        out.put("Import/Export Summary:\nTotal Imports: $");
+        out.putNumber(imports, 2);
+        out.put("\nTotal Exports: $");
+        out.putNumber(exports, 2);
+        out.put("\nNet Balance: $");
+        out.putNumber(imports - exports, 2);
+        out.put("\n\n");
+
+        // Trade values are always positive, so 0 means no trades of that type
+        auto byType = [&](const char* title, const PerType<double>& values) {
+            out.put(title);
+            for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+                if (values[t] == 0) continue;
+                out.put("  ");
+                out.put(ENERGY_TYPES[t].name);
+                out.put(": $");
+                out.putNumber(values[t], 2);
+                out.put('\n');
+            }
+        };
+        byType("Imports by Type:\n", st.importsByType);
+        byType("\nExports by Type:\n", st.exportsByType);
+
+        if (!st.dailyUsage.empty()) {
+            out.put("\nDaily Usage (UTC):\n");
+            char day[16];
+            for (size_t d = 0; d < st.dailyUsage.size(); d++) {
+                out.put("  ");
+                out.put(utcDayName(st.usageFromDay + d, day));
+                out.put(": ");
+                out.putNumber(UsageSeries::toAmount(st.dailyUsage[d]), 2);
+                out.put(" units\n");
+            }
+        }
+    }
+
+    void customerRow(const CustomerRow& r) override {
+        if (!detailsStarted) {
+            out.put("\nCustomer Details:\n");
+            detailsStarted = true;
+        }
+        out.put("  ");
+        out.putNumber(r.id);
+        out.put(": ");
+        out.put(r.name);
+        out.put(" (");
+        out.put(r.province);
+        out.put(") - ");
+        out.put(getEnergyName(r.type));
+        out.put(" - Used ");
+        out.putNumber(r.used, 2);
+        out.put(" of ");
+        out.putNumber(r.allocated, 2);
+        out.put(" units - Owes $");
+        out.putNumber(r.owed, 2);
+        out.put(r.overdue ? " (OVERDUE!)\n" : "\n");
+    }
+
+    void end() override { out.put("\n--- End of Report ---\n"); }
+};
+
+// Several tables one after the other, each with its own header line and a
+// blank line in between
+class CsvReport : public ReportWriter {
+private:
+    bool detailsStarted = false;
+
+    void field(string_view s) {
+        if (s.find_first_of(",\"\n") == string_view::npos) {
+            out.put(s);
+            return;
+        }
+        out.put('"');
+        for (char c : s) {
+            if (c == '"') out.put('"');
+            out.put(c);
+        }
+        out.put('"');
+    }
+
+    void totalsRow(string_view section, string_view name, const Totals& t) {
+        out.put(section);
+        out.put(',');
+        field(name);
+        out.put(',');
+        out.putNumber(t.customers);
+        for (long long v : {t.allocated, t.used, t.unpaid}) {
+            out.put(',');
+            out.putNumber(Totals::toDouble(v));
+        }
+        out.put(',');
+        out.putNumber(t.overdueCustomers);
+        out.put(',');
+        out.putNumber(Totals::toDouble(t.overdueAmount));
+        out.put('\n');
+    }
+
+public:
+    using ReportWriter::ReportWriter;
+
+    void begin(const SystemStats& st, string_view month) override {
+        out.put("month,changes_only\n");
+        field(month);
+        out.put(st.changesOnly ? ",1" : ",0");
+        out.put("\n\nsection,name,customers,allocated,used,unpaid,overdue_customers,overdue_amount\n");
+        totalsRow("overall", "", st.overall);
+        for (auto& [prov, t] : st.provinces) totalsRow("province", prov, t);
+
+        out.put("\nenergy_type,imports,exports\n");
+        for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+            out.put(ENERGY_TYPES[t].name);
+            out.put(',');
+            out.putNumber(st.importsByType[t]);
+            out.put(',');
+            out.putNumber(st.exportsByType[t]);
+            out.put('\n');
+        }
+
+        if (!st.dailyUsage.empty()) {
+            out.put("\nday,usage\n");
+            char day[16];
+            for (size_t d = 0; d < st.dailyUsage.size(); d++) {
+                out.put(utcDayName(st.usageFromDay + d, day));
+                out.put(',');
+                out.putNumber(UsageSeries::toAmount(st.dailyUsage[d]));
+                out.put('\n');
+            }
+        }
+    }
+
+    void customerRow(const CustomerRow& r) override {
+        if (!detailsStarted) {
+            out.put("\nid,name,province,email,energy_type,plan,allocated,used,owed,overdue,bills\n");
+            detailsStarted = true;
+        }
+        out.putNumber(r.id);
+        out.put(',');
+        field(r.name);
+        out.put(',');
+        field(r.province);
+        out.put(',');
+        field(r.email);
+        out.put(',');
+        out.put(getEnergyName(r.type));
+        out.put(',');
+        out.putNumber(r.plan);
+        for (double v : {r.allocated, r.used, r.owed}) {
+            out.put(',');
+            out.putNumber(v);
+        }
+        out.put(r.overdue ? ",1," : ",0,");
+        out.putNumber(r.bills);
+        out.put('\n');
+    }
+
+    void end() override {}
+};
+
+// One JSON object. Customers go in a "customers" array at the end, one per line.
+class JsonReport : public ReportWriter {
+private:
+    bool firstRow = true;
+
+    void str(string_view s) {
+        out.put('"');
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out.put('\\');
+                out.put(c);
+            } else if ((unsigned char)c < 0x20) {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                out.put(esc);
+            } else {
+                out.put(c);
+            }
+        }
+        out.put('"');
+    }
+
+    void key(string_view k) {
+        str(k);
+        out.put(':');
+    }
+
+    // JSON has no inf or nan
+    void num(double v) {
+        if (isfinite(v)) out.putNumber(v);
+        else out.put("null");
+    }
+
+    void totals(const Totals& t) {
+        out.put('{');
+        key("customers");
+        out.putNumber(t.customers);
+        out.put(',');
+        key("allocated");
+        num(Totals::toDouble(t.allocated));
+        out.put(',');
+        key("used");
+        num(Totals::toDouble(t.used));
+        out.put(',');
+        key("unpaid");
+        num(Totals::toDouble(t.unpaid));
+        out.put(',');
+        key("overdueCustomers");
+        out.putNumber(t.overdueCustomers);
+        out.put(',');
+        key("overdueAmount");
+        num(Totals::toDouble(t.overdueAmount));
+        out.put('}');
+    }
+
+public:
+    using ReportWriter::ReportWriter;
+
+    void begin(const SystemStats& st, string_view month) override {
+        out.put("{\n");
+        key("month");
+        str(month);
+        out.put(",\n");
+        key("changesOnly");
+        out.put(st.changesOnly ? "true,\n" : "false,\n");
+        key("overall");
+        totals(st.overall);
+        out.put(",\n");
+        key("provinces");
+        out.put('{');
+        bool first = true;
+        for (auto& [prov, t] : st.provinces) {
+            out.put(first ? "\n" : ",\n");
+            first = false;
+            key(prov);
+            totals(t);
+        }
+        out.put("},\n");
+
+        for (auto [name, values] : {pair{"imports", &st.importsByType}, pair{"exports", &st.exportsByType}}) {
+            key(name);
+            out.put('{');
+            for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+                if (t) out.put(',');
+                key(ENERGY_TYPES[t].name);
+                num((*values)[t]);
+            }
+            out.put("},\n");
+        }
+
+        key("dailyUsage");
+        out.put('[');
+        char day[16];
+        for (size_t d = 0; d < st.dailyUsage.size(); d++) {
+            out.put(d ? ",\n" : "\n");
+            out.put('{');
+            key("day");
+            str(utcDayName(st.usageFromDay + d, day));
+            out.put(',');
+            key("usage");
+            num(UsageSeries::toAmount(st.dailyUsage[d]));
+            out.put('}');
+        }
+        out.put("],\n");
+        key("customers");
+        out.put('[');
+    }
+
+    void customerRow(const CustomerRow& r) override {
+        out.put(firstRow ? "\n{" : ",\n{");
+        firstRow = false;
+        key("id");
+        out.putNumber(r.id);
+        out.put(',');
+        key("name");
+        str(r.name);
+        out.put(',');
+        key("province");
+        str(r.province);
+        out.put(',');
+        key("email");
+        str(r.email);
+        out.put(',');
+        key("energyType");
+        str(getEnergyName(r.type));
+        out.put(',');
+        key("plan");
+        out.putNumber(r.plan);
+        out.put(',');
+        key("allocated");
+        num(r.allocated);
+        out.put(',');
+        key("used");
+        num(r.used);
+        out.put(',');
+        key("owed");
+        num(r.owed);
+        out.put(',');
+        key("overdue");
+        out.put(r.overdue ? "true" : "false");
+        out.put(',');
+        key("bills");
+        out.putNumber(r.bills);
+        out.put('}');
+    }
+
+    void end() override { out.put("\n]\n}\n"); }
+};
+
+// Binary tables stored column by column, in the spirit of Parquet. The file
+// is "EPCOLS01", then row groups, then a footer:
+//   group:  uint32 table, uint32 rows, uint32 columns, then per column
+//           uint8 kind, uint8 name length, name, uint64 bytes, data
+//   footer: uint32 groups, per group {uint32 table, uint64 offset},
+//           uint8 flags (1 = changes only), uint8 length + month,
+//           uint64 footer offset, "EPCOLS01"
+// Kinds: int32, uint8, double (native byte order), and strings as
+// (rows + 1) uint32 offsets and then the bytes. Tables: 0 totals (first row
+// is everyone, with an empty name, then each province), 1 trades by energy
+// type, 2 daily usage, 3 customers. Customers are written ROW_GROUP rows at
+// a time, so only one group is ever held in memory.
+class ColumnarReport : public ReportWriter {
+public:
+    static constexpr char MAGIC[8] = {'E', 'P', 'C', 'O', 'L', 'S', '0', '1'};
+    static const uint32_t ROW_GROUP = 64 * 1024;
+    enum Kind : uint8_t { INT32, UINT8, DOUBLE, STRING };
+    enum Table : uint32_t { TOTALS, TRADES, DAILY_USAGE, CUSTOMERS };
+
+private:
+    struct Column {
+        string name;
+        Kind kind;
+        string data;
+        vector<uint32_t> offsets{0};   // strings only
+
+        template <typename T> void add(T v) { data.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+        void addString(string_view s) {
+            data.append(s);
+            offsets.push_back(data.size());
+        }
+    };
+
+    struct Group {
+        uint32_t table;
+        uint64_t offset;
+    };
+
+    vector<Group> groups;
+    string month;
+    bool changesOnly = false;
+    vector<Column> customers;
+    uint32_t customerRows = 0;
+
+    static vector<Column> columns(initializer_list<pair<const char*, Kind>> spec) {
+        vector<Column> cols;
+        for (auto& [name, kind] : spec) cols.push_back({name, kind, "", {0}});
+        return cols;
+    }
+
+    void writeGroup(uint32_t table, vector<Column>& cols, uint32_t rows) {
+        groups.push_back({table, out.position()});
+        uint32_t head[3] = {table, rows, uint32_t(cols.size())};
+        out.putRaw(head, sizeof(head));
+        for (auto& c : cols) {
+            out.put(char(c.kind));
+            out.put(char(c.name.size()));
+            out.put(c.name);
+            uint64_t bytes = c.data.size() + (c.kind == STRING ? c.offsets.size() * sizeof(uint32_t) : 0);
+            out.putRaw(&bytes, sizeof(bytes));
+            if (c.kind == STRING) out.putRaw(c.offsets.data(), c.offsets.size() * sizeof(uint32_t));
+            out.put(c.data);
+            c.data.clear();
+            c.offsets.assign(1, 0);
+        }
+    }
+
+public:
+    using ReportWriter::ReportWriter;
+
+    void begin(const SystemStats& st, string_view m) override {
+        month = string(m);
+        changesOnly = st.changesOnly;
+        out.putRaw(MAGIC, sizeof(MAGIC));
+
+        auto totals = columns({{"name", STRING}, {"customers", INT32}, {"allocated", DOUBLE}, {"used", DOUBLE},
+                               {"unpaid", DOUBLE}, {"overdue_customers", INT32}, {"overdue_amount", DOUBLE}});
+        auto addTotals = [&](string_view name, const Totals& t) {
+            totals[0].addString(name);
+            totals[1].add<int32_t>(t.customers);
+            totals[2].add(Totals::toDouble(t.allocated));
+            totals[3].add(Totals::toDouble(t.used));
+            totals[4].add(Totals::toDouble(t.unpaid));
+            totals[5].add<int32_t>(t.overdueCustomers);
+            totals[6].add(Totals::toDouble(t.overdueAmount));
+        };
+        addTotals("", st.overall);
+        for (auto& [prov, t] : st.provinces) addTotals(prov, t);
+        writeGroup(TOTALS, totals, st.provinces.size() + 1);
+
+        auto trades = columns({{"energy_type", STRING}, {"imports", DOUBLE}, {"exports", DOUBLE}});
+        for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+            trades[0].addString(ENERGY_TYPES[t].name);
+            trades[1].add(st.importsByType[t]);
+            trades[2].add(st.exportsByType[t]);
+        }
+        writeGroup(TRADES, trades, ENERGY_TYPE_COUNT);
+
+        auto daily = columns({{"day", INT32}, {"usage", DOUBLE}});
+        for (size_t d = 0; d < st.dailyUsage.size(); d++) {
+            daily[0].add<int32_t>(st.usageFromDay + d);
+            daily[1].add(UsageSeries::toAmount(st.dailyUsage[d]));
+        }
+        writeGroup(DAILY_USAGE, daily, st.dailyUsage.size());
+
+        customers = columns({{"id", INT32}, {"name", STRING}, {"province", STRING}, {"email", STRING},
+                             {"energy_type", UINT8}, {"plan", UINT8}, {"allocated", DOUBLE}, {"used", DOUBLE},
+                             {"owed", DOUBLE}, {"overdue", UINT8}, {"bills", INT32}});
+    }
+
+    void customerRow(const CustomerRow& r) override {
+        customers[0].add<int32_t>(r.id);
+        customers[1].addString(r.name);
+        customers[2].addString(r.province);
+        customers[3].addString(r.email);
+        customers[4].add<uint8_t>(static_cast<uint8_t>(r.type));
+        customers[5].add<uint8_t>(r.plan);
+        customers[6].add(r.allocated);
+        customers[7].add(r.used);
+        customers[8].add(r.owed);
+        customers[9].add<uint8_t>(r.overdue);
+        customers[10].add<int32_t>(r.bills);
+        if (++customerRows == ROW_GROUP) {
+            writeGroup(CUSTOMERS, customers, customerRows);
+            customerRows = 0;
+        }
+    }
+
+    void end() override {
+        if (customerRows > 0) writeGroup(CUSTOMERS, customers, customerRows);
+        uint64_t footer = out.position();
+        uint32_t count = groups.size();
+        out.putRaw(&count, sizeof(count));
+        for (auto& g : groups) {
+            out.putRaw(&g.table, sizeof(g.table));
+            out.putRaw(&g.offset, sizeof(g.offset));
+        }
+        out.put(char(changesOnly));
+        out.put(char(min<size_t>(month.size(), 255)));
+        out.put(string_view(month).substr(0, 255));
+        out.putRaw(&footer, sizeof(footer));
+        out.putRaw(MAGIC, sizeof(MAGIC));
+    }
+};
+
+unique_ptr<ReportWriter> makeReportWriter(ReportFormat format, ReportBuffer& out) {
+    switch (format) {
+        case ReportFormat::CSV:      return make_unique<CsvReport>(out);
+        case ReportFormat::JSON:     return make_unique<JsonReport>(out);
+        case ReportFormat::COLUMNAR: return make_unique<ColumnarReport>(out);
+        default:                     return make_unique<TextReport>(out);
+    }
+}
+
+// Write the monthly report file - false if it couldn't be written.
+// 'rows' (if given) streams the per-customer details into the writer.
+bool writeMonthlyReport(const SystemStats& st, const string& filename,
+                        ReportFormat format = ReportFormat::TEXT,
+                        const function<void(ReportWriter&)>& rows = nullptr) {
+    MetricTimer timer(Timing::REPORT);
+    ReportBuffer out;
+    if (!out.open(filename)) {
+        cerr << "Couldn't open report file: " << filename << endl;
+        return false;
+    }
+
+    // Current date for the report
+    time_t now = time(nullptr);
+    tm local;
+    localtime_r(&now, &local);
+    char dateBuffer[80];
+    string_view month(dateBuffer, strftime(dateBuffer, sizeof(dateBuffer), "%B %Y", &local));
+
+    unique_ptr<ReportWriter> writer = makeReportWriter(format, out);
+    writer->begin(st, month);
+    if (rows) rows(*writer);
+    writer->end();
+    bool ok = out.close();
+    metrics().add(Counter::REPORTS);
+    metrics().add(Counter::REPORT_BYTES, out.bytesWritten());
+    if (!ok) {
+        cerr << "Couldn't write report file: " << filename << endl;
+        return false;
+    }
+
+    cout << "Report saved to " << filename << endl;
+    return true;
+}
+
+// Trigram index over each customer's name, email and ID. A substring search
+// only has to check customers that contain every 3-letter piece of the query,
+// so the cost follows the number of matches instead of the customer count.
+class SearchIndex {
+private:
+    unordered_map<uint32_t, vector<int>> postings;  // trigram -> customer indices, ascending
+    
+    static uint32_t gram(const char* p) {
+        return (uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 | (unsigned char)p[2];
+    }
+    
+    static void addGrams(const string& text, vector<uint32_t>& out) {
+        for (size_t i = 0; i + 3 <= text.size(); i++)
+            out.push_back(gram(text.data() + i));
+    }
+    
+public:
+    // Queries shorter than this can't use the index
+    static const size_t MIN_QUERY = 3;
+    
+    // Customers must be added in index order so the lists stay sorted
+    void add(int idx, const string& name, const string& email, int id) {
+        vector<uint32_t> grams;
+        addGrams(name, grams);
+        addGrams(email, grams);
+        addGrams(to_string(id), grams);
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        
+        for (uint32_t g : grams)
+            postings[g].push_back(idx);
+    }
+    
+    void clear() { postings.clear(); }
+    
+    // Customers that contain every trigram of the query, in index order.
+    // These still have to be checked - the trigrams could be in different fields.
+    // 'within' (ascending, like a province's rows) narrows it down further.
+    vector<int> candidates(const string& query, const vector<int>* within = nullptr) const {
+        vector<uint32_t> grams;
+        addGrams(query, grams);
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        
+        vector<const vector<int>*> lists;
+        for (uint32_t g : grams) {
+            auto it = postings.find(g);
+            if (it == postings.end()) return {};
+            lists.push_back(&it->second);
+        }
+        if (lists.empty()) return {};
+        if (within) lists.push_back(within);
+        
+        // Start from the shortest list and binary search the others
+        sort(lists.begin(), lists.end(), [](auto* a, auto* b) { return a->size() < b->size(); });
+        vector<int> result;
+        for (int idx : *lists[0]) {
+            bool inAll = true;
+            for (size_t i = 1; i < lists.size() && inAll; i++)
+                inAll = binary_search(lists[i]->begin(), lists[i]->end(), idx);
+            if (inAll) result.push_back(idx);
+        }
+        return result;
+    }
+};
+
+// Binary snapshot file layout. A header (with a table of sections) is
+// followed by the sections themselves, each starting on an 8 byte boundary.
+// Every section is a flat array, so loading is a handful of big copies out
+// of the memory-mapped file instead of parsing record by record.
+// Numbers are stored in the machine's own byte order - the header has a
+// marker so a file from a different kind of machine gets rejected.
+namespace snapshot {
+    const char MAGIC[8] = {'E', 'P', 'S', 'N', 'A', 'P', '\0', '\0'};
+    const uint32_t VERSION = 6;
+    const uint32_t ENDIAN_MARK = 0x01020304;
+    
+    enum Section {
+        IDS,            // int32 per customer
+        PROVINCE,       // uint8 per customer
+        TYPE,           // uint8 per customer
+        ALLOCATED,      // double per customer
+        USED,           // double per customer
+        OWED,           // double per customer
+        OVERDUE,        // uint8 per customer
+        REMINDER_SENT,  // uint8 per customer
+        OVERDUE_BILLS,  // int32 per customer
+        PAYMENT_START,  // uint64 per customer + 1, index into PAYMENTS
+        MAINT_START,    // uint64 per customer + 1, index into MAINT
+        PAYMENTS,       // PaymentRecord, all customers back to back
+        MAINT,          // MaintRecordData, all customers back to back
+        STRING_START,   // uint64 per string + 1, offsets into STRING_DATA
+        STRING_DATA,    // all strings back to back
+        RATES,          // double per energy type
+        TRADES,         // TradeRecord
+        PLAN,           // uint8 per customer
+        PERIOD_USED,    // double per customer per plan period (MAX_PERIODS)
+        USAGE_STATE,    // UsageSeries::State per customer
+        USAGE_BLOCK_START, // uint64 per customer + 1, index into USAGE_BLOCKS
+        USAGE_BLOCKS,   // UsageSeries::Block, all customers back to back
+        USAGE_DATA_START,  // uint64 per customer + 1, offsets into USAGE_DATA
+        USAGE_DATA,     // packed interval bits, all customers back to back
+        WORK_ORDERS,    // WorkOrderRecord, by number
+        SECTION_COUNT
+    };
+    
+    struct SectionInfo { uint64_t offset, bytes; };
+    
+    // String table order: name/email/address for each customer, then the
+    // province names, then maintenance descriptions, then work order tasks
+    struct Header {
+        char magic[8];
+        uint32_t version, byteOrder;
+        uint64_t customers, provinces, payments, maint, strings, trades;
+        uint64_t usageBlocks, usageBytes, workOrders;
+        uint64_t logSeq;            // last write-ahead log record the snapshot has in it
+        SectionInfo sections[SECTION_COUNT];
+    };
+    
+    struct PaymentRecord {
+        double amount;
+        int64_t date;
+        double paid;
+        uint8_t isPaid, overdue, pad[6];
+    };
+    
+    struct MaintRecordData {
+        int64_t date;
+        double cost;
+        uint64_t desc;   // string table index
+    };
+    
+    struct TradeRecord {
+        double quantity, price;
+        int64_t date;
+        uint8_t type, isImport, pad[6];
+    };
+    
+    struct WorkOrderRecord {
+        int64_t due, finished;
+        double cost;
+        uint64_t task;   // string table index
+        int32_t number, customerId;
+        uint8_t province, priority, status, pad[5];
+    };
+}
+
+// Numbers from the write-ahead log, for sizing the latency budget
+struct LogStats {
+    uint64_t records = 0, bytes = 0, syncs = 0;
+    uint64_t failures = 0;           // times a write or fsync failed (nothing after that is durable until a snapshot)
+    double totalSyncMs = 0, maxSyncMs = 0;
+    double seconds = 0;              // since the log was opened
+    
+    double recordsPerSec() const { return seconds > 0 ? records / seconds : 0; }
+    double recordsPerSync() const { return syncs ? double(records) / syncs : 0; }
+    double avgSyncMs() const { return syncs ? totalSyncMs / syncs : 0; }
+};
+
+// Standard CRC-32 so replay can tell a half-written record from a good one
+uint32_t crc32(const char* data, size_t n) {
+    static const auto table = [] {
+        array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t c = 0xFFFFFFFF;
+    for (size_t i = 0; i < n; i++)
+        c = table[(c ^ (unsigned char)data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+// Append-only log of every change to the system, so nothing is lost between
+// snapshots. Each record is [length][crc][type][payload].
+// Records go into a memory buffer and a background thread writes and fsyncs
+// them in groups - at most 'budget' after the first one arrived - so lots
+// of records share one fsync. Callers that need to know a record is on disk
+// (payments) wait on the sequence number append() gives back.
+class WriteAheadLog {
+private:
+    int fd = -1;
+    string pending;                   // records not written yet
+    uint64_t appendedSeq = 0, durableSeq = 0;
+    uint64_t takenSeq = 0;            // last record the flusher has taken (written or dropped)
+    bool writing = false;             // flusher has a batch out
+    chrono::microseconds budget{2000};
+    size_t maxPending = 1 << 20;      // write early if this much piles up
+    bool stopping = false, flushNow = false;
+    bool failed = false;              // sticky - once a write is lost, later records can't be replayed
+    mutex m;
+    condition_variable wake, durable;
+    thread flusher;
+    LogStats stats;
+    chrono::steady_clock::time_point opened;
+    
+    void flushLoop() {
+        unique_lock<mutex> lock(m);
+        while (true) {
+            wake.wait(lock, [&] { return !pending.empty() || stopping; });
+            if (pending.empty() && stopping) break;
+            
+            // Give other records a chance to join this group
+            wake.wait_for(lock, budget, [&] { return stopping || flushNow || pending.size() >= maxPending; });
+            flushNow = false;
+            
+            string batch;
+            batch.swap(pending);
+            uint64_t seq = takenSeq = appendedSeq;
+            writing = true;
+            lock.unlock();
+            
+            // Replay stops at the first bad record, so after a failure
+            // there's no point writing more
+            bool ok = !failed;
+            auto start = chrono::steady_clock::now();
+            for (size_t done = 0; ok && done < batch.size();) {
+                ssize_t w = ::write(fd, batch.data() + done, batch.size() - done);
+                if (w < 0) {
+                    if (errno == EINTR) continue;
+                    cerr << "Write-ahead log write failed: " << strerror(errno) << "\n";
+                    ok = false;
+                } else {
+                    done += w;
+                }
+            }
+            if (ok && fdatasync(fd) != 0) {
+                cerr << "Write-ahead log fsync failed: " << strerror(errno) << "\n";
+                ok = false;
+            }
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            
+            lock.lock();
+            writing = false;
+            if (ok) {
+                durableSeq = seq;
+                stats.syncs++;
+                stats.totalSyncMs += ms;
+                stats.maxSyncMs = max(stats.maxSyncMs, ms);
+            } else if (!failed) {
+                failed = true;
+                stats.failures++;
+            }
+            durable.notify_all();
+        }
+    }
+    
+public:
+    // Record types
+    enum Type : uint8_t { ADD_CUSTOMER = 1, USAGE, BILL, PAYMENT, MAINTENANCE, TRADE, BILLING_RUN, SET_PLAN,
+                        USAGE_BATCH, GENERATE, PAYMENT_BATCH, TRADE_BATCH, WORK_ORDER, WORK_ORDER_DONE,
+                        WORK_ORDER_CANCEL, BILLING_CHUNK, LOG_START };
+    
+    // Every log file starts with a LOG_START record holding the sequence
+    // number of the record after it, so numbers keep going up through
+    // truncates and restarts and a snapshot can say how far into the log it
+    // got. (Logs from before don't have one and start at 1.)
+    static const size_t START_BYTES = 8 + 1 + sizeof(uint64_t);
+    
+    ~WriteAheadLog() { close(); }
+    
+    // Open (or create) the log for appending. 'lastSeq' is the newest record
+    // already applied (from replay or the snapshot) - new ones follow it.
+    bool open(const string& path, chrono::microseconds latencyBudget, uint64_t lastSeq = 0) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            cerr << "Couldn't open write-ahead log: " << path << endl;
+            return false;
+        }
+        appendedSeq = durableSeq = takenSeq = lastSeq;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (st.st_size == 0 && !writeStart(lastSeq + 1))) {
+            cerr << "Couldn't start write-ahead log: " << path << endl;
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        budget = latencyBudget;
+        stopping = false;
+        failed = false;
+        opened = chrono::steady_clock::now();
+        flusher = thread(&WriteAheadLog::flushLoop, this);
+        return true;
+    }
+    
+    bool isOpen() const { return fd >= 0; }
+    
+    // Length, CRC, type, payload
+    static string record(Type type, const string& payload) {
+        uint32_t len = payload.size() + 1;
+        string rec(8, '\0');
+        rec += char(type);
+        rec += payload;
+        uint32_t crc = crc32(rec.data() + 8, len);
+        memcpy(&rec[0], &len, 4);
+        memcpy(&rec[4], &crc, 4);
+        return rec;
+    }
+    
+    // Write the LOG_START record straight to disk - only while the flusher
+    // isn't (before it starts, or under 'm' with nothing being written)
+    bool writeStart(uint64_t firstSeq) {
+        string rec = record(LOG_START, string(reinterpret_cast<const char*>(&firstSeq), sizeof(firstSeq)));
+        for (size_t done = 0; done < rec.size();) {
+            ssize_t w = ::write(fd, rec.data() + done, rec.size() - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return false;
+            done += w;
+        }
+        return fdatasync(fd) == 0;
+    }
+    
+    // Add a record - returns its sequence number for waitDurable
+    uint64_t append(Type type, const string& payload) {
+        string rec = record(type, payload);
+        
+        lock_guard<mutex> lock(m);
+        pending += rec;
+        stats.records++;
+        stats.bytes += rec.size();
+        wake.notify_one();
+        return ++appendedSeq;
+    }
+    
+    // Block until record 'seq' (and everything before it) is on disk -
+    // false if it never will be, because the log failed to write it
+    bool waitDurable(uint64_t seq) {
+        unique_lock<mutex> lock(m);
+        durable.wait(lock, [&] { return durableSeq >= seq || failed || fd < 0; });
+        return durableSeq >= seq;
+    }
+    
+    // Get everything appended so far onto disk now
+    bool flush() {
+        uint64_t seq;
+        {
+            lock_guard<mutex> lock(m);
+            seq = appendedSeq;
+            flushNow = true;
+            wake.notify_one();
+        }
+        return waitDurable(seq);
+    }
+    
+    // Newest record handed to us - what a snapshot taken now has in it
+    uint64_t lastSeq() {
+        lock_guard<mutex> lock(m);
+        return appendedSeq;
+    }
+    
+    // Start the log over - used once a snapshot holds everything in it, so
+    // a log that had failed is good again. Anything still waiting to be
+    // written goes in after the new LOG_START.
+    bool truncate() {
+        flush();
+        unique_lock<mutex> lock(m);
+        durable.wait(lock, [&] { return !writing; });
+        if (ftruncate(fd, 0) != 0 || !writeStart(takenSeq + 1)) return false;
+        failed = false;
+        return true;
+    }
+    
+    void close() {
+        if (fd < 0) return;
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+            wake.notify_one();
+        }
+        flusher.join();
+        ::close(fd);
+        fd = -1;
+        durable.notify_all();
+    }
+    
+    LogStats getStats() {
+        lock_guard<mutex> lock(m);
+        LogStats s = stats;
+        s.seconds = chrono::duration<double>(chrono::steady_clock::now() - opened).count();
+        return s;
+    }
+    
+    // True if a log file holds any changes (a LOG_START on its own doesn't count)
+    static bool hasChanges(const string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || st.st_size == 0) return false;
+        if (size_t(st.st_size) != START_BYTES) return true;
+        ifstream in(path, ios::binary);
+        char head[9] = {};
+        in.read(head, sizeof(head));
+        return Type(head[8]) != LOG_START;
+    }
+    
+    // Read a log from the start and hand each good record after sequence
+    // number 'after' to 'apply' (earlier ones are already in the snapshot).
+    // Stops at the first damaged or cut-off record (a crash mid-write).
+    // Returns the number of records applied, or -1 if the file couldn't be
+    // read; 'lastSeq' gets the number of the last good record.
+    static long long replay(const string& path, const function<void(Type, const string&)>& apply,
+                            uint64_t after = 0, uint64_t* lastSeq = nullptr) {
+        ifstream in(path, ios::binary);
+        if (!in) return -1;
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        
+        long long count = 0;
+        uint64_t seq = 0;
+        size_t pos = 0;
+        while (pos + 9 <= data.size()) {
+            uint32_t len, crc;
+            memcpy(&len, &data[pos], 4);
+            memcpy(&crc, &data[pos + 4], 4);
+            if (len == 0 || len > data.size() - pos - 8) break;
+            if (crc32(&data[pos + 8], len) != crc) break;
+            Type type = Type(data[pos + 8]);
+            if (type == LOG_START && len == 1 + sizeof(uint64_t)) {
+                memcpy(&seq, &data[pos + 9], sizeof(seq));
+                seq--;
+            } else if (++seq > after) {
+                apply(type, data.substr(pos + 9, len - 1));
+                count++;
+            }
+            pos += 8 + len;
+        }
+        if (lastSeq) *lastSeq = seq;
+        if (pos < data.size())
+            cerr << "Write-ahead log has a damaged tail - ignored the last " << data.size() - pos << " bytes\n";
+        return count;
+    }
+};
+
+// Helpers to build and read log record payloads
+struct LogWriter {
+    string out;
+    template <typename T> LogWriter& put(T v) {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+        return *this;
+    }
+    LogWriter& put(const string& s) {
+        put<uint32_t>(s.size());
+        out += s;
+        return *this;
+    }
+};
+
+struct LogReader {
+    const string& in;
+    size_t pos = 0;
+    bool ok = true;
+    
+    explicit LogReader(const string& s) : in(s) {}
+    
+    template <typename T> T get() {
+        T v{};
+        if (pos + sizeof(T) > in.size()) { ok = false; return v; }
+        memcpy(&v, in.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return v;
+    }
+    bool more() const { return pos < in.size(); }
+    string getString() {
+        uint32_t n = get<uint32_t>();
+        if (!ok || pos + n > in.size()) { ok = false; return ""; }
+        string s = in.substr(pos, n);
+        pos += n;
+        return s;
+    }
+};
+
+// One reminder email waiting to go out
+struct ReminderJob {
+    int customerId;
+    string to;
+    string body;
+    chrono::steady_clock::time_point queued;
+};
+
+// Hands a batch of emails to the mail relay (SMTP, HTTP API...).
+// Returns false if the relay didn't take them - the batch gets retried.
+using ReminderRelay = function<bool(const vector<ReminderJob>&)>;
+
+// Numbers from a reminder run
+struct ReminderStats {
+    long long queued = 0, sent = 0, failed = 0;
+    long long retries = 0;          // relay calls that had to be repeated
+    size_t maxQueueDepth = 0;
+    double seconds = 0;
+    double p99Ms = 0;               // enqueue to accepted by the relay
+    
+    double sentPerSec() const { return seconds > 0 ? sent / seconds : 0; }
+};
+
+// Reminder emails go through here instead of being sent one at a time.
+// The producer submits jobs, a few sender threads take them off the queue in
+// batches and pass them to the relay. Sending is held to ratePerSec (0 = no
+// limit), failed batches are retried with a growing delay, and submit()
+// blocks while the queue is full so we never get too far ahead of the relay.
+class ReminderOutbox {
+private:
+    ReminderRelay relay;
+    BoundedQueue<ReminderJob> queue;
+    vector<thread> senders;
+    size_t batchSize;
+    int maxAttempts;
+    chrono::milliseconds retryDelay;
+    bool finished = false;
+    chrono::steady_clock::time_point startTime;
+    
+    // Token bucket for the rate limit, one second's worth at most
+    double ratePerSec;
+    double tokens;
+    chrono::steady_clock::time_point lastRefill;
+    mutex rateMutex;
+    
+    mutex statsMutex;
+    ReminderStats stats;
+    vector<double> latencies;
+    vector<int> failedIds;
+    
+    // A batch bigger than the bucket takes it in steps, so it still pays
+    // for every email
+    void takeTokens(size_t n) {
+        if (ratePerSec <= 0) return;
+        double owed = n;
+        while (true) {
+            unique_lock<mutex> lock(rateMutex);
+            auto t = chrono::steady_clock::now();
+            tokens = min(ratePerSec, tokens + chrono::duration<double>(t - lastRefill).count() * ratePerSec);
+            lastRefill = t;
+            double take = min(owed, tokens);
+            tokens -= take;
+            owed -= take;
+            if (owed <= 0) return;
+            double wait = min(owed, ratePerSec) / ratePerSec;
+            lock.unlock();
+            this_thread::sleep_for(chrono::duration<double>(wait));
+        }
+    }
+    
+    void work() {
+        vector<ReminderJob> batch;
+        while (true) {
+            batch.clear();
+            if (queue.popBatch(batch, batchSize) == 0) break;
+            
+            takeTokens(batch.size());
+            bool ok = false;
+            int attempt = 0;
+            while (attempt < maxAttempts) {
+                if (attempt > 0) this_thread::sleep_for(retryDelay * (1 << (attempt - 1)));
+                attempt++;
+                if ((ok = relay(batch))) break;
+            }
+            
+            auto t = chrono::steady_clock::now();
+            lock_guard<mutex> lock(statsMutex);
+            stats.retries += attempt - 1;
+            if (ok) {
+                stats.sent += batch.size();
+                for (auto& job : batch)
+                    latencies.push_back(chrono::duration<double, milli>(t - job.queued).count());
+            } else {
+                stats.failed += batch.size();
+                for (auto& job : batch) failedIds.push_back(job.customerId);
+            }
+        }
+    }
+    
+public:
+    ReminderOutbox(ReminderRelay relay, double ratePerSec = 0, size_t senderCount = 4,
+                   size_t capacity = 1024, size_t batch = 32, int maxAttempts = 3,
+                   chrono::milliseconds retryDelay = chrono::milliseconds(50))
+        : relay(move(relay)), queue(capacity), batchSize(batch), maxAttempts(maxAttempts),
+          retryDelay(retryDelay), ratePerSec(ratePerSec), tokens(min<double>(batch, ratePerSec)) {
+        startTime = lastRefill = chrono::steady_clock::now();
+        for (size_t s = 0; s < max<size_t>(1, senderCount); s++)
+            senders.emplace_back(&ReminderOutbox::work, this);
+    }
+    
+    ~ReminderOutbox() {
+        if (!finished) finish();
+    }
+    
+    // Queue an email - blocks if the senders are too far behind.
+    // Call from one producer thread.
+    void submit(ReminderJob job) {
+        job.queued = chrono::steady_clock::now();
+        queue.push(move(job));
+        stats.queued++;
+        stats.maxQueueDepth = max(stats.maxQueueDepth, queue.size());
+    }
+    
+    // Send what's left and wait for the senders
+    ReminderStats finish() {
+        if (finished) return stats;
+        finished = true;
+        queue.close();
+        for (auto& t : senders) t.join();
+        
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        if (!latencies.empty()) {
+            size_t k = (latencies.size() - 1) * 99 / 100;
+            nth_element(latencies.begin(), latencies.begin() + k, latencies.end());
+            stats.p99Ms = latencies[k];
+        }
+        return stats;
+    }
+    
+    // Customers whose email never made it (after finish)
+    const vector<int>& failedCustomers() const { return failedIds; }
+};
+
+// Every import/export trade, stored by column and split up by UTC month
+// and energy type. A partition keeps its trades in date order with running
+// sums next to them, and each month keeps the sums of every month before it,
+// so any type and date range comes down to two binary searches and a
+// subtraction, however many trades there are. Values are added up in
+// millionths (like Totals), which keeps the subtraction exact and makes the
+// order trades arrive in not matter.
+class TradeLedger {
+public:
+    struct Sums {
+        long long imports = 0, exports = 0;     // value, in millionths
+        long long importCount = 0, exportCount = 0;
+
+        void add(const Sums& o, int sign = 1) {
+            imports += sign * o.imports;
+            exports += sign * o.exports;
+            importCount += sign * o.importCount;
+            exportCount += sign * o.exportCount;
+        }
+        double importValue() const { return Totals::toDouble(imports); }
+        double exportValue() const { return Totals::toDouble(exports); }
+        double balance() const { return Totals::toDouble(imports - exports); }
+    };
+
+private:
+    struct Partition {
+        vector<int64_t> date;
+        vector<double> quantity, price;
+        vector<uint8_t> isImport;
+        vector<Sums> before{Sums()};            // sums of the trades ahead of each one, plus the total
+
+        void push(int64_t d, double q, double p, bool imp) {
+            Sums s = before.back();
+            long long value = Totals::toFixed(q * p);
+            if (imp) {
+                s.imports += value;
+                s.importCount++;
+            } else {
+                s.exports += value;
+                s.exportCount++;
+            }
+            date.push_back(d);
+            quantity.push_back(q);
+            price.push_back(p);
+            isImport.push_back(imp);
+            before.push_back(s);
+        }
+
+        // Trades dated before t
+        Sums upTo(int64_t t) const {
+            return before[lower_bound(date.begin(), date.end(), t) - date.begin()];
+        }
+    };
+
+    struct Month {
+        int key;                                // months since 1970-01
+        PerType<Partition> byType;
+        PerType<Sums> before{};                 // every earlier month
+    };
+
+    vector<Month> months;                       // in key order - there are only a dozen a year
+    PerType<Sums> totals{};
+    size_t count = 0;
+
+    static int monthOf(int64_t t) {
+        time_t tt = t;
+        tm utc;
+        gmtime_r(&tt, &utc);
+        return (utc.tm_year - 70) * 12 + utc.tm_mon;
+    }
+
+
+    size_t monthIndex(int key) const {
+        return lower_bound(months.begin(), months.end(), key,
+                           [](const Month& m, int k) { return m.key < k; }) - months.begin();
+    }
+
+public:
+    size_t size() const { return count; }
+    const PerType<Sums>& total() const { return totals; }
+
+    // Add a batch of trades. They're sorted into their partitions first, so
+    // a batch costs one pass per partition it touches. Trades dated before
+    // the newest one already in a partition are merged in, which costs the
+    // trades dated after them.
+    void append(const ImportExport* trades, size_t n) {
+        if (n == 0) return;
+        struct Slot {
+            int month;
+            uint8_t type;
+            int64_t date;
+            size_t k;
+        };
+        vector<Slot> order(n);
+        for (size_t k = 0; k < n; k++)
+            order[k] = {monthOf(trades[k].date), uint8_t(typeIndex(trades[k].type)), (int64_t)trades[k].date, k};
+        sort(order.begin(), order.end(), [](const Slot& a, const Slot& b) {
+            return tie(a.month, a.type, a.date, a.k) < tie(b.month, b.type, b.date, b.k);
+        });
+
+        // Make any months we don't have yet
+        for (size_t g = 0; g < n; g++) {
+            if (g > 0 && order[g].month == order[g - 1].month) continue;
+            size_t m = monthIndex(order[g].month);
+            if (m == months.size() || months[m].key != order[g].month)
+                months.insert(months.begin() + m, Month{order[g].month, {}, {}});
+        }
+
+        for (size_t g = 0, end; g < n; g = end) {
+            for (end = g + 1; end < n && order[end].month == order[g].month && order[end].type == order[g].type;) end++;
+            Partition& p = months[monthIndex(order[g].month)].byType[order[g].type];
+            Sums start = p.before.back();
+            
+            // Backdated trades go in after the ones dated the same or
+            // earlier - only the trades after that get moved and their sums redone
+            size_t pos = upper_bound(p.date.begin(), p.date.end(), order[g].date) - p.date.begin();
+            Partition later;
+            later.date.assign(p.date.begin() + pos, p.date.end());
+            later.quantity.assign(p.quantity.begin() + pos, p.quantity.end());
+            later.price.assign(p.price.begin() + pos, p.price.end());
+            later.isImport.assign(p.isImport.begin() + pos, p.isImport.end());
+            p.date.resize(pos);
+            p.quantity.resize(pos);
+            p.price.resize(pos);
+            p.isImport.resize(pos);
+            p.before.resize(pos + 1);
+            
+            size_t a = 0;
+            for (size_t s = g; s < end; s++) {
+                const ImportExport& t = trades[order[s].k];
+                for (; a < later.date.size() && later.date[a] <= t.date; a++)
+                    p.push(later.date[a], later.quantity[a], later.price[a], later.isImport[a]);
+                p.push(t.date, t.quantity, t.price, t.isImport);
+            }
+            for (; a < later.date.size(); a++)
+                p.push(later.date[a], later.quantity[a], later.price[a], later.isImport[a]);
+            
+            Sums added = p.before.back();
+            added.add(start, -1);
+            totals[order[g].type].add(added);
+        }
+        count += n;
+
+        // Redo the running month sums from the first month this batch touched
+        for (size_t m = monthIndex(order[0].month); m < months.size(); m++) {
+            for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+                Sums s = m > 0 ? months[m - 1].before[t] : Sums();
+                if (m > 0) s.add(months[m - 1].byType[t].before.back());
+                months[m].before[t] = s;
+            }
+        }
+    }
+
+    // Trades of one type dated in [from, to)
+    Sums between(EnergyType type, int64_t from, int64_t to) const {
+        if (to <= from) return Sums();
+        Sums s = upTo(type, to);
+        s.add(upTo(type, from), -1);
+        return s;
+    }
+
+    // Every type, added up
+    Sums between(int64_t from, int64_t to) const {
+        Sums s;
+        for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) s.add(between(typeAt(t), from, to));
+        return s;
+    }
+
+    // Trades of one type dated before t
+    Sums upTo(EnergyType type, int64_t t) const {
+        size_t i = typeIndex(type);
+        int key = monthOf(t);
+        size_t m = monthIndex(key);
+        if (m == months.size()) return totals[i];
+        Sums s = months[m].before[i];
+        if (months[m].key == key) s.add(months[m].byType[i].upTo(t));
+        return s;
+    }
+
+    // Every trade, by month, type and date
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (auto& month : months) {
+            for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+                const Partition& p = month.byType[t];
+                for (size_t k = 0; k < p.date.size(); k++) {
+                    ImportExport trade(typeAt(t), p.quantity[k], p.price[k], p.isImport[k]);
+                    trade.date = p.date[k];
+                    fn(trade);
+                }
+            }
+        }
+    }
+
+    void clear() {
+        months.clear();
+        totals = {};
+        count = 0;
+    }
+};
+
+// Fire-and-forget coroutine for the maintenance scheduler. It runs as soon
+// as it's called, up to its first co_await, and frees itself when it's
+// done. Anything it's parked on gets resumed when the scheduler stops, so
+// none are left hanging.
+struct MaintenanceTask {
+    struct promise_type {
+        MaintenanceTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// Upcoming maintenance for every customer. Open work orders wait in a
+// priority queue per province (most urgent first, then earliest due) for a
+// crew to take them, and every order that isn't finished is also in a
+// per-province due date index, so "equipment checks due in Alberta this
+// week" is a range lookup that never goes near the customers.
+// Crews and anyone waiting on an order are coroutines: co_await
+// nextOrder(crew) hands a crew the next order it can take as soon as there
+// is one, and co_await finished(number) comes back once the order is done
+// or cancelled. Coroutines are resumed by whoever made the change, after
+// the lock is let go.
+class MaintenanceScheduler {
+public:
+    enum Status : uint8_t { OPEN, DISPATCHED, DONE, CANCELLED };
+    
+    struct WorkOrder {
+        int number = -1;
+        int customerId = 0;
+        int province = 0;           // province ID, as in CustomerStore::province
+        int priority = 5;           // 0 = emergency, 9 = whenever
+        time_t due = 0;
+        string task;
+        Status status = OPEN;
+        int crew = -1;              // who's on it, while it's dispatched
+        time_t finished = 0;
+        double cost = 0;
+        
+        static const char* statusName(Status s) {
+            const char* names[] = {"open", "dispatched", "done", "cancelled"};
+            return s <= CANCELLED ? names[s] : "unknown";
+        }
+    };
+    
+private:
+    struct Queued {
+        int priority;
+        time_t due;
+        int number;
+        bool operator>(const Queued& o) const {
+            return tie(priority, due, number) > tie(o.priority, o.due, o.number);
+        }
+    };
+    using Queue = priority_queue<Queued, vector<Queued>, greater<Queued>>;
+    
+    struct Crew {
+        string name;
+        int province;                       // -1 = goes anywhere
+        int order = -1;                     // what they're on
+        coroutine_handle<> parked{};        // waiting in nextOrder
+        optional<WorkOrder>* slot = nullptr;
+    };
+    struct Waiter {
+        coroutine_handle<> h;
+        WorkOrder* slot;
+    };
+    
+    vector<WorkOrder> orders;               // by number; number -1 is a gap
+    vector<Queue> queues;                   // open orders by province - finished ones get skipped when they come up
+    vector<set<pair<time_t, int>>> byDate;  // (due, number) of unfinished orders, by province
+    vector<Crew> crews;
+    unordered_map<int, vector<Waiter>> waiters;   // finished() callers, by order number
+    size_t count = 0;
+    bool stopping = false;
+    mutable mutex m;
+    
+    static Queued key(const WorkOrder& o) { return {o.priority, o.due, o.number}; }
+    
+    void growProvinces(int p) {
+        if (p >= (int)queues.size()) {
+            queues.resize(p + 1);
+            byDate.resize(p + 1);
+        }
+    }
+    
+    // Most urgent open order crew c can take, or -1. Caller holds m.
+    int pick(const Crew& c) {
+        Queue* best = nullptr;
+        auto look = [&](Queue& q) {
+            while (!q.empty() && orders[q.top().number].status != OPEN) q.pop();
+            if (!q.empty() && (!best || best->top() > q.top())) best = &q;
+        };
+        if (c.province >= 0) {
+            if (c.province < (int)queues.size()) look(queues[c.province]);
+        } else {
+            for (auto& q : queues) look(q);
+        }
+        if (!best) return -1;
+        int n = best->top().number;
+        best->pop();
+        return n;
+    }
+    
+    // Give order n to crew c. Caller holds m.
+    void assign(int c, int n) {
+        orders[n].status = DISPATCHED;
+        orders[n].crew = c;
+        crews[c].order = n;
+    }
+    
+    // A parked crew that can take an open order n - it gets it and goes
+    // into 'wake'. Caller holds m.
+    void offer(int n, vector<coroutine_handle<>>& wake) {
+        for (size_t c = 0; c < crews.size(); c++) {
+            Crew& crew = crews[c];
+            if (!crew.parked || (crew.province >= 0 && crew.province != orders[n].province)) continue;
+            assign(c, n);
+            *crew.slot = orders[n];
+            wake.push_back(exchange(crew.parked, nullptr));
+            return;
+        }
+    }
+    
+    // Finish order n off as done or cancelled. Caller holds m.
+    void finish(int n, Status status, vector<coroutine_handle<>>& wake) {
+        WorkOrder& o = orders[n];
+        o.status = status;
+        byDate[o.province].erase({o.due, n});
+        if (o.crew >= 0) crews[o.crew].order = -1;
+        auto it = waiters.find(n);
+        if (it == waiters.end()) return;
+        for (Waiter& w : it->second) {
+            *w.slot = o;
+            wake.push_back(w.h);
+        }
+        waiters.erase(it);
+    }
+    
+    static void resume(vector<coroutine_handle<>>& wake) {
+        for (auto h : wake) h.resume();
+    }
+    
+public:
+    ~MaintenanceScheduler() { stop(); }
+    
+    // Add an order and return its number. A number of -1 takes the next
+    // one; replay and snapshots pass the number it had before. Orders
+    // that are already done or cancelled just get recorded.
+    int add(WorkOrder o) {
+        vector<coroutine_handle<>> wake;
+        {
+            lock_guard<mutex> lock(m);
+            if (o.number < 0) o.number = orders.size();
+            if (o.number >= (int)orders.size()) orders.resize(o.number + 1);
+            if (orders[o.number].number >= 0) return -1;     // already there
+            growProvinces(o.province);
+            if (o.status == DISPATCHED) o.status = OPEN;      // crews sign on again after a restart
+            o.crew = -1;
+            orders[o.number] = o;
+            count++;
+            if (o.status == OPEN) {
+                queues[o.province].push(key(o));
+                byDate[o.province].insert({o.due, o.number});
+                offer(o.number, wake);
+            }
+        }
+        resume(wake);
+        return o.number;
+    }
+    
+    // Mark an order done. Null if there's no such order or it's already
+    // finished; otherwise what it looks like now.
+    optional<WorkOrder> complete(int n, double cost, time_t when) {
+        vector<coroutine_handle<>> wake;
+        optional<WorkOrder> done;
+        {
+            lock_guard<mutex> lock(m);
+            if (n < 0 || n >= (int)orders.size() || orders[n].number < 0 || orders[n].status >= DONE) return nullopt;
+            orders[n].cost = cost;
+            orders[n].finished = when;
+            finish(n, DONE, wake);
+            done = orders[n];
+        }
+        resume(wake);
+        return done;
+    }
+    
+    bool cancel(int n) {
+        vector<coroutine_handle<>> wake;
+        {
+            lock_guard<mutex> lock(m);
+            if (n < 0 || n >= (int)orders.size() || orders[n].number < 0 || orders[n].status >= DONE) return false;
+            finish(n, CANCELLED, wake);
+        }
+        resume(wake);
+        return true;
+    }
+    
+    // A crew that works one province (-1 = anywhere). Returns its number.
+    int addCrew(const string& name, int province = -1) {
+        lock_guard<mutex> lock(m);
+        crews.push_back({name, province});
+        return crews.size() - 1;
+    }
+    
+    string crewName(int c) const {
+        lock_guard<mutex> lock(m);
+        return c >= 0 && c < (int)crews.size() ? crews[c].name : string();
+    }
+    
+    // co_await nextOrder(crew): the next order the crew can take, once
+    // there is one. Empty once the scheduler stops.
+    struct NextOrder {
+        MaintenanceScheduler& s;
+        int crew;
+        optional<WorkOrder> result;
+        
+        bool await_ready() const { return false; }
+        bool await_suspend(coroutine_handle<> h) {
+            lock_guard<mutex> lock(s.m);
+            if (s.stopping || crew < 0 || crew >= (int)s.crews.size()) return false;
+            int n = s.pick(s.crews[crew]);
+            if (n >= 0) {
+                s.assign(crew, n);
+                result = s.orders[n];
+                return false;
+            }
+            s.crews[crew].parked = h;
+            s.crews[crew].slot = &result;
+            return true;
+        }
+        optional<WorkOrder> await_resume() { return move(result); }
+    };
+    NextOrder nextOrder(int crew) { return {*this, crew, nullopt}; }
+    
+    // co_await finished(n): the order once it's done or cancelled (or as
+    // it stands when the scheduler stops). Number -1 if there's no such order.
+    struct Finished {
+        MaintenanceScheduler& s;
+        int number;
+        WorkOrder result;
+        
+        bool await_ready() const { return false; }
+        bool await_suspend(coroutine_handle<> h) {
+            lock_guard<mutex> lock(s.m);
+            if (number < 0 || number >= (int)s.orders.size()) return false;
+            result = s.orders[number];
+            if (s.stopping || result.number < 0 || result.status >= DONE) return false;
+            s.waiters[number].push_back({h, &result});
+            return true;
+        }
+        WorkOrder await_resume() { return move(result); }
+    };
+    Finished finished(int n) { return {*this, n, WorkOrder()}; }
+    
+    // Call fn with the order once it's done or cancelled - straight away
+    // if it already is
+    MaintenanceTask whenFinished(int n, function<void(const WorkOrder&)> fn) {
+        fn(co_await finished(n));
+    }
+    
+    // Unfinished orders in one province (-1 = all of them) due in
+    // [from, to), soonest first. An empty task matches every task.
+    vector<WorkOrder> due(int province, time_t from, time_t to, string_view task = {}, size_t limit = SIZE_MAX) const {
+        lock_guard<mutex> lock(m);
+        vector<WorkOrder> found;
+        for (int p = province < 0 ? 0 : province; p < (int)byDate.size() && (province < 0 || p == province); p++) {
+            for (auto it = byDate[p].lower_bound({from, INT_MIN}); it != byDate[p].end() && it->first < to; ++it) {
+                const WorkOrder& o = orders[it->second];
+                if (task.empty() || o.task == task) found.push_back(o);
+            }
+        }
+        sort(found.begin(), found.end(), [](const WorkOrder& a, const WorkOrder& b) {
+            return tie(a.due, a.number) < tie(b.due, b.number);
+        });
+        if (found.size() > limit) found.resize(limit);
+        return found;
+    }
+    
+    optional<WorkOrder> order(int n) const {
+        lock_guard<mutex> lock(m);
+        if (n < 0 || n >= (int)orders.size() || orders[n].number < 0) return nullopt;
+        return orders[n];
+    }
+    
+    // Every order, by number
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        lock_guard<mutex> lock(m);
+        for (auto& o : orders)
+            if (o.number >= 0) fn(o);
+    }
+    
+    size_t size() const {
+        lock_guard<mutex> lock(m);
+        return count;
+    }
+    
+    // Drop every order. Anyone waiting on one gets it back as it was;
+    // crews stay and go back to waiting for work.
+    void clear() {
+        vector<coroutine_handle<>> wake;
+        {
+            lock_guard<mutex> lock(m);
+            for (auto& [n, list] : waiters) {
+                for (Waiter& w : list) {
+                    *w.slot = orders[n];
+                    wake.push_back(w.h);
+                }
+            }
+            waiters.clear();
+            for (auto& c : crews) c.order = -1;
+            orders.clear();
+            queues.clear();
+            byDate.clear();
+            count = 0;
+        }
+        resume(wake);
+    }
+    
+    // Wake everything that's parked, and make every later co_await come
+    // straight back, so all the coroutines run to the end
+    void stop() {
+        vector<coroutine_handle<>> wake;
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+            for (auto& c : crews)
+                if (c.parked) wake.push_back(exchange(c.parked, nullptr));
+            for (auto& [n, list] : waiters) {
+                for (Waiter& w : list) {
+                    *w.slot = orders[n];
+                    wake.push_back(w.h);
+                }
+            }
+            waiters.clear();
+        }
+        resume(wake);
+    }
+};
+
+// Runs what-if scenarios over a copy of the customer columns, on a
+// work-stealing pool. Usage, province and type are only ever read, so
+// every scenario shares them; each one gets a copy-on-write view of the
+// allocations. Supply is what's allocated in each province and energy
+// type today, plus that pool's share of net imports.
+// A scenario goes in two passes of TASK_ROWS customers a task. The first
+// adds up demand and allocation per pool (province x energy type). The
+// last first-pass task to finish works out each pool's supply and how far
+// its allocations can move, and queues the second pass, which rebalances
+// and adds up what gets served and paid for. So the passes of different
+// scenarios overlap and no thread waits on another.
+class CapacityPlanner {
+public:
+    struct Base {
+        vector<uint8_t> province;
+        vector<EnergyType> type;
+        vector<double> demand, allocated;   // per customer, units a month
+        vector<string> provinceNames;
+        PerType<double> rates{};
+        PerType<double> netImports{};       // units a month
+    };
+    
+private:
+    static const size_t TASK_ROWS = 16 * CowColumn<double>::CHUNK;
+    
+    struct PoolSums {
+        double demand = 0, allocated = 0, need = 0;     // first pass
+        double served = 0, raised = 0;                  // second pass
+        long long customers = 0, overLimit = 0, raisedCustomers = 0;
+    };
+    
+    // One scenario on its way through
+    struct Run {
+        const Scenario* scenario;
+        CowColumn<double> allocated;
+        vector<double> factor;              // demand multiplier, by pool
+        vector<double> supply, scale, raise;    // by pool, set between the passes
+        PerType<double> rate{};
+        vector<vector<PoolSums>> partial;   // by task
+        atomic<size_t> left{0};
+        ScenarioResult result;
+    };
+    
+    const Base& base;
+    CowColumn<double> allocated;
+    size_t provinces, tasks;
+    vector<double> baseAllocated;           // by pool
+    PerType<double> typeAllocated{};
+    
+    size_t pool(size_t i) const { return base.province[i] * ENERGY_TYPE_COUNT + typeIndex(base.type[i]); }
+    
+    static double shareFor(const vector<pair<string, double>>& list, const string& name) {
+        double share = 0;
+        for (auto& [n, v] : list)
+            if (n == name) share += v;
+        return share;
+    }
+    
+    void firstPass(Run& run, size_t task, WorkStealingPool& pool) {
+        vector<PoolSums>& sums = run.partial[task];
+        sums.assign(provinces * ENERGY_TYPE_COUNT, PoolSums());
+        size_t end = min(base.demand.size(), (task + 1) * TASK_ROWS);
+        for (size_t i = task * TASK_ROWS; i < end; i++) {
+            PoolSums& s = sums[this->pool(i)];
+            double d = base.demand[i] * run.factor[this->pool(i)], a = run.allocated[i];
+            s.demand += d;
+            s.allocated += a;
+            s.need += max(0.0, d - a);
+            s.customers++;
+        }
+        if (--run.left > 0) return;
+        
+        // Last one in: add the tasks up and plan each pool
+        vector<PoolSums> total(provinces * ENERGY_TYPE_COUNT);
+        for (auto& part : run.partial) {
+            for (size_t p = 0; p < total.size(); p++) {
+                total[p].demand += part[p].demand;
+                total[p].allocated += part[p].allocated;
+                total[p].need += part[p].need;
+                total[p].customers += part[p].customers;
+            }
+        }
+        const Scenario& sc = *run.scenario;
+        run.supply.assign(total.size(), 0);
+        run.scale.assign(total.size(), 1);
+        run.raise.assign(total.size(), 0);
+        for (size_t p = 0; p < total.size(); p++) {
+            size_t prov = p / ENERGY_TYPE_COUNT, t = p % ENERGY_TYPE_COUNT;
+            double change = 1 + sc.supplyChange + shareFor(sc.provinceSupply, base.provinceNames[prov]) + sc.typeSupply[t];
+            double imports = typeAllocated[t] > 0 ? base.netImports[t] * (1 + sc.importChange) * baseAllocated[p] / typeAllocated[t] : 0;
+            double supply = max(0.0, baseAllocated[p] * max(0.0, change) + imports);
+            run.supply[p] = supply;
+            if (!sc.rebalance) continue;
+            double room = supply - total[p].allocated;
+            if (room >= 0) {
+                run.raise[p] = total[p].need > 0 ? min(1.0, room / total[p].need) : 0;
+            } else {
+                run.scale[p] = supply / total[p].allocated;     // not enough to go round - everyone gets cut
+            }
+        }
+        run.partial.assign(tasks, {});
+        run.result.total.customers = 0;
+        for (auto& part : total) run.result.total.customers += part.customers;
+        run.left = tasks;
+        for (size_t k = tasks; k-- > 0;) pool.submit([this, &run, k] { secondPass(run, k); });
+    }
+    
+    void secondPass(Run& run, size_t task) {
+        vector<PoolSums>& sums = run.partial[task];
+        sums.assign(provinces * ENERGY_TYPE_COUNT, PoolSums());
+        size_t end = min(base.demand.size(), (task + 1) * TASK_ROWS);
+        for (size_t i = task * TASK_ROWS; i < end; i++) {
+            size_t p = this->pool(i);
+            PoolSums& s = sums[p];
+            double d = base.demand[i] * run.factor[p], a = run.allocated[i];
+            double now = a * run.scale[p] + run.raise[p] * max(0.0, d - a);
+            if (now != a) {
+                run.allocated.write(i) = now;
+                if (now > a) {
+                    s.raised += now - a;
+                    s.raisedCustomers++;
+                }
+            }
+            s.demand += d;
+            s.allocated += now;
+            s.served += min(d, now);
+            s.overLimit += d > now + 1e-9;
+            s.customers++;
+        }
+        if (--run.left > 0) return;
+        finish(run);
+    }
+    
+    // Add the second pass up by province
+    void finish(Run& run) {
+        vector<PoolSums> total(provinces * ENERGY_TYPE_COUNT);
+        for (auto& part : run.partial) {
+            for (size_t p = 0; p < total.size(); p++) {
+                PoolSums& t = total[p];
+                t.demand += part[p].demand;
+                t.allocated += part[p].allocated;
+                t.served += part[p].served;
+                t.raised += part[p].raised;
+                t.customers += part[p].customers;
+                t.overLimit += part[p].overLimit;
+                t.raisedCustomers += part[p].raisedCustomers;
+            }
+        }
+        run.partial.clear();
+        
+        ScenarioResult& r = run.result;
+        r.name = run.scenario->name;
+        r.total = ProvinceProjection();
+        r.total.province = "All";
+        for (size_t prov = 0; prov < provinces; prov++) {
+            ProvinceProjection pp;
+            pp.province = base.provinceNames[prov];
+            for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) {
+                size_t p = prov * ENERGY_TYPE_COUNT + t;
+                const PoolSums& s = total[p];
+                // Allocations never add up to more than the supply after
+                // rebalancing, but they can without it
+                double served = min(s.served, run.supply[p]);
+                ProvinceProjection part;
+                part.demand = s.demand;
+                part.supply = run.supply[p];
+                part.allocated = s.allocated;
+                part.served = served;
+                part.shortfall = s.demand - served;
+                part.revenue = served * run.rate[t];
+                part.lostRevenue = part.shortfall * run.rate[t];
+                part.raised = s.raised;
+                part.customers = s.customers;
+                part.overLimit = s.overLimit;
+                part.raisedCustomers = s.raisedCustomers;
+                pp.add(part);
+            }
+            if (pp.customers == 0) continue;
+            r.total.add(pp);
+            r.provinces.push_back(move(pp));
+        }
+        r.total.province = "All";
+    }
+    
+public:
+    explicit CapacityPlanner(const Base& b)
+        : base(b), allocated(b.allocated), provinces(b.provinceNames.size()),
+          tasks((b.demand.size() + TASK_ROWS - 1) / TASK_ROWS),
+          baseAllocated(b.provinceNames.size() * ENERGY_TYPE_COUNT) {
+        for (size_t i = 0; i < b.allocated.size(); i++) {
+            baseAllocated[pool(i)] += b.allocated[i];
+            typeAllocated[typeIndex(b.type[i])] += b.allocated[i];
+        }
+    }
+    
+    CapacityPlan run(const vector<Scenario>& scenarios, unsigned threadCount = 0) {
+        auto start = chrono::steady_clock::now();
+        WorkStealingPool pool(threadCount);
+        deque<Run> runs;     // stays put while tasks point at it
+        for (const Scenario& sc : scenarios) {
+            Run& run = runs.emplace_back();
+            run.scenario = &sc;
+            run.allocated = allocated;
+            run.factor.assign(provinces * ENERGY_TYPE_COUNT, 0);
+            for (size_t prov = 0; prov < provinces; prov++) {
+                double growth = max(0.0, 1 + sc.demandGrowth + shareFor(sc.provinceGrowth, base.provinceNames[prov]));
+                for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++)
+                    run.factor[prov * ENERGY_TYPE_COUNT + t] = growth * max(0.0, 1 + sc.priceElasticity * sc.rateChange[t]);
+            }
+            for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++) run.rate[t] = base.rates[t] * (1 + sc.rateChange[t]);
+            run.partial.resize(tasks);
+            run.left = tasks;
+        }
+        for (Run& run : runs) {
+            if (tasks == 0) {
+                run.supply.assign(provinces * ENERGY_TYPE_COUNT, 0);
+                finish(run);
+                continue;
+            }
+            for (size_t k = 0; k < tasks; k++) pool.submit([this, &run, k, &pool] { firstPass(run, k, pool); });
+        }
+        pool.wait();
+        
+        CapacityPlan plan;
+        plan.customers = base.demand.size();
+        plan.threads = pool.size();
+        for (Run& run : runs) {
+            run.result.chunksCopied = run.allocated.ownChunks();
+            plan.scenarios.push_back(move(run.result));
+        }
+        plan.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return plan;
+    }
+};
+
+// What EnergySystem::generateData makes. Everything comes out of 'seed',
+// so the same settings always give the same customers, however many
+// threads build them.
+struct GeneratorConfig {
+    enum UsageShape : uint8_t { UNIFORM, NORMAL, HEAVY_TAIL };
+    
+    size_t customers = 500;
+    int firstId = 1001;           // IDs go up from here
+    int provinces = 5;            // first this many of PROVINCES, evenly
+    int billMonths = 1;           // monthly bills already sent, oldest a 'billMonths' months back
+    double paidShare = 0.9;       // chance each of those bills was paid
+    
+    // A month's usage as a share of the allocation: mean +/- spread for
+    // UNIFORM, mean and standard deviation for NORMAL, and for HEAVY_TAIL a
+    // log-normal with median 'mean' (most use a little, a few use a lot)
+    UsageShape usage = UNIFORM;
+    double usageMean = 0.5, usageSpread = 0.3;
+    double allocMin = 250, allocMax = 1000;
+    
+    // This cycle's usage goes in the interval series as readingsPerDay
+    // readings a day over the last usageDays days
+    int usageDays = 1, readingsPerDay = 24;
+    
+    double maintenanceShare = 1.0 / 15;
+    size_t trades = 30;
+    uint64_t seed = 1;
+};
+
+const char* const GENERATOR_FIRST_NAMES[] = {
+    "John", "Jane", "Mike", "Emily", "Dave", "Sarah", "Chris", "Laura", "Mark", "Anna", "Paul", "Rachel",
+    "Kevin", "Megan", "Brian", "Olivia", "Steve", "Grace", "Ryan", "Hannah", "Adam", "Chloe", "Eric", "Julia"};
+const char* const GENERATOR_LAST_NAMES[] = {
+    "Smith", "Johnson", "Williams", "Jones", "Brown", "Tremblay", "Martin", "Roy", "Wilson", "Gagnon",
+    "Lee", "Taylor", "Campbell", "Anderson", "Leblanc", "Thompson", "White", "Cote", "Wong", "Morin",
+    "Clark", "Bouchard", "Scott", "Fraser"};
+const char* const GENERATOR_STREETS[] = {
+    "Howard Ave", "Dougall Ave", "Walker Rd", "Ouellette Ave", "Lauzon Rd", "Tecumseh Rd", "Wyandotte St",
+    "Huron Church Rd", "Riverside Dr", "Erie St"};
+
+// A GENERATE log record only holds the settings, so replaying it needs the
+// same generator: the same tables, and the same output from the standard
+// library's distributions (which is up to the implementation). Records
+// carry this fingerprint of both and replay refuses a different one. Bump
+// GENERATOR_VERSION for changes it can't see, like what a row does with them.
+const uint32_t GENERATOR_VERSION = 2;
+
+uint32_t generatorFingerprint() {
+    static const uint32_t fingerprint = [] {
+        string bits(reinterpret_cast<const char*>(&GENERATOR_VERSION), sizeof(GENERATOR_VERSION));
+        auto addNames = [&](const auto& list) {
+            for (const char* name : list) bits.append(name, strlen(name) + 1);
+        };
+        addNames(PROVINCES);
+        addNames(GENERATOR_FIRST_NAMES);
+        addNames(GENERATOR_LAST_NAMES);
+        addNames(GENERATOR_STREETS);
+        auto addSample = [&](auto v) { bits.append(reinterpret_cast<const char*>(&v), sizeof(v)); };
+        mt19937_64 gen(1);
+        for (int k = 0; k < 16; k++) {
+            addSample(uniform_int_distribution<>(0, 9999)(gen));
+            addSample(uniform_int_distribution<size_t>(0, 1000000)(gen));
+            addSample(uniform_int_distribution<time_t>(0, 86400 * 365)(gen));
+            addSample(uniform_real_distribution<>(0, 1)(gen));
+            addSample(normal_distribution<>(0, 1)(gen));
+        }
+        return crc32(bits.data(), bits.size());
+    }();
+    return fingerprint;
+}
+
+// Main system class that manages everything
+class EnergySystem {
+private:
+    CustomerStore customers;            // Column store - see CustomerStore
+    vector<vector<int>> provinceRows;   // customer indices in each province, by province ID
+    unordered_map<int, int> idIndex;    // Maps customer ID to index in customers
+    SearchIndex searchIndex;            // Substring search over name/email/ID
+    
+    // Cached totals. Each customer's last counted values are kept in
+    // 'counted' so an update only has to apply the difference.
+    vector<Totals> provinceTotals;      // indexed like customers.provinceNames
+    Totals overall;
+    vector<Totals> counted;
+    mutex totalsMutex;                  // ingestion workers update totals in parallel
+    bool checkTotals = false;           // debug mode - compare against a full recount
+    bool searchIndexStale = false;      // rebuilt on the next search (after a snapshot load)
+    
+    // Delta reports. Every customer change is tagged with the report
+    // generation it happened in (under the customer's segment), and usage
+    // that goes into the interval series is added up per UTC day until the
+    // next report takes it (under totalsMutex). See reportStats.
+    struct ReportCheckpoint {
+        bool valid = false;
+        SystemStats stats;              // what the last report counted
+    };
+    ReportCheckpoint lastReport;
+    mutex reportMutex;                  // one report at a time, guards lastReport
+    vector<uint32_t> changedIn;         // per customer
+    atomic<uint32_t> reportGeneration{1};
+    map<int64_t, long long> pendingUsage;
+    
+    // Write-ahead log - every change is appended here while it's open
+    unique_ptr<WriteAheadLog> wal;
+    uint64_t snapshotLogSeq = 0;        // log records the loaded snapshot already has
+    bool durablePayments = true;        // makePayment waits until its record is on disk
+    int tierAfterDays = 90;             // paid bills older than this go to cold storage (0 = never)
+    int usageKeepDays = 400;            // interval usage older than this is dropped (0 = keep it all)
+    
+    // Where reminder emails go. Until there's a real relay we just say who they went to.
+    ReminderTemplate reminderTemplate;
+    ReminderRelay reminderRelay = [](const vector<ReminderJob>& batch) {
+        string lines;
+        for (auto& job : batch)
+            lines += "Sent reminder to " + job.to + " (ID: " + to_string(job.customerId) + ")\n";
+        cout << lines;
+        return true;
+    };
+    double reminderRate = 1000;         // emails per second, 0 = no limit
+    
+    // Overdue scheduler. Every unpaid bill sits in a min-heap keyed on when it
+    // goes overdue, so we only look at bills whose time has actually come.
+    struct DueBill {
+        time_t due;
+        int customer, bill;
+        bool operator>(const DueBill& o) const { return due > o.due; }
+    };
+    priority_queue<DueBill, vector<DueBill>, greater<DueBill>> dueBills;
+    set<int> overdueSet;                // customers with an overdue bill
+    mutex overdueMutex;                 // guards dueBills and overdueSet
+    function<time_t()> clock = [] { return time(nullptr); };
+    PerType<double> rates;              // Pricing for each energy type
+    RatePlanBook plans;                 // time-of-use / tiered plans on top of the rates
+    TradeLedger ledger;                 // imports and exports
+    mutable RWLock tradeLock;           // guards ledger
+    mutex searchMutex;                  // one thread (re)builds the search index at a time
+    mt19937 rng{random_device{}()};
+    
+    // Work orders and the crews doing them. Booking, finishing and
+    // cancelling take workOrderMutex, so the log gets them in the order the
+    // scheduler saw them (it comes before layout). Crews hear about each
+    // order they're sent to through dispatchHandler - it runs inside
+    // whatever call freed the order up, so it mustn't book or finish work.
+    MaintenanceScheduler maintenance;
+    mutex workOrderMutex;
+    function<void(const string&, const MaintenanceScheduler::WorkOrder&)> dispatchHandler =
+        [](const string& crew, const MaintenanceScheduler::WorkOrder& o) {
+            cout << crew + " sent to customer " + to_string(o.customerId) + " for " + o.task +
+                    " (work order #" + to_string(o.number) + ")\n";
+        };
+    
+    // What customer 'idx' adds to the totals right now
+    Totals totalsFor(int idx) const {
+        Totals t;
+        t.customers = 1;
+        t.allocated = Totals::toFixed(customers.allocated[idx]);
+        t.used = Totals::toFixed(customers.used[idx]);
+        t.unpaid = Totals::toFixed(customers.owed[idx]);
+        if (customers.overdue[idx]) {
+            t.overdueCustomers = 1;
+            t.overdueAmount = t.unpaid;
+        }
+        return t;
+    }
+    
+    // Cached totals of every province that has customers, into 'st'.
+    // Caller holds totalsMutex.
+    void addProvinceTotals(SystemStats& st) const {
+        for (size_t p = 0; p < provinceRows.size(); p++)
+            if (!provinceRows[p].empty()) st.provinces[customers.provinceNames[p]] = provinceTotals[p];
+    }
+    
+    // Bring the totals up to date after customer 'idx' changed, along with
+    // the usage waiting for the next report if 'usage' is given
+    void updateTotals(int idx, const UsageAdded* usage = nullptr) {
+        Totals change = takeChange(idx);
+        lock_guard<mutex> lock(totalsMutex);
+        provinceTotals[customers.province[idx]].add(change);
+        overall.add(change);
+        if (usage) {
+            for (auto& g : usage->intervals)
+                if (!g.late && g.units != 0) pendingUsage[UsageSeries::dayOf(g.interval)] += g.units;
+        }
+    }
+    
+    // How much customer 'idx' moved since we last counted them. Marks them
+    // as counted (and changed, for delta reports), so the caller has to add
+    // the result to the totals.
+    Totals takeChange(int idx) {
+        changedIn[idx] = reportGeneration.load(memory_order_relaxed);
+        Totals now = totalsFor(idx);
+        Totals change = now;
+        change.add(counted[idx], -1);
+        counted[idx] = now;
+        return change;
+    }
+    
+    // Queue up an unpaid bill so we notice when it goes overdue.
+    // Caller holds the customer's segment.
+    void scheduleBill(int idx, int bill) {
+        const Payment* p = customers.findBill(idx, bill);
+        if (p && !p->isPaid && !p->overdue) {
+            lock_guard<mutex> lock(overdueMutex);
+            dueBills.push({p->dueTime(), idx, bill});
+        }
+    }
+    
+    // Flip every bill that's past due as of now(). Paid bills still in the
+    // heap just get thrown away when they come up.
+    // Lock order is always layout, then segment, then overdueMutex, then
+    // totalsMutex - so the due bills are taken off the heap first and only
+    // then marked, one segment at a time.
+    void processOverdue() {
+        shared_lock<RWLock> layout(customers.layout);
+        time_t t = now();
+        vector<DueBill> ready;
+        {
+            lock_guard<mutex> lock(overdueMutex);
+            while (!dueBills.empty() && dueBills.top().due <= t) {
+                ready.push_back(dueBills.top());
+                dueBills.pop();
+            }
+        }
+        for (auto& d : ready) {
+            unique_lock<RWLock> row(customers.segmentFor(d.customer));
+            if (customers.markOverdue(d.customer, d.bill)) {
+                {
+                    lock_guard<mutex> lock(overdueMutex);
+                    overdueSet.insert(d.customer);
+                }
+                updateTotals(d.customer);
+            }
+        }
+    }
+    
+    // Overdue customers right now, copied out so the caller can take their time
+    vector<int> overdueRows() {
+        processOverdue();
+        lock_guard<mutex> lock(overdueMutex);
+        return vector<int>(overdueSet.begin(), overdueSet.end());
+    }
+    
+    // Usage for one customer. Each reading goes into the period of their plan
+    // and the series interval that 'when' falls in (now() if when is null),
+    // or all into 'period' if one is given (old log records). Returns how
+    // many were accepted, -1 if there's no such customer.
+    int addUsage(int id, const double* amts, const time_t* when, size_t n, int period = -1) {
+        shared_lock<RWLock> layout(customers.layout);
+        auto it = idIndex.find(id);
+        if (it == idIndex.end()) return -1;
+        int idx = it->second;
+        unique_lock<RWLock> row(customers.segmentFor(idx));
+        
+        thread_local vector<uint8_t> periods;
+        thread_local vector<int64_t> intervals;
+        thread_local UsageAdded added;
+        periods.resize(n);
+        intervals.resize(n);
+        time_t t = when ? 0 : now();
+        int plan = customers.plan[idx];
+        for (size_t k = 0; k < n; k++) {
+            time_t at = when ? when[k] : t;
+            periods[k] = period >= 0 ? period : plans.periodAt(plan, at);
+            intervals[k] = UsageSeries::intervalOf(at);
+        }
+        
+        int accepted = customers.useEnergyBatch(idx, amts, periods.data(), intervals.data(), n, added);
+        if (accepted > 0) {
+            updateTotals(idx, &added);
+            // Exactly what was added, so replay ends up with the same doubles:
+            // the total, each period touched and each interval
+            LogWriter w;
+            w.put<int32_t>(id).put(added.total);
+            uint8_t touched = 0;
+            for (int p = 0; p < MAX_PERIODS; p++)
+                if (added.periods[p] != 0) touched |= 1 << p;
+            w.put(touched);
+            for (int p = 0; p < MAX_PERIODS; p++)
+                if (touched & (1 << p)) w.put(added.periods[p]);
+            w.put<uint32_t>(added.intervals.size());
+            for (auto& g : added.intervals) w.put(g.interval).put(g.units);
+            logChange(WriteAheadLog::USAGE_BATCH, w);
+        }
+        return accepted;
+    }
+    
+    // Interval usage [from, to) in 'bucket' interval slots, added up over
+    // 'rows' (everyone if null). Caller holds layout; segments get shared
+    // one at a time as we go, unless the caller has them all already.
+    vector<long long> usageByBucket(const vector<int>* rows, int64_t from, int64_t to, int64_t bucket,
+                                    bool segmentsHeld = false) const {
+        vector<long long> out(max<int64_t>(0, (to - from + bucket - 1) / bucket));
+        if (out.empty()) return out;
+        vector<int64_t> sums(out.size());
+        size_t n = rows ? rows->size() : customers.size();
+        shared_lock<RWLock> seg;
+        for (size_t k = 0; k < n; k++) {
+            size_t i = rows ? (*rows)[k] : k;
+            RWLock& want = customers.segmentFor(i);
+            if (!segmentsHeld && seg.mutex() != &want) seg = shared_lock<RWLock>(want);
+            customers.usage[i].aggregate(from, to, bucket, sums.data());
+        }
+        copy(sums.begin(), sums.end(), out.begin());
+        return out;
+    }
+    
+    // Turn a time range and bucket size into intervals - false (with a
+    // message) if the bucket isn't a whole number of intervals
+    static bool usageRange(time_t from, time_t to, int bucketSeconds,
+                           int64_t& fromIv, int64_t& toIv, int64_t& bucket) {
+        if (bucketSeconds <= 0 || bucketSeconds % UsageSeries::INTERVAL != 0) {
+            cerr << "Usage buckets have to be a multiple of " << UsageSeries::INTERVAL / 60 << " minutes\n";
+            return false;
+        }
+        fromIv = UsageSeries::intervalOf(from);
+        toIv = to > from ? UsageSeries::intervalOf(to - 1) + 1 : fromIv;
+        bucket = bucketSeconds / UsageSeries::INTERVAL;
+        return true;
+    }
+    
+    // What customer 'idx' owes for this cycle under their plan. Caller holds their segment.
+    double billAmount(int idx) const {
+        double amount;
+        plans.price(1, &customers.plan[idx], &customers.periodUsed[idx * MAX_PERIODS], &customers.used[idx],
+                    &customers.type[idx], rates.data(), &amount);
+        return amount;
+    }
+    
+    // Append a change to the log (if we have one) - returns its sequence
+    // number, or 0 with no log. See logDurable.
+    uint64_t logChange(WriteAheadLog::Type type, const LogWriter& w) {
+        return wal ? wal->append(type, w.out) : 0;
+    }
+    
+    // Wait for a logged change to be on disk - false if the log couldn't
+    // write it (the change still stands in memory, but a restart loses it)
+    bool logDurable(uint64_t seq) {
+        if (!seq || wal->waitDurable(seq)) return true;
+        cerr << "Change " << seq << " didn't make it into the write-ahead log\n";
+        return false;
+    }
+    
+    // Redo one logged change. Same methods as normal use - the log isn't
+    // open yet while we replay, so nothing gets logged twice.
+    bool applyLogRecord(WriteAheadLog::Type type, const string& payload) {
+        LogReader r(payload);
+        switch (type) {
+            case WriteAheadLog::ADD_CUSTOMER: {
+                CustomerInfo info;
+                info.id = r.get<int32_t>();
+                info.type = toEnergyType(r.get<uint8_t>());
+                info.allocated = r.get<double>();
+                info.name = r.getString();
+                info.province = r.getString();
+                info.email = r.getString();
+                info.address = r.getString();
+                if (r.ok) addCustomer(info);
+                break;
+            }
+            case WriteAheadLog::USAGE: {
+                int id = r.get<int32_t>();
+                double amt = r.get<double>();
+                int period = r.more() ? r.get<uint8_t>() : 0;   // older logs were all flat
+                if (!r.ok || period >= MAX_PERIODS) return false;
+                // It passed the allocation check when it was logged - checking
+                // again could turn it away over rounding
+                auto it = idIndex.find(id);
+                if (it != idIndex.end()) {
+                    UsageAdded added;
+                    added.total = amt;
+                    added.periods[period] = amt;
+                    added.intervals.push_back({UsageSeries::intervalOf(now()), UsageSeries::toUnits(amt), false});
+                    customers.restoreUsage(it->second, added);
+                    updateTotals(it->second, &added);
+                }
+                break;
+            }
+            case WriteAheadLog::USAGE_BATCH: {
+                int id = r.get<int32_t>();
+                UsageAdded added;
+                added.total = r.get<double>();
+                uint8_t touched = r.get<uint8_t>();
+                for (int p = 0; p < MAX_PERIODS; p++)
+                    if (touched & (1 << p)) added.periods[p] = r.get<double>();
+                uint32_t groups = r.get<uint32_t>();
+                if (!r.ok || groups > payload.size() / (2 * sizeof(int64_t))) return false;
+                added.intervals.resize(groups);
+                for (auto& g : added.intervals) {
+                    g.interval = r.get<int64_t>();
+                    g.units = r.get<int64_t>();
+                }
+                if (!r.ok || touched >> MAX_PERIODS) return false;
+                auto it = idIndex.find(id);
+                if (it != idIndex.end()) {
+                    customers.restoreUsage(it->second, added);
+                    updateTotals(it->second, &added);
+                }
+                break;
+            }
+            case WriteAheadLog::SET_PLAN: {
+                int id = r.get<int32_t>();
+                int plan = r.get<uint8_t>();
+                time_t when = r.get<int64_t>();
+                if (!r.ok || !setCustomerPlan(id, plan, when)) return false;
+                break;
+            }
+            case WriteAheadLog::BILL: {
+                int id = r.get<int32_t>();
+                time_t when = r.get<int64_t>();
+                if (r.ok) createBill(id, when);
+                break;
+            }
+            case WriteAheadLog::PAYMENT: {
+                int id = r.get<int32_t>();
+                int bill = r.get<int32_t>();
+                double amt = r.get<double>();
+                if (r.ok) makePayment(id, bill, amt);
+                break;
+            }
+            case WriteAheadLog::PAYMENT_BATCH: {
+                uint32_t n = r.get<uint32_t>();
+                if (!r.ok || n > payload.size() / (sizeof(int32_t) + sizeof(double))) return false;
+                vector<Remittance> batch(n);
+                for (auto& pay : batch) {
+                    pay.customerId = r.get<int32_t>();
+                    pay.amount = r.get<double>();
+                }
+                if (r.ok) postPayments(batch, 1);
+                break;
+            }
+            case WriteAheadLog::WORK_ORDER: {
+                MaintenanceScheduler::WorkOrder o;
+                o.number = r.get<int32_t>();
+                o.customerId = r.get<int32_t>();
+                o.due = r.get<int64_t>();
+                o.priority = r.get<uint8_t>();
+                o.task = r.getString();
+                auto it = idIndex.find(o.customerId);
+                if (!r.ok || o.number < 0 || it == idIndex.end()) return false;
+                o.province = customers.province[it->second];
+                maintenance.add(o);
+                break;
+            }
+            case WriteAheadLog::WORK_ORDER_DONE: {
+                int number = r.get<int32_t>();
+                time_t when = r.get<int64_t>();
+                double cost = r.get<double>();
+                if (r.ok) finishWorkOrder(number, cost, when);
+                break;
+            }
+            case WriteAheadLog::WORK_ORDER_CANCEL: {
+                int number = r.get<int32_t>();
+                if (r.ok) maintenance.cancel(number);
+                break;
+            }
+            case WriteAheadLog::MAINTENANCE: {
+                int id = r.get<int32_t>();
+                time_t when = r.get<int64_t>();
+                double cost = r.get<double>();
+                string desc = r.getString();
+                auto it = idIndex.find(id);
+                if (r.ok && it != idIndex.end()) customers.addMaintenance(it->second, desc, cost, when);
+                break;
+            }
+            case WriteAheadLog::TRADE: {
+                EnergyType t = toEnergyType(r.get<uint8_t>());
+                bool isImport = r.get<uint8_t>();
+                double qty = r.get<double>(), price = r.get<double>();
+                time_t date = r.get<int64_t>();
+                if (r.ok) {
+                    ImportExport trade(t, qty, price, isImport);
+                    trade.date = date;
+                    addTrade(trade);
+                }
+                break;
+            }
+            case WriteAheadLog::TRADE_BATCH: {
+                uint32_t n = r.get<uint32_t>();
+                if (!r.ok || n > payload.size() / (2 + 3 * sizeof(double))) return false;
+                vector<ImportExport> batch;
+                batch.reserve(n);
+                for (uint32_t k = 0; k < n && r.ok; k++) {
+                    EnergyType t = toEnergyType(r.get<uint8_t>());
+                    bool isImport = r.get<uint8_t>();
+                    double qty = r.get<double>(), price = r.get<double>();
+                    batch.emplace_back(t, qty, price, isImport);
+                    batch.back().date = r.get<int64_t>();
+                }
+                if (r.ok) addTrades(batch);
+                break;
+            }
+            case WriteAheadLog::BILLING_RUN: {     // older logs - a whole run in one record
+                time_t when = r.get<int64_t>();
+                if (r.ok) runBilling(when, 0);
+                break;
+            }
+            case WriteAheadLog::BILLING_CHUNK: {
+                time_t when = r.get<int64_t>();
+                uint32_t ch = r.get<uint32_t>();
+                if (!r.ok || ch >= customers.segments.size()) return false;
+                int bills = 0;
+                double billed = 0;
+                shared_lock<RWLock> layout(customers.layout);
+                unique_lock<RWLock> rows(customers.segments[ch]);
+                billSegment(ch, when, bills, billed);
+                break;
+            }
+            case WriteAheadLog::GENERATE: {
+                time_t when = r.get<int64_t>();
+                GeneratorConfig cfg;
+                cfg.seed = r.get<uint64_t>();
+                cfg.customers = r.get<uint64_t>();
+                cfg.firstId = r.get<int32_t>();
+                cfg.provinces = r.get<int32_t>();
+                cfg.billMonths = r.get<int32_t>();
+                cfg.paidShare = r.get<double>();
+                cfg.usage = static_cast<GeneratorConfig::UsageShape>(r.get<uint8_t>());
+                cfg.usageMean = r.get<double>();
+                cfg.usageSpread = r.get<double>();
+                cfg.allocMin = r.get<double>();
+                cfg.allocMax = r.get<double>();
+                cfg.usageDays = r.get<int32_t>();
+                cfg.readingsPerDay = r.get<int32_t>();
+                cfg.maintenanceShare = r.get<double>();
+                cfg.trades = r.get<uint64_t>();
+                uint32_t madeBy = r.get<uint32_t>();        // logs from before it was added don't have one
+                if (madeBy != generatorFingerprint()) {
+                    cerr << "Generated customers in the log came from a different generator - "
+                            "they can't be made again, start from a snapshot\n";
+                    return false;
+                }
+                if (!r.ok || !generatorConfigOk(cfg)) return false;
+                generateRows(cfg, when, 0);
+                break;
+            }
+            default:
+                r.ok = false;
+        }
+        return r.ok;
+    }
+    
+    // Throw away everything (before loading a snapshot)
+    void clearData() {
+        customers.clear();
+        provinceRows.assign(customers.provinceNames.size(), {});
+        idIndex.clear();
+        searchIndex.clear();
+        provinceTotals.assign(customers.provinceNames.size(), Totals());
+        overall = Totals();
+        counted.clear();
+        changedIn.clear();
+        lastReport = ReportCheckpoint();
+        pendingUsage.clear();
+        dueBills = {};
+        overdueSet.clear();
+        ledger.clear();
+        maintenance.clear();
+    }
+    
+    // Rebuild the lookups, totals and overdue heap from the customer columns
+    void rebuildDerived() {
+        provinceTotals.assign(customers.provinceNames.size(), Totals());
+        counted.clear();
+        changedIn.clear();
+        indexRows(0);
+    }
+    
+    // Add rows 'first' on (filled in straight into the columns) to the
+    // lookups, totals and overdue heap. Caller holds layout exclusively.
+    void indexRows(size_t first) {
+        size_t n = customers.size();
+        customers.growSegments();
+        provinceTotals.resize(customers.provinceNames.size());
+        provinceRows.resize(customers.provinceNames.size());
+        counted.resize(n);
+        changedIn.resize(n, 0);
+        idIndex.reserve(n);
+        
+        vector<DueBill> due;
+        for (size_t i = first; i < n; i++) {
+            idIndex[customers.id[i]] = i;
+            provinceRows[customers.province[i]].push_back(i);
+            counted[i] = totalsFor(i);
+            provinceTotals[customers.province[i]].add(counted[i]);
+            overall.add(counted[i]);
+            if (customers.overdue[i]) overdueSet.insert(overdueSet.end(), i);
+            
+            const auto& payments = customers.profile[i].payments;
+            for (auto& b : payments)
+                if (!b.isPaid && !b.overdue)
+                    due.push_back({b.dueTime(), (int)i, b.number});
+        }
+        // Heapify in one go rather than pushing one by one
+        if (dueBills.empty()) dueBills = decltype(dueBills)(greater<DueBill>(), move(due));
+        else for (auto& d : due) dueBills.push(d);
+        searchIndexStale = true;
+    }
+    
+    // Caller holds searchMutex and at least a shared layout lock
+    void buildSearchIndex() {
+        searchIndexStale = false;
+        searchIndex.clear();
+        for (size_t i = 0; i < customers.size(); i++)
+            searchIndex.add(i, customers.profile[i].name, customers.profile[i].email, customers.id[i]);
+    }
+    
+    // Debug mode - recount everything and complain if the cached totals drifted.
+    // Every writer updates the totals before letting go of its segment, so
+    // with all segments held the two have to agree.
+    bool verifyTotals() {
+        shared_lock<RWLock> layout(customers.layout);
+        auto rows = customers.readAll();
+        lock_guard<mutex> totalsLock(totalsMutex);
+        vector<Totals> fresh(customers.provinceNames.size());
+        Totals all;
+        for (size_t i = 0; i < customers.size(); i++) {
+            Totals t = totalsFor(i);
+            fresh[customers.province[i]].add(t);
+            all.add(t);
+        }
+        
+        bool ok = overall == all;
+        for (size_t p = 0; p < fresh.size(); p++) {
+            if (!(provinceTotals[p] == fresh[p])) {
+                cerr << "Totals mismatch for " << customers.provinceNames[p] << "\n";
+                ok = false;
+            }
+        }
+        if (!ok) cerr << "Cached totals don't match a full recount!\n";
+        return ok;
+    }
+    
+    static bool generatorConfigOk(const GeneratorConfig& cfg) {
+        bool ok = cfg.provinces >= 1 && cfg.provinces <= int(size(PROVINCES)) &&
+                  cfg.billMonths >= 0 && cfg.paidShare >= 0 && cfg.paidShare <= 1 &&
+                  cfg.usage <= GeneratorConfig::HEAVY_TAIL && cfg.usageMean >= 0 && cfg.usageSpread >= 0 &&
+                  cfg.allocMin >= 0 && cfg.allocMin <= cfg.allocMax &&
+                  cfg.usageDays >= 0 && cfg.readingsPerDay >= 1 && cfg.readingsPerDay <= UsageSeries::PER_DAY &&
+                  cfg.maintenanceShare >= 0 && cfg.maintenanceShare <= 1 &&
+                  cfg.firstId > 0 && cfg.customers <= size_t(numeric_limits<int>::max() - cfg.firstId) + 1;
+        if (!ok) cerr << "Those generator settings don't make sense\n";
+        return ok;
+    }
+    
+    // One month's usage for a customer allocated 'alloc' (see GeneratorConfig)
+    static double drawUsage(const GeneratorConfig& cfg, double alloc, mt19937_64& gen) {
+        double share = cfg.usageMean;
+        if (cfg.usageSpread > 0) {
+            switch (cfg.usage) {
+                case GeneratorConfig::UNIFORM:
+                    share = uniform_real_distribution<>(cfg.usageMean - cfg.usageSpread,
+                                                        cfg.usageMean + cfg.usageSpread)(gen);
+                    break;
+                case GeneratorConfig::NORMAL:
+                    share = normal_distribution<>(cfg.usageMean, cfg.usageSpread)(gen);
+                    break;
+                case GeneratorConfig::HEAVY_TAIL:
+                    share = cfg.usageMean * exp(normal_distribution<>(0, cfg.usageSpread)(gen));
+                    break;
+            }
+        }
+        return clamp(share, 0.0, 1.0) * alloc;
+    }
+    
+    // Fill in row i as the k'th generated customer. Only touches row i, so
+    // rows can be made on any thread.
+    void generateRow(const GeneratorConfig& cfg, size_t i, size_t k, const vector<uint8_t>& provIdx,
+                     time_t t, mt19937_64& gen) {
+        const time_t MONTH = 30 * 24 * 60 * 60;
+        auto pick = [&](auto& list) { return list[uniform_int_distribution<size_t>(0, size(list) - 1)(gen)]; };
+        auto chance = [&](double p) { return uniform_real_distribution<>(0, 1)(gen) < p; };
+        
+        int id = cfg.firstId + int(k);
+        int prov = k % provIdx.size();
+        customers.id[i] = id;
+        customers.province[i] = provIdx[prov];
+        customers.type[i] = typeAt(uniform_int_distribution<size_t>(0, ENERGY_TYPE_COUNT - 1)(gen));
+        double alloc = uniform_real_distribution<>(cfg.allocMin, cfg.allocMax)(gen);
+        customers.allocated[i] = alloc;
+        
+        // Email is first initial + last name + ID, so every one is different
+        CustomerProfile& p = customers.profile[i];
+        string first = pick(GENERATOR_FIRST_NAMES), last = pick(GENERATOR_LAST_NAMES);
+        p.name = first + " " + last;
+        p.email = string(1, first[0]) + last;
+        transform(p.email.begin(), p.email.end(), p.email.begin(), ::tolower);
+        p.email += to_string(id) + "@email.com";
+        p.address = to_string(uniform_int_distribution<>(100, 9999)(gen)) + " " + pick(GENERATOR_STREETS) + ", " +
+                    customers.provinceNames[provIdx[prov]];
+        
+        // Bills a month apart, each for a month's usage
+        double* periods = &customers.periodUsed[i * MAX_PERIODS];
+        for (int m = cfg.billMonths; m >= 1; m--) {
+            customers.used[i] = periods[0] = drawUsage(cfg, alloc, gen);
+            customers.createBill(i, billAmount(i), t - m * MONTH);
+            if (chance(cfg.paidShare)) customers.makePayment(i, p.billCount - 1, p.payments.back().amount);
+        }
+        if (chance(cfg.maintenanceShare)) {
+            time_t when = t - uniform_int_distribution<time_t>(0, max(1, cfg.billMonths) * MONTH)(gen);
+            customers.addMaintenance(i, "Equipment check", uniform_real_distribution<>(50, 200)(gen), when);
+        }
+        
+        // This cycle so far, spread unevenly over the readings
+        double cycle = drawUsage(cfg, alloc, gen);
+        int readings = cfg.usageDays * cfg.readingsPerDay;
+        if (readings == 0) {
+            customers.used[i] = periods[0] = cycle;
+            return;
+        }
+        thread_local vector<double> weight;
+        weight.resize(readings);
+        double totalWeight = 0;
+        for (auto& w : weight) totalWeight += w = uniform_real_distribution<>(0.5, 1.5)(gen);
+        int64_t step = UsageSeries::PER_DAY / cfg.readingsPerDay;
+        int64_t interval = UsageSeries::intervalOf(t) - (readings - 1) * step;
+        double used = 0;
+        for (int r = 0; r < readings; r++, interval += step) {
+            double amt = cycle * weight[r] / totalWeight;
+            customers.usage[i].add(interval, UsageSeries::toUnits(amt));
+            used += amt;
+        }
+        customers.used[i] = periods[0] = used;
+    }
+    
+    // The work behind generateData (and its log record). Rows are made a
+    // chunk at a time, each chunk with its own random stream seeded from
+    // the chunk number - so the threads can take chunks in any order.
+    void generateRows(const GeneratorConfig& cfg, time_t t, unsigned threadCount) {
+        {
+            unique_lock<RWLock> layout(customers.layout);
+            lock_guard<mutex> search(searchMutex);
+            vector<uint8_t> provIdx;
+            for (int p = 0; p < cfg.provinces; p++)
+                provIdx.push_back(customers.provinceIndex(PROVINCES[p]));
+            size_t first = customers.grow(cfg.customers);
+            
+            const size_t CHUNK = CustomerStore::SEGMENT_ROWS;
+            size_t chunkCount = (cfg.customers + CHUNK - 1) / CHUNK;
+            atomic<size_t> nextChunk{0};
+            auto work = [&] {
+                for (size_t ch; (ch = nextChunk++) < chunkCount;) {
+                    seed_seq seq{uint32_t(cfg.seed), uint32_t(cfg.seed >> 32), uint32_t(ch), uint32_t(ch >> 32)};
+                    mt19937_64 gen(seq);
+                    size_t end = min(cfg.customers, (ch + 1) * CHUNK);
+                    for (size_t k = ch * CHUNK; k < end; k++) generateRow(cfg, first + k, k, provIdx, t, gen);
+                }
+            };
+            if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+            threadCount = max<size_t>(1, min<size_t>(threadCount, chunkCount));
+            vector<thread> pool;
+            for (unsigned i = 1; i < threadCount; i++)
+                pool.emplace_back(work);
+            work();
+            for (auto& th : pool) th.join();
+            
+            lock_guard<mutex> totalsLock(totalsMutex);
+            indexRows(first);
+        }
+        
+        // Trades get a stream of their own, spread over the billing history
+        seed_seq seq{uint32_t(cfg.seed), uint32_t(cfg.seed >> 32), ~0u, ~0u};
+        mt19937_64 gen(seq);
+        time_t span = max(1, cfg.billMonths) * 30 * 24 * 60 * 60;
+        vector<ImportExport> batch;
+        batch.reserve(cfg.trades);
+        for (size_t k = 0; k < cfg.trades; k++) {
+            EnergyType type = typeAt(uniform_int_distribution<size_t>(0, ENERGY_TYPE_COUNT - 1)(gen));
+            double rate = rates[typeIndex(type)];
+            double qty = uniform_real_distribution<>(1000, 10000)(gen);
+            double price = uniform_real_distribution<>(rate * 0.7, rate * 1.3)(gen);
+            ImportExport trade(type, qty, price, uniform_int_distribution<>(0, 2)(gen) != 0); // 2/3 are imports
+            trade.date = t - uniform_int_distribution<time_t>(0, span)(gen);
+            batch.push_back(trade);
+        }
+        unique_lock<RWLock> lock(tradeLock);
+        ledger.append(batch.data(), batch.size());
+    }
+
+public:
+    // Constructor - set up initial energy rates
+    EnergySystem() : provinceRows(PROVINCE_COUNT), provinceTotals(PROVINCE_COUNT) {
+        // These rates are per unit (kWh, barrel, etc.)
+        for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++)
+            rates[t] = ENERGY_TYPES[t].defaultRate;
+    }
+    
+    // Threads: searches, lookups, stats, reports and Customer getters can run
+    // from any number of threads alongside billing, ingestion, payments and
+    // adding customers. Loading a snapshot, replaying a log, generating data
+    // and the setters are for setting up, before other threads start.
+    
+    int customerCount() const {
+        shared_lock<RWLock> layout(customers.layout);
+        return customers.size();
+    }
+    
+    // Add a customer to the system. Taken by value, so callers passing a
+    // temporary (or std::move) have their strings moved all the way into
+    // the store instead of copied.
+    Customer addCustomer(CustomerInfo info) {
+        unique_lock<RWLock> layout(customers.layout);
+        lock_guard<mutex> search(searchMutex);
+        int idx = customers.add(move(info));
+        const CustomerProfile& p = customers.profile[idx];
+        int id = customers.id[idx];
+        
+        if (provinceTotals.size() < customers.provinceNames.size()) {
+            provinceTotals.resize(customers.provinceNames.size());
+            provinceRows.resize(customers.provinceNames.size());
+        }
+        provinceRows[customers.province[idx]].push_back(idx);
+        idIndex[id] = idx;
+        counted.push_back(Totals());
+        changedIn.push_back(0);
+        updateTotals(idx);
+        if (!searchIndexStale) searchIndex.add(idx, p.name, p.email, id);
+        
+        logChange(WriteAheadLog::ADD_CUSTOMER, LogWriter().put<int32_t>(id)
+                  .put<uint8_t>(static_cast<uint8_t>(customers.type[idx])).put(customers.allocated[idx])
+                  .put(p.name).put(customers.provinceNames[customers.province[idx]]).put(p.email).put(p.address));
+        return Customer(&customers, idx);
+    }
+    
+    // Same as addCustomer, built straight from the fields
+    Customer emplaceCustomer(int id, string name, string prov, string mail, string addr,
+                             EnergyType type, double alloc) {
+        return addCustomer({id, move(name), move(prov), move(mail), move(addr), type, alloc});
+    }
+    
+    // Make room for this many customers before a big load
+    void reserveCustomers(size_t n) {
+        unique_lock<RWLock> layout(customers.layout);
+        customers.reserve(n);
+        counted.reserve(n);
+        changedIn.reserve(n);
+        idIndex.reserve(n);
+    }
+    
+    // Record usage for a customer - false if they're over their allocation or don't exist
+    bool useEnergy(int id, double amt) {
+        return addUsage(id, &amt, nullptr, 1) == 1;
+    }
+    
+    // Apply a batch of usage for one customer (see CustomerStore::useEnergyBatch).
+    // 'when' is each reading's time, for time-of-use plans - null means now.
+    int useEnergyBatch(int id, const double* amts, size_t n, const time_t* when = nullptr) {
+        return addUsage(id, amts, when, n);
+    }
+    
+    // Usage from 'from' up to 'to' out of the interval series (15 minute
+    // steps, to a thousandth of a unit) - -1 if there's no such customer
+    double usageBetween(int id, time_t from, time_t to) const {
+        shared_lock<RWLock> layout(customers.layout);
+        auto it = idIndex.find(id);
+        if (it == idIndex.end()) return -1;
+        shared_lock<RWLock> row(customers.segmentFor(it->second));
+        int64_t fromIv = UsageSeries::intervalOf(from);
+        int64_t toIv = to > from ? UsageSeries::intervalOf(to - 1) + 1 : fromIv;
+        return UsageSeries::toAmount(customers.usage[it->second].sum(fromIv, toIv));
+    }
+    
+    // Usage from 'from' up to 'to' in buckets of 'bucketSeconds' (a whole
+    // number of 15 minute intervals) - empty if there's no such customer
+    vector<double> usageProfile(int id, time_t from, time_t to, int bucketSeconds = 60*60) const {
+        int64_t fromIv, toIv, bucket;
+        if (!usageRange(from, to, bucketSeconds, fromIv, toIv, bucket)) return {};
+        shared_lock<RWLock> layout(customers.layout);
+        auto it = idIndex.find(id);
+        if (it == idIndex.end()) return {};
+        vector<int> row{it->second};
+        vector<long long> units = usageByBucket(&row, fromIv, toIv, bucket);
+        vector<double> out;
+        for (long long u : units) out.push_back(UsageSeries::toAmount(u));
+        return out;
+    }
+    
+    // Same, added up over everyone in a province ("" for everyone)
+    vector<double> provinceUsageProfile(const string& prov, time_t from, time_t to,
+                                        int bucketSeconds = 24*60*60) const {
+        int64_t fromIv, toIv, bucket;
+        if (!usageRange(from, to, bucketSeconds, fromIv, toIv, bucket)) return {};
+        shared_lock<RWLock> layout(customers.layout);
+        vector<long long> units;
+        if (prov.empty()) {
+            units = usageByBucket(nullptr, fromIv, toIv, bucket);
+        } else {
+            int id = customers.findProvince(prov);
+            static const vector<int> none;
+            units = usageByBucket(id < 0 || id >= (int)provinceRows.size() ? &none : &provinceRows[id],
+                                  fromIv, toIv, bucket);
+        }
+        vector<double> out;
+        for (long long u : units) out.push_back(UsageSeries::toAmount(u));
+        return out;
+    }
+    
+    // Compile a rate plan so customers can be put on it - returns its number,
+    // -1 if it isn't valid. Plans aren't saved anywhere, so add them in the
+    // same order before loading a snapshot or replaying a log.
+    int addRatePlan(const RatePlan& plan) { return plans.add(plan); }
+    const RatePlanBook& ratePlans() const { return plans; }
+    
+    // Move a customer to another plan. Usage so far this cycle was split up
+    // by the old plan's periods, so it gets billed under the old plan first.
+    bool setCustomerPlan(int id, int plan, time_t when = 0) {
+        if (plan < 0 || plan >= (int)plans.size()) return false;
+        if (when == 0) when = now();
+        shared_lock<RWLock> layout(customers.layout);
+        auto it = idIndex.find(id);
+        if (it == idIndex.end()) return false;
+        int idx = it->second;
+        unique_lock<RWLock> row(customers.segmentFor(idx));
+        if (customers.plan[idx] == plan) return true;
+        
+        if (customers.used[idx] > 0) {
+            customers.createBill(idx, billAmount(idx), when);
+            scheduleBill(idx, customers.profile[idx].billCount - 1);
+            updateTotals(idx);
+        }
+        customers.plan[idx] = plan;
+        changedIn[idx] = reportGeneration.load(memory_order_relaxed);
+        logChange(WriteAheadLog::SET_PLAN, LogWriter().put<int32_t>(id).put<uint8_t>(plan).put<int64_t>(when));
+        return true;
+    }
+    
+    // Pay one of a customer's bills - REJECTED if there's no such bill or
+    // it's paid already (see PaymentResult)
+    PaymentResult makePayment(int id, int bill, double amt) {
+        uint64_t seq;
+        {
+            shared_lock<RWLock> layout(customers.layout);
+            auto it = idIndex.find(id);
+            if (it == idIndex.end()) return PaymentResult::REJECTED;
+            unique_lock<RWLock> row(customers.segmentFor(it->second));
+            if (!customers.makePayment(it->second, bill, amt)) return PaymentResult::REJECTED;
+            if (!customers.overdue[it->second]) {
+                lock_guard<mutex> lock(overdueMutex);
+                overdueSet.erase(it->second);
+            }
+            updateTotals(it->second);
+            seq = logChange(WriteAheadLog::PAYMENT, LogWriter().put<int32_t>(id).put<int32_t>(bill).put(amt));
+        }
+        // Don't sit on the locks while waiting for the disk
+        return !durablePayments || logDurable(seq) ? PaymentResult::PAID : PaymentResult::NOT_SAVED;
+    }
+    
+    // Post a remittance batch. Each payment goes on the customer's open
+    // bills oldest first, part paying the last one if it runs out. Store
+    // segments are shared out between 'threadCount' threads (0 = one per
+    // core); a customer's payments stay in batch order. Each segment's
+    // totals, overdue list and log record are updated once, not per
+    // payment. Anything that didn't pay bills off exactly ends up in the
+    // report's issues.
+    PostingReport postPayments(const vector<Remittance>& batch, unsigned threadCount = 0) {
+        auto start = chrono::steady_clock::now();
+        const size_t SEG = CustomerStore::SEGMENT_ROWS;
+        PostingReport report;
+        report.payments = batch.size();
+        
+        // What happened to each line, filled in by whoever has its segment
+        struct Outcome {
+            double applied = 0;
+            PaymentIssue::Kind kind = PaymentIssue::UNKNOWN_CUSTOMER;
+            bool issue = true;
+        };
+        vector<Outcome> outcome(batch.size());
+        vector<int> rowOf(batch.size(), -1);
+        
+        uint64_t lastSeq = 0;
+        int billsPaid = 0, billsPartlyPaid = 0;
+        {
+            shared_lock<RWLock> layout(customers.layout);
+            
+            // Lines grouped by segment, in batch order within each
+            size_t segCount = customers.segments.size();
+            vector<size_t> segStart(segCount + 1, 0);
+            for (size_t k = 0; k < batch.size(); k++) {
+                const Remittance& pay = batch[k];
+                if (!isfinite(pay.amount) || pay.amount <= CustomerStore::PAYMENT_SLACK) {
+                    outcome[k].kind = PaymentIssue::BAD_AMOUNT;
+                    continue;
+                }
+                auto it = idIndex.find(pay.customerId);
+                if (it == idIndex.end()) continue;
+                rowOf[k] = it->second;
+                segStart[it->second / SEG + 1]++;
+            }
+            partial_sum(segStart.begin(), segStart.end(), segStart.begin());
+            vector<size_t> lines(segStart[segCount]);
+            {
+                vector<size_t> fill(segStart.begin(), segStart.end() - 1);
+                for (size_t k = 0; k < batch.size(); k++)
+                    if (rowOf[k] >= 0) lines[fill[rowOf[k] / SEG]++] = k;
+            }
+            vector<size_t> busy;
+            for (size_t s = 0; s < segCount; s++)
+                if (segStart[s + 1] > segStart[s]) busy.push_back(s);
+            
+            atomic<size_t> next{0};
+            mutex resultLock;
+            auto work = [&] {
+                int paid = 0, partly = 0;
+                uint64_t seq = 0;
+                vector<Totals> change(provinceTotals.size());
+                vector<int> touched, cleared;
+                for (size_t b; (b = next++) < busy.size();) {
+                    size_t s = busy[b];
+                    unique_lock<RWLock> rows(customers.segments[s]);
+                    LogWriter w;
+                    w.put<uint32_t>(segStart[s + 1] - segStart[s]);
+                    touched.clear();
+                    for (size_t l = segStart[s]; l < segStart[s + 1]; l++) {
+                        size_t k = lines[l];
+                        int i = rowOf[k];
+                        w.put<int32_t>(batch[k].customerId).put(batch[k].amount);
+                        bool hadOverdue = customers.overdue[i];
+                        bool partial = false;
+                        int before = paid;
+                        double left = customers.payOldestFirst(i, batch[k].amount, paid, partial);
+                        
+                        Outcome& o = outcome[k];
+                        o.applied = batch[k].amount - left;
+                        o.issue = partial || left > 0;
+                        o.kind = partial ? PaymentIssue::PARTIAL
+                               : paid == before && left > 0 ? PaymentIssue::NOTHING_OWED
+                               : PaymentIssue::OVERPAID;
+                        partly += partial;
+                        if (hadOverdue && !customers.overdue[i]) cleared.push_back(i);
+                        touched.push_back(i);
+                    }
+                    
+                    // Each customer counted once, however many payments they had
+                    sort(touched.begin(), touched.end());
+                    touched.erase(unique(touched.begin(), touched.end()), touched.end());
+                    for (int i : touched) change[customers.province[i]].add(takeChange(i));
+                    if (!cleared.empty()) {
+                        lock_guard<mutex> lock(overdueMutex);
+                        for (int i : cleared) overdueSet.erase(i);
+                        cleared.clear();
+                    }
+                    {
+                        lock_guard<mutex> lock(totalsMutex);
+                        for (size_t p = 0; p < change.size(); p++) {
+                            provinceTotals[p].add(change[p]);
+                            overall.add(change[p]);
+                            change[p] = Totals();
+                        }
+                    }
+                    seq = max(seq, logChange(WriteAheadLog::PAYMENT_BATCH, w));
+                }
+                lock_guard<mutex> lock(resultLock);
+                billsPaid += paid;
+                billsPartlyPaid += partly;
+                lastSeq = max(lastSeq, seq);
+            };
+            
+            if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+            threadCount = max<size_t>(1, min<size_t>(threadCount, busy.size()));
+            vector<thread> pool;
+            for (unsigned t = 1; t < threadCount; t++) pool.emplace_back(work);
+            work();
+            for (auto& th : pool) th.join();
+            report.threads = threadCount;
+        }
+        // Don't sit on the locks while waiting for the disk
+        if (durablePayments) report.durable = logDurable(lastSeq);
+        
+        // Added up in batch order so the totals come out the same every run
+        report.billsPaid = billsPaid;
+        report.billsPartlyPaid = billsPartlyPaid;
+        for (size_t k = 0; k < batch.size(); k++) {
+            const Outcome& o = outcome[k];
+            if (isfinite(batch[k].amount)) report.received += batch[k].amount;
+            report.applied += o.applied;
+            if (!o.issue) {
+                report.matched++;
+                continue;
+            }
+            report.issues.push_back({k, o.kind, batch[k].customerId, batch[k].amount, o.applied, batch[k].reference});
+        }
+        report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return report;
+    }
+    
+    // Record an import/export transaction
+    void addTrade(const ImportExport& t) {
+        unique_lock<RWLock> lock(tradeLock);
+        ledger.append(&t, 1);
+        logChange(WriteAheadLog::TRADE, LogWriter().put<uint8_t>(static_cast<uint8_t>(t.type))
+                  .put<uint8_t>(t.isImport).put(t.quantity).put(t.price).put<int64_t>(t.date));
+    }
+    
+    // A batch from the trading system - one lock and one log record for all of it
+    void addTrades(const vector<ImportExport>& batch) {
+        if (batch.empty()) return;
+        unique_lock<RWLock> lock(tradeLock);
+        ledger.append(batch.data(), batch.size());
+        if (!wal) return;
+        LogWriter w;
+        w.put<uint32_t>(batch.size());
+        for (auto& t : batch)
+            w.put<uint8_t>(static_cast<uint8_t>(t.type)).put<uint8_t>(t.isImport)
+             .put(t.quantity).put(t.price).put<int64_t>(t.date);
+        logChange(WriteAheadLog::TRADE_BATCH, w);
+    }
+    
+    // Import (or export) value per energy type, indexed by EnergyType
+    PerType<double> tradeTotalsByType(bool imports) const {
+        shared_lock<RWLock> lock(tradeLock);
+        PerType<double> sums{};
+        for (size_t t = 0; t < ENERGY_TYPE_COUNT; t++)
+            sums[t] = imports ? ledger.total()[t].importValue() : ledger.total()[t].exportValue();
+        return sums;
+    }
+    
+    // Trades dated in [from, to), of one type or all of them
+    TradeLedger::Sums tradesBetween(time_t from, time_t to) const {
+        shared_lock<RWLock> lock(tradeLock);
+        return ledger.between(from, to);
+    }
+    TradeLedger::Sums tradesBetween(EnergyType type, time_t from, time_t to) const {
+        shared_lock<RWLock> lock(tradeLock);
+        return ledger.between(type, from, to);
+    }
+    
+    size_t tradeCount() const {
+        shared_lock<RWLock> lock(tradeLock);
+        return ledger.size();
+    }
+    
+    // Run what-if scenarios over the customers as of now (see
+    // CapacityPlanner). Demand is each customer's last 30 days of usage, or
+    // what they've used this period if the series has nothing; supply is
+    // today's allocations plus the last 30 days of net imports. Nothing is
+    // changed - the locks are only held while the columns are copied.
+    CapacityPlan planCapacity(const vector<Scenario>& scenarios, unsigned threadCount = 0) const {
+        CapacityPlanner::Base base;
+        time_t to = now(), from = to - 30 * 24 * 60 * 60;
+        {
+            shared_lock<RWLock> layout(customers.layout);
+            auto rows = customers.readAll();
+            size_t n = customers.size();
+            base.province = customers.province;
+            base.type = customers.type;
+            base.allocated = customers.allocated;
+            base.provinceNames = customers.provinceNames;
+            base.rates = rates;
+            base.demand.resize(n);
+            int64_t fromIv = UsageSeries::intervalOf(from), toIv = UsageSeries::intervalOf(to - 1) + 1;
+            for (size_t i = 0; i < n; i++) {
+                int64_t units = customers.usage[i].sum(fromIv, toIv);
+                base.demand[i] = units > 0 ? UsageSeries::toAmount(units) : customers.used[i];
+            }
+        }
+        {
+            shared_lock<RWLock> lock(tradeLock);
+            ledger.forEach([&](const ImportExport& trade) {
+                if (trade.date >= from && trade.date < to)
+                    base.netImports[typeIndex(trade.type)] += trade.isImport ? trade.quantity : -trade.quantity;
+            });
+        }
+        return CapacityPlanner(base).run(scenarios, threadCount);
+    }
+    
+    // Bill one customer for what they've used so far
+    void createBill(int id, time_t when) {
+        shared_lock<RWLock> layout(customers.layout);
+        auto it = idIndex.find(id);
+        if (it == idIndex.end()) return;
+        unique_lock<RWLock> row(customers.segmentFor(it->second));
+        customers.createBill(it->second, billAmount(it->second), when);
+        scheduleBill(it->second, customers.profile[it->second].billCount - 1);
+        updateTotals(it->second);
+        logChange(WriteAheadLog::BILL, LogWriter().put<int32_t>(id).put<int64_t>(when));
+    }
+    
+    // Mark a work order done and put it on the customer's maintenance
+    // record. Caller holds workOrderMutex (or is replaying).
+    bool finishWorkOrder(int number, double cost, time_t when) {
+        optional<MaintenanceScheduler::WorkOrder> done = maintenance.complete(number, cost, when);
+        if (!done) return false;
+        shared_lock<RWLock> layout(customers.layout);
+        auto it = idIndex.find(done->customerId);
+        if (it == idIndex.end()) return true;
+        unique_lock<RWLock> row(customers.segmentFor(it->second));
+        customers.addMaintenance(it->second, done->task, cost, when);
+        return true;
+    }
+    
+    // A crew's shift: take the most urgent order they can, wait until it's
+    // finished, and go again - until the scheduler stops
+    MaintenanceTask crewShift(int crew) {
+        string name = maintenance.crewName(crew);
+        while (optional<MaintenanceScheduler::WorkOrder> order = co_await maintenance.nextOrder(crew)) {
+            if (dispatchHandler) dispatchHandler(name, *order);
+            co_await maintenance.finished(order->number);
+        }
+    }
+    
+    // Add maintenance work to a customer's record
+    void addMaintenance(int id, const string& desc, double cost) {
+        shared_lock<RWLock> layout(customers.layout);
+        auto it = idIndex.find(id);
+        if (it == idIndex.end()) return;
+        unique_lock<RWLock> row(customers.segmentFor(it->second));
+        time_t when = now();
+        customers.addMaintenance(it->second, desc, cost, when);
+        logChange(WriteAheadLog::MAINTENANCE, LogWriter().put<int32_t>(id).put<int64_t>(when).put(cost).put(desc));
+    }
+    
+    // Replay an existing log on top of the current state, then keep logging
+    // every change to it. latencyBudget is how long a record may wait for
+    // its fsync, so more records can share one.
+    bool openLog(const string& path, chrono::microseconds latencyBudget = chrono::microseconds(2000)) {
+        wal.reset();
+        long long bad = 0;
+        uint64_t lastSeq = 0;
+        long long applied = WriteAheadLog::replay(path, [&](WriteAheadLog::Type type, const string& payload) {
+            if (!applyLogRecord(type, payload)) bad++;
+        }, snapshotLogSeq, &lastSeq);
+        if (applied > 0)
+            cout << "Replayed " << applied << " changes from " << path << "\n";
+        if (bad > 0)
+            cerr << bad << " log records couldn't be applied\n";
+        
+        wal = make_unique<WriteAheadLog>();
+        if (!wal->open(path, latencyBudget, max(lastSeq, snapshotLogSeq))) {
+            wal.reset();
+            return false;
+        }
+        return true;
+    }
+    
+    // True if a log holds changes (i.e. there's state to restore)
+    static bool logHasRecords(const string& path) { return WriteAheadLog::hasChanges(path); }
+    
+    // fsync a file or directory by name
+    static bool syncPath(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        bool ok = fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+    
+    bool hasLog() const { return wal != nullptr; }
+    LogStats getLogStats() { return wal ? wal->getStats() : LogStats(); }
+    
+    // Paid bills older than this many days get packed into cold storage
+    // after each billing run (0 turns it off)
+    void setBillTiering(int days) { tierAfterDays = days; }
+    
+    // Interval usage older than this many days gets dropped after each
+    // billing run (0 keeps everything)
+    void setUsageRetention(int days) { usageKeepDays = days; }
+    
+    // Move old paid bills to cold storage and drop old interval usage now
+    TieringStats compactBills() {
+        shared_lock<RWLock> layout(customers.layout);
+        time_t cutoff = now() - (time_t)tierAfterDays * 60*60*24;
+        int64_t usageCutoff = UsageSeries::intervalOf(now() - (time_t)usageKeepDays * 60*60*24);
+        TieringStats st;
+        for (size_t s = 0; s < customers.segments.size(); s++) {
+            unique_lock<RWLock> rows(customers.segments[s]);
+            size_t end = min(customers.size(), (s + 1) * CustomerStore::SEGMENT_ROWS);
+            for (size_t i = s * CustomerStore::SEGMENT_ROWS; i < end; i++) {
+                if (tierAfterDays > 0) st.billsMoved += customers.compactHistory(i, cutoff);
+                if (usageKeepDays > 0) customers.usage[i].dropBefore(usageCutoff);
+                st.hotBytes += customers.profile[i].payments.capacity() * sizeof(Payment);
+                st.coldBytes += customers.profile[i].coldBills.capacity();
+                st.usageBytes += customers.usage[i].bytes();
+            }
+        }
+        return st;
+    }
+    
+    // Whether makePayment waits for its log record to hit the disk
+    void setDurablePayments(bool on) { durablePayments = on; }
+    
+    // The clock used for billing and overdue checks. Tests can swap in
+    // their own to replay a billing cycle.
+    time_t now() const { return clock(); }
+    void setClock(function<time_t()> c) { clock = move(c); }
+    
+    // Debug mode - check cached totals against a full recount after stats/reports
+    void setTotalsCheck(bool on) { checkTotals = on; }
+    
+    // Build the search index from scratch (after loading a lot of customers at once)
+    void rebuildSearchIndex() {
+        shared_lock<RWLock> layout(customers.layout);
+        lock_guard<mutex> lock(searchMutex);
+        buildSearchIndex();
+    }
+    
+    // Write everything to a binary snapshot file (see the snapshot namespace)
+    bool saveSnapshot(const string& filename) {
+        using namespace snapshot;
+        // Everything held shared until the log has been reset, so the file is
+        // one moment in time and no change slips in between it and the truncate
+        lock_guard<mutex> orders(workOrderMutex);
+        shared_lock<RWLock> layout(customers.layout);
+        auto rows = customers.readAll();
+        shared_lock<RWLock> tradesShared(tradeLock);
+        size_t n = customers.size();
+        
+        // Flatten bills, maintenance and strings into big arrays
+        vector<uint64_t> payStart{0}, maintStart{0}, strStart{0};
+        vector<PaymentRecord> pays;
+        vector<MaintRecordData> maint;
+        string strData;
+        auto addString = [&](const string& s) {
+            strData += s;
+            strStart.push_back(strData.size());
+            return strStart.size() - 2;
+        };
+        
+        vector<uint8_t> reminder(n);
+        vector<int32_t> overdueBills(n);
+        for (size_t i = 0; i < n; i++) {
+            const CustomerProfile& p = customers.profile[i];
+            addString(p.name);
+            addString(p.email);
+            addString(p.address);
+            reminder[i] = p.reminderSent;
+            overdueBills[i] = p.overdueBills;
+        }
+        for (auto& name : customers.provinceNames)
+            addString(name);
+        for (size_t i = 0; i < n; i++) {
+            const CustomerProfile& p = customers.profile[i];
+            // Snapshots always hold the full history - bill i is number i
+            for (auto& b : customers.fullHistory(i))
+                pays.push_back({b.amount, (int64_t)b.date, b.paid, b.isPaid, b.overdue, {}});
+            for (auto& m : p.maintenance)
+                maint.push_back({(int64_t)m.date, m.cost, addString(m.desc)});
+            payStart.push_back(pays.size());
+            maintStart.push_back(maint.size());
+        }
+        // Crews aren't saved, so dispatched orders go back in the queue
+        vector<WorkOrderRecord> workOrders;
+        maintenance.forEach([&](const MaintenanceScheduler::WorkOrder& o) {
+            uint8_t status = o.status == MaintenanceScheduler::DISPATCHED ? MaintenanceScheduler::OPEN : o.status;
+            workOrders.push_back({(int64_t)o.due, (int64_t)o.finished, o.cost, addString(o.task), o.number,
+                                  o.customerId, uint8_t(o.province), uint8_t(o.priority), status, {}});
+        });
+        
+        const PerType<double>& rateTable = rates;
+        
+        vector<TradeRecord> tradeRecs;
+        tradeRecs.reserve(ledger.size());
+        ledger.forEach([&](const ImportExport& t) {
+            tradeRecs.push_back({t.quantity, t.price, (int64_t)t.date,
+                                 static_cast<uint8_t>(t.type), t.isImport, {}});
+        });
+        
+        vector<uint8_t> types(n);
+        for (size_t i = 0; i < n; i++) types[i] = static_cast<uint8_t>(customers.type[i]);
+        
+        vector<UsageSeries::State> usageState(n);
+        vector<uint64_t> blockStart{0}, dataStart{0};
+        vector<UsageSeries::Block> usageBlocks;
+        vector<uint8_t> usageData;
+        for (size_t i = 0; i < n; i++) {
+            const UsageSeries& u = customers.usage[i];
+            usageState[i] = u.state();
+            usageBlocks.insert(usageBlocks.end(), u.blockList().begin(), u.blockList().end());
+            usageData.insert(usageData.end(), u.data().begin(), u.data().end());
+            blockStart.push_back(usageBlocks.size());
+            dataStart.push_back(usageData.size());
+        }
+        
+        Header h{};
+        memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version = VERSION;
+        h.byteOrder = ENDIAN_MARK;
+        h.customers = n;
+        h.provinces = customers.provinceNames.size();
+        h.payments = pays.size();
+        h.maint = maint.size();
+        h.strings = strStart.size() - 1;
+        h.trades = tradeRecs.size();
+        h.usageBlocks = usageBlocks.size();
+        h.usageBytes = usageData.size();
+        h.workOrders = workOrders.size();
+        h.logSeq = wal ? wal->lastSeq() : snapshotLogSeq;
+        
+        struct Part { const void* data; size_t bytes; };
+        Part parts[SECTION_COUNT] = {
+            {customers.id.data(), n * sizeof(int32_t)},
+            {customers.province.data(), n},
+            {types.data(), n},
+            {customers.allocated.data(), n * sizeof(double)},
+            {customers.used.data(), n * sizeof(double)},
+            {customers.owed.data(), n * sizeof(double)},
+            {customers.overdue.data(), n},
+            {reminder.data(), n},
+            {overdueBills.data(), n * sizeof(int32_t)},
+            {payStart.data(), payStart.size() * sizeof(uint64_t)},
+            {maintStart.data(), maintStart.size() * sizeof(uint64_t)},
+            {pays.data(), pays.size() * sizeof(PaymentRecord)},
+            {maint.data(), maint.size() * sizeof(MaintRecordData)},
+            {strStart.data(), strStart.size() * sizeof(uint64_t)},
+            {strData.data(), strData.size()},
+            {rateTable.data(), rateTable.size() * sizeof(double)},
+            {tradeRecs.data(), tradeRecs.size() * sizeof(TradeRecord)},
+            {customers.plan.data(), n},
+            {customers.periodUsed.data(), n * MAX_PERIODS * sizeof(double)},
+            {usageState.data(), n * sizeof(UsageSeries::State)},
+            {blockStart.data(), blockStart.size() * sizeof(uint64_t)},
+            {usageBlocks.data(), usageBlocks.size() * sizeof(UsageSeries::Block)},
+            {dataStart.data(), dataStart.size() * sizeof(uint64_t)},
+            {usageData.data(), usageData.size()},
+            {workOrders.data(), workOrders.size() * sizeof(WorkOrderRecord)},
+        };
+        
+        uint64_t offset = sizeof(Header);
+        for (int s = 0; s < SECTION_COUNT; s++) {
+            offset = (offset + 7) & ~uint64_t(7);
+            h.sections[s] = {offset, parts[s].bytes};
+            offset += parts[s].bytes;
+        }
+        
+        // Write to a temp file and rename, so a crash never leaves half a snapshot
+        string tmp = filename + ".tmp";
+        ofstream out(tmp, ios::binary | ios::trunc);
+        if (!out) {
+            cerr << "Couldn't open snapshot file: " << tmp << endl;
+            return false;
+        }
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        uint64_t pos = sizeof(Header);
+        const char zeros[8] = {};
+        for (int s = 0; s < SECTION_COUNT; s++) {
+            out.write(zeros, h.sections[s].offset - pos);
+            out.write(static_cast<const char*>(parts[s].data), parts[s].bytes);
+            pos = h.sections[s].offset + parts[s].bytes;
+        }
+        out.close();
+        // On disk before the rename, and the rename on disk before the log
+        // is emptied, so a power cut leaves the old snapshot and log or the
+        // new snapshot - never an empty one
+        size_t slash = filename.rfind('/');
+        string dir = slash == string::npos ? "." : slash == 0 ? "/" : filename.substr(0, slash);
+        if (!out || !syncPath(tmp) || rename(tmp.c_str(), filename.c_str()) != 0 || !syncPath(dir)) {
+            cerr << "Couldn't write snapshot file: " << filename << endl;
+            return false;
+        }
+        
+        // Everything in the log is in the snapshot now. If the truncate
+        // doesn't happen, replay skips what the snapshot has (h.logSeq).
+        snapshotLogSeq = h.logSeq;
+        if (wal && !wal->truncate()) {
+            cerr << "Couldn't reset the write-ahead log after the snapshot\n";
+            return false;
+        }
+        return true;
+    }
+    
+    // Replace everything with what's in a snapshot file. The file is mapped
+    // into memory and each section is copied straight into its column.
+    bool loadSnapshot(const string& filename) {
+        using namespace snapshot;
+        
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Couldn't open snapshot file: " << filename << endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+            cerr << "Snapshot file is too small: " << filename << endl;
+            close(fd);
+            return false;
+        }
+        size_t fileSize = st.st_size;
+        void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            cerr << "Couldn't map snapshot file: " << filename << endl;
+            return false;
+        }
+        const char* base = static_cast<const char*>(mapped);
+        
+        Header h;
+        memcpy(&h, base, sizeof(h));
+        
+        // Check the header and that every section is the size it should be
+        uint64_t n = h.customers;
+        uint64_t expected[SECTION_COUNT] = {
+            n * sizeof(int32_t), n, n, n * sizeof(double), n * sizeof(double), n * sizeof(double),
+            n, n, n * sizeof(int32_t), (n + 1) * sizeof(uint64_t), (n + 1) * sizeof(uint64_t),
+            h.payments * sizeof(PaymentRecord), h.maint * sizeof(MaintRecordData),
+            (h.strings + 1) * sizeof(uint64_t), 0, ENERGY_TYPE_COUNT * sizeof(double), h.trades * sizeof(TradeRecord),
+            n, n * MAX_PERIODS * sizeof(double),
+            n * sizeof(UsageSeries::State), (n + 1) * sizeof(uint64_t), h.usageBlocks * sizeof(UsageSeries::Block),
+            (n + 1) * sizeof(uint64_t), h.usageBytes, h.workOrders * sizeof(WorkOrderRecord)
+        };
+        bool ok = memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 && h.version == VERSION &&
+                  h.byteOrder == ENDIAN_MARK && h.provinces <= 256 &&
+                  h.strings >= 3 * n + h.provinces + h.maint + h.workOrders;
+        for (int s = 0; s < SECTION_COUNT && ok; s++) {
+            const SectionInfo& sec = h.sections[s];
+            ok = sec.offset % 8 == 0 && sec.offset <= fileSize && sec.bytes <= fileSize - sec.offset &&
+                 (s == STRING_DATA || sec.bytes == expected[s]);
+        }
+        
+        auto column = [&](Section s) { return base + h.sections[s].offset; };
+        const uint64_t* strStart = reinterpret_cast<const uint64_t*>(column(STRING_START));
+        const uint64_t* payStart = reinterpret_cast<const uint64_t*>(column(PAYMENT_START));
+        const uint64_t* maintStart = reinterpret_cast<const uint64_t*>(column(MAINT_START));
+        const uint8_t* provinceCol = reinterpret_cast<const uint8_t*>(column(PROVINCE));
+        const uint64_t* blockStart = reinterpret_cast<const uint64_t*>(column(USAGE_BLOCK_START));
+        const uint64_t* dataStart = reinterpret_cast<const uint64_t*>(column(USAGE_DATA_START));
+        
+        // Offsets must only go up and stay inside their sections
+        if (ok) {
+            for (uint64_t i = 0; i < h.strings && ok; i++)
+                ok = strStart[i] <= strStart[i + 1];
+            ok = ok && strStart[0] == 0 && strStart[h.strings] <= h.sections[STRING_DATA].bytes;
+            for (uint64_t i = 0; i < n && ok; i++)
+                ok = payStart[i] <= payStart[i + 1] && maintStart[i] <= maintStart[i + 1] &&
+                     blockStart[i] <= blockStart[i + 1] && dataStart[i] <= dataStart[i + 1] &&
+                     provinceCol[i] < h.provinces;
+            ok = ok && payStart[0] == 0 && payStart[n] == h.payments &&
+                 maintStart[0] == 0 && maintStart[n] == h.maint &&
+                 blockStart[0] == 0 && blockStart[n] == h.usageBlocks &&
+                 dataStart[0] == 0 && dataStart[n] == h.usageBytes;
+        }
+        if (!ok) {
+            cerr << "Not a valid snapshot file (or a different version): " << filename << endl;
+            munmap(mapped, fileSize);
+            return false;
+        }
+        const uint8_t* planCol = reinterpret_cast<const uint8_t*>(column(PLAN));
+        for (uint64_t i = 0; i < n && ok; i++)
+            ok = planCol[i] < plans.size();
+        if (!ok) {
+            cerr << "Snapshot uses rate plans that haven't been added: " << filename << endl;
+            munmap(mapped, fileSize);
+            return false;
+        }
+        
+        const char* strData = column(STRING_DATA);
+        auto getString = [&](uint64_t idx) {
+            return string(strData + strStart[idx], strStart[idx + 1] - strStart[idx]);
+        };
+        auto copyColumn = [&](auto& vec, Section s) {
+            using T = typename decay_t<decltype(vec)>::value_type;
+            vec.resize(n);
+            memcpy(vec.data(), column(s), n * sizeof(T));
+        };
+        
+        // Province IDs in the file are its own - map them onto ours
+        clearData();
+        vector<uint8_t> provinceId(h.provinces);
+        for (uint64_t p = 0; p < h.provinces; p++)
+            provinceId[p] = customers.provinceIndex(getString(3 * n + p));
+        if (customers.provinceNames.size() > 256) {
+            cerr << "Snapshot has too many provinces: " << filename << endl;
+            munmap(mapped, fileSize);
+            clearData();
+            return false;
+        }
+        
+        copyColumn(customers.id, IDS);
+        copyColumn(customers.province, PROVINCE);
+        for (auto& p : customers.province) p = provinceId[p];
+        copyColumn(customers.allocated, ALLOCATED);
+        copyColumn(customers.used, USED);
+        copyColumn(customers.owed, OWED);
+        copyColumn(customers.overdue, OVERDUE);
+        copyColumn(customers.plan, PLAN);
+        customers.periodUsed.resize(n * MAX_PERIODS);
+        memcpy(customers.periodUsed.data(), column(PERIOD_USED), n * MAX_PERIODS * sizeof(double));
+        customers.type.resize(n);
+        const uint8_t* types = reinterpret_cast<const uint8_t*>(column(TYPE));
+        for (uint64_t i = 0; i < n; i++) customers.type[i] = toEnergyType(types[i]);
+        
+        const uint8_t* reminder = reinterpret_cast<const uint8_t*>(column(REMINDER_SENT));
+        const int32_t* overdueBills = reinterpret_cast<const int32_t*>(column(OVERDUE_BILLS));
+        const PaymentRecord* pays = reinterpret_cast<const PaymentRecord*>(column(PAYMENTS));
+        const MaintRecordData* maint = reinterpret_cast<const MaintRecordData*>(column(MAINT));
+        
+        customers.profile.reserve(n);
+        for (uint64_t i = 0; i < n; i++)
+            customers.profile.push_back(customers.newProfile());
+        
+        const auto* usageState = reinterpret_cast<const UsageSeries::State*>(column(USAGE_STATE));
+        const auto* usageBlocks = reinterpret_cast<const UsageSeries::Block*>(column(USAGE_BLOCKS));
+        const uint8_t* usageData = reinterpret_cast<const uint8_t*>(column(USAGE_DATA));
+        customers.usage.reserve(n);
+        for (uint64_t i = 0; i < n && ok; i++) {
+            UsageSeries& u = customers.usage.emplace_back(customers.newSeries());
+            ok = u.restore(usageState[i], usageData + dataStart[i], dataStart[i + 1] - dataStart[i],
+                           usageBlocks + blockStart[i], blockStart[i + 1] - blockStart[i]);
+        }
+        if (!ok) {
+            cerr << "Snapshot has broken usage history: " << filename << endl;
+            munmap(mapped, fileSize);
+            clearData();
+            return false;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            CustomerProfile& p = customers.profile[i];
+            p.name = getString(3 * i);
+            p.email = getString(3 * i + 1);
+            p.address = getString(3 * i + 2);
+            p.reminderSent = reminder[i];
+            p.overdueBills = overdueBills[i];
+            
+            p.payments.reserve(payStart[i + 1] - payStart[i]);
+            for (uint64_t b = payStart[i]; b < payStart[i + 1]; b++) {
+                Payment bill(pays[b].amount, (time_t)pays[b].date);
+                bill.isPaid = pays[b].isPaid;
+                bill.overdue = pays[b].overdue;
+                bill.paid = pays[b].paid;
+                bill.number = p.billCount++;
+                p.payments.push_back(bill);
+            }
+            for (uint64_t m = maintStart[i]; m < maintStart[i + 1]; m++) {
+                uint64_t desc = min<uint64_t>(maint[m].desc, h.strings - 1);
+                p.maintenance.push_back({(time_t)maint[m].date, getString(desc), maint[m].cost});
+            }
+        }
+        
+        const double* rateTable = reinterpret_cast<const double*>(column(RATES));
+        copy(rateTable, rateTable + ENERGY_TYPE_COUNT, rates.begin());
+        
+        const TradeRecord* tradeRecs = reinterpret_cast<const TradeRecord*>(column(TRADES));
+        vector<ImportExport> loaded;
+        loaded.reserve(h.trades);
+        for (uint64_t t = 0; t < h.trades; t++) {
+            loaded.emplace_back(toEnergyType(tradeRecs[t].type), tradeRecs[t].quantity,
+                                tradeRecs[t].price, tradeRecs[t].isImport);
+            loaded.back().date = tradeRecs[t].date;
+        }
+        {
+            unique_lock<RWLock> lock(tradeLock);
+            ledger.append(loaded.data(), loaded.size());
+        }
+        
+        const WorkOrderRecord* workOrders = reinterpret_cast<const WorkOrderRecord*>(column(WORK_ORDERS));
+        for (uint64_t k = 0; k < h.workOrders; k++) {
+            const WorkOrderRecord& rec = workOrders[k];
+            if (rec.number < 0 || rec.province >= h.provinces || rec.status > MaintenanceScheduler::CANCELLED) continue;
+            MaintenanceScheduler::WorkOrder o;
+            o.number = rec.number;
+            o.customerId = rec.customerId;
+            o.province = provinceId[rec.province];
+            o.priority = rec.priority;
+            o.due = rec.due;
+            o.task = getString(min<uint64_t>(rec.task, h.strings - 1));
+            o.status = MaintenanceScheduler::Status(rec.status);
+            o.finished = rec.finished;
+            o.cost = rec.cost;
+            maintenance.add(o);
+        }
+        
+        munmap(mapped, fileSize);
+        snapshotLogSeq = h.logSeq;
+        rebuildDerived();
+        if (tierAfterDays > 0 || usageKeepDays > 0) compactBills();
+        return true;
+    }
+    
+    // Exact ID lookup - an empty Customer if nobody has that ID
+    Customer findById(int id) const {
+        shared_lock<RWLock> layout(customers.layout);
+        auto it = idIndex.find(id);
+        return it == idIndex.end() ? Customer() : Customer(&customers, it->second);
+    }
+    
+    // Add cfg.customers made-up customers after the ones we already have,
+    // with their bill history, this cycle's usage so far and cfg.trades
+    // trades. Customers are built on 'threadCount' threads (0 = one per
+    // core). It's logged as one record that makes them all again on replay
+    // (with the same generator - see generatorFingerprint).
+    // False if the settings don't make sense or one of the IDs is taken.
+    bool generateData(const GeneratorConfig& cfg, unsigned threadCount = 0) {
+        if (!generatorConfigOk(cfg)) return false;
+        {
+            shared_lock<RWLock> layout(customers.layout);
+            long long end = cfg.firstId + (long long)cfg.customers;
+            for (int id : customers.id) {
+                if (id >= cfg.firstId && id < end) {
+                    cerr << "Customer ID " << id << " is already taken\n";
+                    return false;
+                }
+            }
+        }
+        time_t t = now();
+        logChange(WriteAheadLog::GENERATE, LogWriter().put<int64_t>(t).put<uint64_t>(cfg.seed)
+                  .put<uint64_t>(cfg.customers).put<int32_t>(cfg.firstId).put<int32_t>(cfg.provinces)
+                  .put<int32_t>(cfg.billMonths).put(cfg.paidShare).put<uint8_t>(cfg.usage)
+                  .put(cfg.usageMean).put(cfg.usageSpread).put(cfg.allocMin).put(cfg.allocMax)
+                  .put<int32_t>(cfg.usageDays).put<int32_t>(cfg.readingsPerDay)
+                  .put(cfg.maintenanceShare).put<uint64_t>(cfg.trades).put<uint32_t>(generatorFingerprint()));
+        generateRows(cfg, t, threadCount);
+        if (wal && !wal->flush()) {
+            cerr << "Couldn't get the generated data into the write-ahead log\n";
+            return false;
+        }
+        return true;
+    }
+    
+    // Create test data - 500 customers over 5 provinces, different every run
+    void createTestData() {
+        GeneratorConfig cfg;
+        cfg.seed = uint64_t(rng()) << 32 | rng();
+        generateData(cfg);
+    }
+    
+    // Process billing for all customers. Customers are split into fixed
+    // chunks that worker threads grab one at a time. Each chunk keeps its own
+    // results and they're merged in chunk order afterwards, so the output is
+    // the same no matter how many threads ran.
+    BillingSummary doBilling(unsigned threadCount = 0) {
+        time_t t = now();
+        BillingSummary summary = runBilling(t, threadCount);
+        if (tierAfterDays > 0 || usageKeepDays > 0) summary.billsCompacted = compactBills().billsMoved;
+        return summary;
+    }
+    
+    // Bill everyone in store segment 'ch' who's used something. Needs layout
+    // shared and the segment locked.
+    void billSegment(size_t ch, time_t t, int& bills, double& billed) {
+        const size_t CHUNK = CustomerStore::SEGMENT_ROWS;
+        size_t first = ch * CHUNK, end = min(customers.size(), first + CHUNK);
+        thread_local vector<Totals> change;
+        change.assign(provinceTotals.size(), Totals());
+        
+        // Price the whole chunk in one pass over the columns, then bill
+        thread_local vector<double> amounts;
+        amounts.resize(end - first);
+        plans.price(end - first, &customers.plan[first], &customers.periodUsed[first * MAX_PERIODS],
+                    &customers.used[first], &customers.type[first], rates.data(), amounts.data());
+        
+        const double* used = customers.used.data();
+        for (size_t i = first; i < end; i++) {
+            if (used[i] <= 0) continue;
+            double amount = amounts[i - first];
+            customers.createBill(i, amount, t);
+            bills++;
+            billed += amount;
+            change[customers.province[i]].add(takeChange(i));
+            scheduleBill(i, customers.profile[i].billCount - 1);
+        }
+        
+        // Totals are whole numbers of millionths, so the order chunks
+        // land in doesn't matter
+        lock_guard<mutex> lock(totalsMutex);
+        for (size_t p = 0; p < change.size(); p++) {
+            provinceTotals[p].add(change[p]);
+            overall.add(change[p]);
+        }
+    }
+    
+    // Each chunk is one store segment, locked while it's billed - readers
+    // only ever wait on the chunk that's in progress. Each chunk is logged
+    // while it's still locked, so usage and plan changes logged for the
+    // segment land on the same side of its bills in the log as in memory.
+    BillingSummary runBilling(time_t t, unsigned threadCount) {
+        auto start = chrono::steady_clock::now();
+        const size_t CHUNK = CustomerStore::SEGMENT_ROWS;
+        shared_lock<RWLock> layout(customers.layout);
+        
+        struct ChunkResult {
+            int bills = 0;
+            double billed = 0;
+        };
+        size_t chunkCount = (customers.size() + CHUNK - 1) / CHUNK;
+        vector<ChunkResult> results(chunkCount);
+        atomic<size_t> nextChunk{0};
+        
+        auto work = [&] {
+            for (size_t ch; (ch = nextChunk++) < chunkCount;) {
+                ChunkResult& r = results[ch];
+                unique_lock<RWLock> rows(customers.segments[ch]);
+                billSegment(ch, t, r.bills, r.billed);
+                if (r.bills > 0)
+                    logChange(WriteAheadLog::BILLING_CHUNK, LogWriter().put<int64_t>(t).put<uint32_t>(ch));
+            }
+        };
+        
+        if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+        threadCount = max<size_t>(1, min<size_t>(threadCount, chunkCount));
+        vector<thread> pool;
+        for (unsigned i = 1; i < threadCount; i++)
+            pool.emplace_back(work);
+        work();
+        for (auto& th : pool) th.join();
+        
+        // Add up in chunk order so the billed total comes out the same every run
+        BillingSummary summary;
+        summary.threads = threadCount;
+        for (auto& r : results) {
+            summary.billsCreated += r.bills;
+            summary.totalBilled += r.billed;
+        }
+        auto took = chrono::steady_clock::now() - start;
+        summary.seconds = chrono::duration<double>(took).count();
+        metrics().add(Counter::BILLING_RUNS);
+        metrics().add(Counter::BILLS_CREATED, summary.billsCreated);
+        metrics().observe(Timing::BILLING_RUN, took);
+        return summary;
+    }
+    
+    // Send reminders to customers with overdue bills. Customers whose
+    // email couldn't be delivered get picked up again next time.
+    ReminderStats sendReminders() {
+        MetricTimer timer(Timing::REMINDER_PASS);
+        vector<int> overdueNow = overdueRows();
+        time_t t = now();
+        ReminderOutbox outbox(reminderRelay, reminderRate);
+        string body;
+        for (int idx : overdueNow) {
+            ReminderJob job;
+            {
+                shared_lock<RWLock> layout(customers.layout);
+                unique_lock<RWLock> row(customers.segmentFor(idx));
+                if (!customers.sendReminder(idx, t, reminderTemplate, body)) continue;
+                job = {customers.id[idx], customers.profile[idx].email, body, {}};
+            }
+            // Not holding anything here - submit() can block on a full queue
+            outbox.submit(move(job));
+        }
+        
+        ReminderStats stats = outbox.finish();
+        metrics().add(Counter::REMINDERS_RENDERED, stats.queued);
+        metrics().add(Counter::REMINDERS_SENT, stats.sent);
+        metrics().add(Counter::REMINDERS_FAILED, stats.failed);
+        shared_lock<RWLock> layout(customers.layout);
+        for (int id : outbox.failedCustomers()) {
+            int idx = idIndex.at(id);
+            unique_lock<RWLock> row(customers.segmentFor(idx));
+            customers.profile[idx].reminderSent = false;
+        }
+        return stats;
+    }
+    
+    // Book maintenance work for a customer, due at 'due' (priority 0 =
+    // emergency, 9 = whenever). Returns the work order number, or -1 if
+    // there's no such customer.
+    int scheduleMaintenance(int id, const string& task, time_t due, int priority = 5) {
+        MaintenanceScheduler::WorkOrder o;
+        o.customerId = id;
+        o.task = task;
+        o.due = due;
+        o.priority = clamp(priority, 0, 9);
+        lock_guard<mutex> orders(workOrderMutex);
+        {
+            shared_lock<RWLock> layout(customers.layout);
+            auto it = idIndex.find(id);
+            if (it == idIndex.end()) return -1;
+            o.province = customers.province[it->second];
+        }
+        o.number = maintenance.add(o);
+        logChange(WriteAheadLog::WORK_ORDER, LogWriter().put<int32_t>(o.number).put<int32_t>(id)
+                  .put<int64_t>(due).put<uint8_t>(o.priority).put(task));
+        return o.number;
+    }
+    
+    // The work's been done - it goes on the customer's maintenance record.
+    // False if there's no such order or it's already done or cancelled.
+    bool completeMaintenance(int number, double cost) {
+        lock_guard<mutex> orders(workOrderMutex);
+        time_t when = now();
+        if (!finishWorkOrder(number, cost, when)) return false;
+        logChange(WriteAheadLog::WORK_ORDER_DONE, LogWriter().put<int32_t>(number).put<int64_t>(when).put(cost));
+        return true;
+    }
+    
+    bool cancelMaintenance(int number) {
+        lock_guard<mutex> orders(workOrderMutex);
+        if (!maintenance.cancel(number)) return false;
+        logChange(WriteAheadLog::WORK_ORDER_CANCEL, LogWriter().put<int32_t>(number));
+        return true;
+    }
+    
+    // Unfinished work orders due in [from, to), soonest first, for one
+    // province ("" = everywhere) and one task ("" = any)
+    vector<MaintenanceScheduler::WorkOrder> maintenanceDue(const string& province, time_t from, time_t to,
+                                                        const string& task = "", size_t limit = SIZE_MAX) const {
+        int p = -1;
+        if (!province.empty()) {
+            shared_lock<RWLock> layout(customers.layout);
+            p = customers.findProvince(province);
+            if (p < 0) return {};
+        }
+        return maintenance.due(p, from, to, task, limit);
+    }
+    
+    optional<MaintenanceScheduler::WorkOrder> workOrder(int number) const { return maintenance.order(number); }
+    size_t workOrderCount() const { return maintenance.size(); }
+    string crewName(int crew) const { return maintenance.crewName(crew); }
+    string provinceName(int province) const {
+        shared_lock<RWLock> layout(customers.layout);
+        return province >= 0 && province < (int)customers.provinceNames.size() ? customers.provinceNames[province] : "";
+    }
+    
+    // Put a crew on shift for one province ("" = anywhere). Whenever
+    // they're free they get the most urgent open order they can take.
+    // Returns the crew's number, or -1 for a province we don't know.
+    int addCrew(const string& name, const string& province = "") {
+        int p = -1;
+        if (!province.empty()) {
+            shared_lock<RWLock> layout(customers.layout);
+            p = customers.findProvince(province);
+            if (p < 0) return -1;
+        }
+        int crew = maintenance.addCrew(name, p);
+        crewShift(crew);
+        return crew;
+    }
+    
+    // Call fn with a work order once it's done or cancelled
+    void whenWorkOrderFinished(int number, function<void(const MaintenanceScheduler::WorkOrder&)> fn) {
+        maintenance.whenFinished(number, move(fn));
+    }
+    
+    void setDispatchHandler(function<void(const string&, const MaintenanceScheduler::WorkOrder&)> fn) {
+        dispatchHandler = move(fn);
+    }
+    
+    // Swap in a real mail relay, a different email or a different send rate
+    void setReminderRelay(ReminderRelay relay, double ratePerSec = 1000) {
+        reminderRelay = move(relay);
+        reminderRate = ratePerSec;
+    }
+    void setReminderTemplate(const string& text) { reminderTemplate = ReminderTemplate(text); }
+    
+    // Everything stats and reports need, as of now. 'usageDays' adds the
+    // daily usage of the last that many days (today included) from the
+    // interval series - that one walks every customer.
+    SystemStats gatherStats(int usageDays = 0) {
+        processOverdue();
+        shared_lock<RWLock> layout(customers.layout);
+        SystemStats st;
+        {
+            lock_guard<mutex> lock(totalsMutex);
+            st.overall = overall;
+            addProvinceTotals(st);
+        }
+        st.rates = rates;
+        st.importsByType = tradeTotalsByType(true);
+        st.exportsByType = tradeTotalsByType(false);
+        if (usageDays > 0) {
+            int64_t today = UsageSeries::dayOf(UsageSeries::intervalOf(now()));
+            st.usageFromDay = today - usageDays + 1;
+            st.dailyUsage = usageByBucket(nullptr, st.usageFromDay * UsageSeries::PER_DAY,
+                                          (today + 1) * UsageSeries::PER_DAY, UsageSeries::PER_DAY);
+        }
+        return st;
+    }
+    
+    // Stats for a report, moving the report checkpoint up to now. With
+    // 'delta' the daily usage carries on from the last checkpoint, so only
+    // usage that came in since gets counted, and 'before'
+    // gets what the last report had. Without it (or the first time, after a
+    // load, or if the clock went backwards) everything is counted again.
+    // 'since' gets the generation to hand writeCustomerRows for the
+    // customers that changed since the last checkpoint (0 = all of them).
+    SystemStats reportStats(bool delta, uint32_t& since, SystemStats& before) {
+        lock_guard<mutex> reportLock(reportMutex);
+        processOverdue();
+        shared_lock<RWLock> layout(customers.layout);
+        const int days = REPORT_USAGE_DAYS;
+        int64_t today = UsageSeries::dayOf(UsageSeries::intervalOf(now()));
+        int64_t from = today - days + 1;
+        delta = delta && lastReport.valid && from >= lastReport.stats.usageFromDay;
+        before = delta ? lastReport.stats : SystemStats();
+        
+        SystemStats st;
+        st.rates = rates;
+        st.usageFromDay = from;
+        st.dailyUsage.assign(days, 0);
+        {
+            // With no writer inside a segment, the totals, the usage waiting
+            // for us and the generation all line up
+            auto rows = customers.readAll();
+            lock_guard<mutex> lock(totalsMutex);
+            st.overall = overall;
+            addProvinceTotals(st);
+            
+            // Days the last report already had just get what came in since.
+            // Days new to the window are counted from the series (block
+            // totals, so that's one number per customer per day).
+            int64_t kept = delta ? max<int64_t>(0, before.usageFromDay + days - from) : 0;
+            for (int64_t d = 0; d < kept; d++) {
+                st.dailyUsage[d] = before.dailyUsage[from - before.usageFromDay + d];
+                auto it = pendingUsage.find(from + d);
+                if (it != pendingUsage.end()) st.dailyUsage[d] += it->second;
+            }
+            if (kept < days) {
+                vector<long long> fresh = usageByBucket(nullptr, (from + kept) * UsageSeries::PER_DAY,
+                                                        (from + days) * UsageSeries::PER_DAY,
+                                                        UsageSeries::PER_DAY, true);
+                copy(fresh.begin(), fresh.end(), st.dailyUsage.begin() + kept);
+            }
+            pendingUsage.clear();
+            uint32_t generation = reportGeneration.fetch_add(1);
+            since = delta ? generation : 0;
+        }
+        
+        // The ledger keeps running totals, so trades cost nothing either way
+        st.importsByType = tradeTotalsByType(true);
+        st.exportsByType = tradeTotalsByType(false);
+        lastReport = {true, st};
+        return st;
+    }
+    
+    // One CustomerRow per customer, in customer order, into 'w' - only
+    // those changed in generation 'since' or later if it isn't 0 (see
+    // reportStats). A segment at a time is held shared while its rows go out.
+    void writeCustomerRows(ReportWriter& w, uint32_t since = 0) const {
+        shared_lock<RWLock> layout(customers.layout);
+        for (size_t s = 0; s < customers.segments.size(); s++) {
+            shared_lock<RWLock> rows(customers.segments[s]);
+            size_t end = min(customers.size(), (s + 1) * CustomerStore::SEGMENT_ROWS);
+            for (size_t i = s * CustomerStore::SEGMENT_ROWS; i < end; i++) {
+                if (changedIn[i] < since) continue;
+                const CustomerProfile& p = customers.profile[i];
+                w.customerRow({customers.id[i], p.name, customers.provinceNames[customers.province[i]], p.email,
+                               customers.type[i],
+                               customers.plan[i], customers.allocated[i], customers.used[i],
+                               customers.owed[i], customers.overdue[i] != 0, p.billCount});
+            }
+        }
+    }
+    
+    // Create a monthly report file. The format goes by the extension (see
+    // reportFormatFor) unless one is given; 'withCustomers' adds a row for
+    // every customer.
+    void createMonthlyReport(const string& filename, bool withCustomers = false) {
+        createMonthlyReport(filename, reportFormatFor(filename), withCustomers);
+    }
+    void createMonthlyReport(const string& filename, ReportFormat format, bool withCustomers = false) {
+        uint32_t since;
+        SystemStats before;
+        SystemStats st = reportStats(false, since, before);
+        function<void(ReportWriter&)> rows;
+        if (withCustomers) rows = [&](ReportWriter& w) { writeCustomerRows(w); };
+        writeMonthlyReport(st, filename, format, rows);
+        if (checkTotals) verifyTotals();
+    }
+    
+    // Report of what changed since the last report (monthly or delta):
+    // overall numbers, trades and daily usage, the provinces whose totals
+    // moved and, with 'withCustomers', the customers that changed. Trades
+    // and usage are picked up from where the last report got to instead
+    // of being recounted, so this costs what changed, not the whole book.
+    void createDeltaReport(const string& filename, bool withCustomers = false) {
+        createDeltaReport(filename, reportFormatFor(filename), withCustomers);
+    }
+    void createDeltaReport(const string& filename, ReportFormat format, bool withCustomers = false) {
+        uint32_t since;
+        SystemStats before;
+        SystemStats st = reportStats(true, since, before);
+        function<void(ReportWriter&)> rows;
+        if (withCustomers) rows = [&](ReportWriter& w) { writeCustomerRows(w, since); };
+        writeMonthlyReport(changesSince(st, before), filename, format, rows);
+        if (checkTotals) verifyTotals();
+    }
+    
+    // Search for customers. Returns at most 'limit' matches after skipping
+    // the first 'offset', in customer order, so callers can page through.
+    vector<Customer> findCustomers(const string& query, const string& prov = "",
+                                   size_t limit = SIZE_MAX, size_t offset = 0) {
+        MetricTimer timer(Timing::SEARCH);
+        vector<Customer> results;
+        
+        // Check one customer, returns false once we have enough
+        int provId = -1;
+        auto consider = [&](int idx) {
+            const CustomerProfile& c = customers.profile[idx];
+            
+            // Skip if province doesn't match (when specified)
+            if (provId >= 0 && customers.province[idx] != provId) return true;
+            
+            // Match ID, name or email
+            if (c.name.find(query) != string::npos ||
+                c.email.find(query) != string::npos ||
+                to_string(customers.id[idx]).find(query) != string::npos) {
+                if (offset > 0) offset--;
+                else results.push_back(Customer(&customers, idx));
+            }
+            return results.size() < limit;
+        };
+        
+        if (limit == 0) return results;
+        // Names, emails and IDs never change once added, so the layout lock
+        // is all we need to read them
+        shared_lock<RWLock> layout(customers.layout);
+        if (!prov.empty()) {
+            provId = customers.findProvince(prov);
+            if (provId < 0 || provId >= (int)provinceRows.size()) return results;
+        }
+        
+        if (query.size() >= SearchIndex::MIN_QUERY) {
+            vector<int> candidates;
+            {
+                lock_guard<mutex> lock(searchMutex);
+                if (searchIndexStale) buildSearchIndex();
+                candidates = searchIndex.candidates(query, provId >= 0 ? &provinceRows[provId] : nullptr);
+            }
+            for (int idx : candidates)
+                if (!consider(idx)) break;
+        } else if (provId >= 0) {
+            // Too short for the index - scan the province
+            for (int idx : provinceRows[provId])
+                if (!consider(idx)) break;
+        } else {
+            // Too short for the index - scan everyone
+            for (size_t i = 0; i < customers.size(); i++)
+                if (!consider(i)) break;
+        }
+        metrics().add(Counter::SEARCHES);
+        metrics().add(Counter::SEARCH_RESULTS, results.size());
+        return results;
+    }
+    
+    // Get list of customers with overdue bills
+    vector<Customer> getOverdueCustomers() {
+        vector<Customer> results;
+        for (int idx : overdueRows())
+            results.push_back(Customer(&customers, idx));
+        return results;
+    }
+    
+    // Show general system statistics
+    void showStats() {
+        printStats(gatherStats(), cout);
+        
+        if (checkTotals && verifyTotals())
+            cout << "(Cached totals checked against a full recount: OK)\n";
+    }
+};
+
+// Takes meter readings from an outside feed and applies them in batches.
+// Each worker owns the customers whose ID maps to it, so two workers never
+// touch the same Customer and a customer's readings stay in order.
+// submit() should be called from a single feed thread. Works on anything
+// with useEnergyBatch - one EnergySystem or a ShardRouter in front of many.
+template <typename System>
+class IngestionPipeline {
+private:
+    System& system;
+    vector<unique_ptr<BoundedQueue<MeterReading>>> queues;
+    vector<thread> workers;
+    vector<IngestStats> workerStats;
+    size_t batchSize;
+    long long received = 0;
+    bool finished = false;
+    chrono::steady_clock::time_point startTime;
+    
+    // Worker loop - drain a batch, group it by customer, apply each group once
+    void work(size_t w) {
+        vector<MeterReading> batch;
+        vector<double> amts;
+        vector<time_t> whens;
+        IngestStats& st = workerStats[w];
+        
+        while (true) {
+            batch.clear();
+            if (queues[w]->popBatch(batch, batchSize) == 0) break;
+            MetricTimer timer(Timing::INGEST_BATCH);
+            long long applied = st.applied, rejected = st.overAllocation + st.unknownId;
+            
+            // Group by customer, oldest reading first
+            stable_sort(batch.begin(), batch.end(), [](const MeterReading& a, const MeterReading& b) {
+                if (a.customerId != b.customerId) return a.customerId < b.customerId;
+                return a.timestamp < b.timestamp;
+            });
+            
+            for (size_t i = 0; i < batch.size();) {
+                size_t j = i;
+                while (j < batch.size() && batch[j].customerId == batch[i].customerId) j++;
+                
+                amts.clear();
+                whens.clear();
+                for (size_t k = i; k < j; k++) {
+                    amts.push_back(batch[k].amount);
+                    whens.push_back(batch[k].timestamp);
+                }
+                
+                int accepted = system.useEnergyBatch(batch[i].customerId, amts.data(), amts.size(), whens.data());
+                if (accepted < 0) {
+                    st.unknownId += j - i;
+                } else {
+                    st.applied += accepted;
+                    st.overAllocation += (j - i) - accepted;
+                }
+                i = j;
+            }
+            metrics().add(Counter::READINGS_APPLIED, st.applied - applied);
+            metrics().add(Counter::READINGS_REJECTED, st.overAllocation + st.unknownId - rejected);
+        }
+    }
+    
+public:
+    // workerCount 0 = one per core
+    IngestionPipeline(System& system, size_t workerCount = 0,
+                      size_t queueCapacity = 65536, size_t batch = 4096)
+        : system(system), batchSize(batch) {
+        if (workerCount == 0) workerCount = max(1u, thread::hardware_concurrency());
+        
+        workerStats.resize(workerCount);
+        for (size_t w = 0; w < workerCount; w++)
+            queues.push_back(make_unique<BoundedQueue<MeterReading>>(queueCapacity / workerCount + 1));
+        
+        startTime = chrono::steady_clock::now();
+        for (size_t w = 0; w < workerCount; w++)
+            workers.emplace_back(&IngestionPipeline::work, this, w);
+    }
+    
+    ~IngestionPipeline() {
+        if (!finished) finish();
+    }
+    
+    // Hand a reading to the worker that owns this customer
+    void submit(const MeterReading& r) {
+        queues[static_cast<unsigned>(r.customerId) % queues.size()]->push(r);
+        received++;
+    }
+    
+    // Stop taking readings, wait for the workers and add up their numbers
+    IngestStats finish() {
+        IngestStats total;
+        if (finished) return total;
+        finished = true;
+        
+        for (auto& q : queues) q->close();
+        for (auto& t : workers) t.join();
+        
+        total.received = received;
+        for (auto& st : workerStats) {
+            total.applied += st.applied;
+            total.overAllocation += st.overAllocation;
+            total.unknownId += st.unknownId;
+        }
+        total.seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        return total;
+    }
+};
+
+// Splits customers over several EnergySystems by province. A big province
+// can get more than one shard, in which case its customers are spread over
+// them by ID. Anything about one customer goes straight to their shard;
+// searches, billing, reminders and stats go to every shard involved (in
+// parallel where it's worth it) and the results are put together here.
+// Trades aren't tied to a province, so they get a shard of their own.
+//
+// The shards here are objects in this process. Each one can still have its
+// own log and snapshot files (see shard()), and this class is the one place
+// that would have to learn to talk to another machine.
+class ShardRouter {
+private:
+    vector<unique_ptr<EnergySystem>> shards;
+    map<string, vector<int>> provinceShards;   // province -> its shards
+    map<string, int> shardsPerProvince;
+    int defaultShards;
+    unordered_map<int, int> shardOf;           // customer ID -> shard
+    vector<RatePlan> ratePlans;                // every shard gets these, in order
+    RatePlanBook planBook;                     // just to check and number them
+    EnergySystem tradeDesk;
+    mutable RWLock directoryLock;              // guards everything above
+    
+    EnergySystem* shardFor(int id) const {
+        shared_lock<RWLock> lock(directoryLock);
+        auto it = shardOf.find(id);
+        return it == shardOf.end() ? nullptr : shards[it->second].get();
+    }
+    
+    // Run fn(i) for every shard i at once. Caller holds directoryLock shared.
+    template <typename Fn>
+    void everyShard(Fn fn) {
+        vector<thread> pool;
+        for (size_t s = 0; s < shards.size(); s++)
+            pool.emplace_back([&fn, s] { fn(s); });
+        for (auto& t : pool) t.join();
+    }
+    
+    // The shards to ask for a search - all of them, or one province's
+    vector<EnergySystem*> shardsMatching(const string& prov) const {
+        shared_lock<RWLock> lock(directoryLock);
+        vector<EnergySystem*> found;
+        if (prov.empty()) {
+            for (auto& s : shards) found.push_back(s.get());
+        } else if (auto it = provinceShards.find(prov); it != provinceShards.end()) {
+            for (int s : it->second) found.push_back(shards[s].get());
+        }
+        return found;
+    }
+    
+public:
+    // shardsPerProvince: how many shards a province gets, defaultShards for
+    // any province not listed. Shards are made when a province's first
+    // customer shows up.
+    explicit ShardRouter(map<string, int> shardsPerProvince = {}, int defaultShards = 1)
+        : shardsPerProvince(move(shardsPerProvince)), defaultShards(max(1, defaultShards)) {}
+    
+    size_t shardCount() const {
+        shared_lock<RWLock> lock(directoryLock);
+        return shards.size();
+    }
+    
+    // For per-shard setup (clock, log file, tiering...)
+    EnergySystem& shard(size_t i) { return *shards.at(i); }
+    EnergySystem& trades() { return tradeDesk; }
+    
+    int customerCount() const {
+        shared_lock<RWLock> lock(directoryLock);
+        return shardOf.size();
+    }
+    
+    Customer addCustomer(CustomerInfo info) {
+        EnergySystem* target;
+        {
+            unique_lock<RWLock> lock(directoryLock);
+            if (shardOf.count(info.id)) {
+                cerr << "Customer " << info.id << " already exists\n";
+                return Customer();
+            }
+            auto& list = provinceShards[info.province];
+            if (list.empty()) {
+                auto it = shardsPerProvince.find(info.province);
+                int count = it == shardsPerProvince.end() ? defaultShards : max(1, it->second);
+                for (int s = 0; s < count; s++) {
+                    list.push_back(shards.size());
+                    shards.push_back(make_unique<EnergySystem>());
+                    for (auto& plan : ratePlans) shards.back()->addRatePlan(plan);
+                }
+            }
+            int s = list[static_cast<unsigned>(info.id) % list.size()];
+            shardOf[info.id] = s;
+            target = shards[s].get();
+        }
+        return target->addCustomer(move(info));
+    }
+    
+    bool useEnergy(int id, double amt) {
+        EnergySystem* s = shardFor(id);
+        return s && s->useEnergy(id, amt);
+    }
+    
+    int useEnergyBatch(int id, const double* amts, size_t n, const time_t* when = nullptr) {
+        EnergySystem* s = shardFor(id);
+        return s ? s->useEnergyBatch(id, amts, n, when) : -1;
+    }
+    
+    // Plans get added to every shard (and shards made later) so the numbers match
+    int addRatePlan(const RatePlan& plan) {
+        unique_lock<RWLock> lock(directoryLock);
+        int number = planBook.add(plan);
+        if (number < 0) return -1;
+        ratePlans.push_back(plan);
+        for (auto& s : shards) s->addRatePlan(plan);
+        return number;
+    }
+    
+    bool setCustomerPlan(int id, int plan) {
+        EnergySystem* s = shardFor(id);
+        return s && s->setCustomerPlan(id, plan);
+    }
+    
+    PaymentResult makePayment(int id, int bill, double amt) {
+        EnergySystem* s = shardFor(id);
+        return s ? s->makePayment(id, bill, amt) : PaymentResult::REJECTED;
+    }
+    
+    void createBill(int id, time_t when) {
+        if (EnergySystem* s = shardFor(id)) s->createBill(id, when);
+    }
+    
+    // Each shard posts its own customers' payments at the same time. Lines
+    // for customers no shard has are reported as unknown.
+    PostingReport postPayments(const vector<Remittance>& batch) {
+        auto start = chrono::steady_clock::now();
+        shared_lock<RWLock> lock(directoryLock);
+        vector<vector<Remittance>> parts(shards.size());
+        vector<vector<size_t>> lineOf(shards.size());
+        PostingReport total;
+        total.payments = batch.size();
+        for (size_t k = 0; k < batch.size(); k++) {
+            auto it = shardOf.find(batch[k].customerId);
+            if (it == shardOf.end()) {
+                const Remittance& pay = batch[k];
+                bool amountOk = isfinite(pay.amount) && pay.amount > CustomerStore::PAYMENT_SLACK;
+                if (isfinite(pay.amount)) total.received += pay.amount;
+                total.issues.push_back({k, amountOk ? PaymentIssue::UNKNOWN_CUSTOMER : PaymentIssue::BAD_AMOUNT,
+                                        pay.customerId, pay.amount, 0, pay.reference});
+                continue;
+            }
+            parts[it->second].push_back(batch[k]);
+            lineOf[it->second].push_back(k);
+        }
+        
+        unsigned threadsEach = max(1u, thread::hardware_concurrency() / max<unsigned>(1, shards.size()));
+        vector<PostingReport> runs(shards.size());
+        everyShard([&](size_t s) { if (!parts[s].empty()) runs[s] = shards[s]->postPayments(parts[s], threadsEach); });
+        
+        for (size_t s = 0; s < runs.size(); s++) {
+            PostingReport& r = runs[s];
+            total.matched += r.matched;
+            total.billsPaid += r.billsPaid;
+            total.billsPartlyPaid += r.billsPartlyPaid;
+            total.received += r.received;
+            total.applied += r.applied;
+            total.threads += r.threads;
+            for (auto& issue : r.issues) {
+                issue.line = lineOf[s][issue.line];
+                total.issues.push_back(move(issue));
+            }
+        }
+        sort(total.issues.begin(), total.issues.end(),
+             [](const PaymentIssue& a, const PaymentIssue& b) { return a.line < b.line; });
+        total.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return total;
+    }
+    
+    void addMaintenance(int id, const string& desc, double cost) {
+        if (EnergySystem* s = shardFor(id)) s->addMaintenance(id, desc, cost);
+    }
+    
+    void addTrade(const ImportExport& t) { tradeDesk.addTrade(t); }
+    void addTrades(const vector<ImportExport>& batch) { tradeDesk.addTrades(batch); }
+    TradeLedger::Sums tradesBetween(time_t from, time_t to) const { return tradeDesk.tradesBetween(from, to); }
+    TradeLedger::Sums tradesBetween(EnergyType type, time_t from, time_t to) const {
+        return tradeDesk.tradesBetween(type, from, to);
+    }
+    
+    Customer findById(int id) const {
+        EnergySystem* s = shardFor(id);
+        return s ? s->findById(id) : Customer();
+    }
+    
+    // Bill every shard at once, splitting the cores between them
+    BillingSummary doBilling() {
+        shared_lock<RWLock> lock(directoryLock);
+        unsigned threadsEach = max(1u, thread::hardware_concurrency() / max<unsigned>(1, shards.size()));
+        vector<BillingSummary> runs(shards.size());
+        auto start = chrono::steady_clock::now();
+        everyShard([&](size_t s) { runs[s] = shards[s]->doBilling(threadsEach); });
+        
+        BillingSummary total;
+        for (auto& r : runs) {
+            total.billsCreated += r.billsCreated;
+            total.totalBilled += r.totalBilled;
+            total.threads += r.threads;
+            total.billsCompacted += r.billsCompacted;
+        }
+        total.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return total;
+    }
+    
+    // Every shard sends its own at the same time. The p99 is the worst shard's.
+    ReminderStats sendReminders() {
+        shared_lock<RWLock> lock(directoryLock);
+        vector<ReminderStats> runs(shards.size());
+        everyShard([&](size_t s) { runs[s] = shards[s]->sendReminders(); });
+        
+        ReminderStats total;
+        for (auto& r : runs) {
+            total.queued += r.queued;
+            total.sent += r.sent;
+            total.failed += r.failed;
+            total.retries += r.retries;
+            total.maxQueueDepth = max(total.maxQueueDepth, r.maxQueueDepth);
+            total.seconds = max(total.seconds, r.seconds);
+            total.p99Ms = max(total.p99Ms, r.p99Ms);
+        }
+        return total;
+    }
+    
+    // Same paging as EnergySystem::findCustomers, in shard order. Each shard
+    // is asked for enough to cover the page in case all of it comes from there.
+    vector<Customer> findCustomers(const string& query, const string& prov = "",
+                                   size_t limit = SIZE_MAX, size_t offset = 0) {
+        vector<EnergySystem*> targets = shardsMatching(prov);
+        size_t want = limit > SIZE_MAX - offset ? SIZE_MAX : limit + offset;
+        vector<vector<Customer>> found(targets.size());
+        {
+            vector<thread> pool;
+            for (size_t s = 0; s < targets.size(); s++)
+                pool.emplace_back([&, s] { found[s] = targets[s]->findCustomers(query, prov, want); });
+            for (auto& t : pool) t.join();
+        }
+        
+        vector<Customer> results;
+        for (auto& list : found) {
+            for (auto& c : list) {
+                if (results.size() >= limit) return results;
+                if (offset > 0) offset--;
+                else results.push_back(c);
+            }
+        }
+        return results;
+    }
+    
+    vector<Customer> getOverdueCustomers() {
+        shared_lock<RWLock> lock(directoryLock);
+        vector<Customer> results;
+        for (auto& s : shards) {
+            vector<Customer> part = s->getOverdueCustomers();
+            results.insert(results.end(), part.begin(), part.end());
+        }
+        return results;
+    }
+    
+    double usageBetween(int id, time_t from, time_t to) const {
+        EnergySystem* s = shardFor(id);
+        return s ? s->usageBetween(id, from, to) : -1;
+    }
+
+    vector<double> usageProfile(int id, time_t from, time_t to, int bucketSeconds = 60*60) const {
+        EnergySystem* s = shardFor(id);
+        return s ? s->usageProfile(id, from, to, bucketSeconds) : vector<double>();
+    }
+
+    // A province's usage from just its own shards, added up
+    vector<double> provinceUsageProfile(const string& prov, time_t from, time_t to,
+                                        int bucketSeconds = 24*60*60) const {
+        vector<double> total;
+        for (EnergySystem* s : shardsMatching(prov)) {
+            vector<double> part = s->provinceUsageProfile(prov, from, to, bucketSeconds);
+            if (total.empty()) total = move(part);
+            else for (size_t b = 0; b < min(total.size(), part.size()); b++) total[b] += part[b];
+        }
+        return total;
+    }
+    
+    // Stats from every shard (and the trade desk) added together
+    SystemStats gatherStats(int usageDays = 0) {
+        shared_lock<RWLock> lock(directoryLock);
+        vector<SystemStats> parts(shards.size());
+        everyShard([&](size_t s) { parts[s] = shards[s]->gatherStats(usageDays); });
+        
+        SystemStats st = tradeDesk.gatherStats(usageDays);
+        for (auto& p : parts) st.merge(p);
+        return st;
+    }
+    
+    void showStats() { printStats(gatherStats(), cout); }
+    // Customer rows come from one shard after another, so they're grouped by shard
+    void createMonthlyReport(const string& filename, bool withCustomers = false) {
+        createMonthlyReport(filename, reportFormatFor(filename), withCustomers);
+    }
+    void createMonthlyReport(const string& filename, ReportFormat format, bool withCustomers = false) {
+        writeReport(filename, format, withCustomers, false);
+    }
+    
+    // Every shard carries on from its own checkpoint, but which provinces
+    // changed is decided here - a province can be split over several shards
+    void createDeltaReport(const string& filename, bool withCustomers = false) {
+        createDeltaReport(filename, reportFormatFor(filename), withCustomers);
+    }
+    void createDeltaReport(const string& filename, ReportFormat format, bool withCustomers = false) {
+        writeReport(filename, format, withCustomers, true);
+    }
+    
+private:
+    SystemStats lastReported;                  // what the last report had, for deltas
+    mutex reportMutex;                         // guards lastReported
+    
+    void writeReport(const string& filename, ReportFormat format, bool withCustomers, bool delta) {
+        lock_guard<mutex> reportLock(reportMutex);
+        shared_lock<RWLock> lock(directoryLock);
+        vector<SystemStats> parts(shards.size()), before(shards.size() + 1);
+        vector<uint32_t> since(shards.size() + 1);
+        everyShard([&](size_t s) { parts[s] = shards[s]->reportStats(delta, since[s], before[s]); });
+        SystemStats st = tradeDesk.reportStats(delta, since.back(), before.back());
+        for (auto& p : parts) st.merge(p);
+        
+        function<void(ReportWriter&)> rows;
+        if (withCustomers) {
+            rows = [&](ReportWriter& w) {
+                for (size_t s = 0; s < shards.size(); s++) shards[s]->writeCustomerRows(w, since[s]);
+            };
+        }
+        writeMonthlyReport(delta ? changesSince(st, lastReported) : st, filename, format, rows);
+        lastReported = move(st);
+    }
+};
+
+// A mix of work for runLoadTest. The weights are relative - the defaults
+// are mostly lookups and searches, with the odd report and billing run.
+struct LoadTestConfig {
+    unsigned threads = 4;
+    double seconds = 10;
+    uint64_t seed = 1;
+    size_t pageSize = 20;               // results wanted per search, like the menu
+    string reportFile = "/dev/null";    // where reports go
+    double lookups = 400, searches = 250, provinceSearches = 100, usage = 150, payments = 95,
+           reports = 4, billing = 1;
+};
+
+// How one kind of operation did in a load test
+struct LoadTestOp {
+    string name;
+    long long count = 0;
+    long long missed = 0;     // found nobody, over the allocation, nothing to pay...
+    double totalMs = 0, p50Us = 0, p99Us = 0, maxUs = 0;
+};
+
+struct LoadTestResult {
+    vector<LoadTestOp> ops;
+    long long total = 0;
+    double seconds = 0;
+};
+
+// Hit 'system' from cfg.threads threads at once with a random mix of
+// operations for cfg.seconds. 'data' is what the customers were generated
+// with (see EnergySystem::generateData), for picking IDs, names and
+// provinces that exist. Each thread has its own seeded stream, so a given
+// seed always asks for the same things in the same order.
+LoadTestResult runLoadTest(EnergySystem& system, const GeneratorConfig& data, const LoadTestConfig& cfg) {
+    enum Kind { LOOKUP, SEARCH, PROVINCE_SEARCH, USAGE, PAYMENT, REPORT, BILLING, KINDS };
+    const char* names[KINDS] = {"lookup", "search", "province search", "usage", "payment", "report", "billing"};
+    double weights[KINDS] = {cfg.lookups, cfg.searches, cfg.provinceSearches, cfg.usage, cfg.payments,
+                             cfg.reports, cfg.billing};
+    LoadTestResult result;
+    if (data.customers == 0 || accumulate(begin(weights), end(weights), 0.0) <= 0) {
+        cerr << "Nothing to load test\n";
+        return result;
+    }
+    
+    struct ThreadLog {
+        vector<float> us[KINDS];
+        long long missed[KINDS] = {};
+    };
+    unsigned threads = max(1u, cfg.threads);
+    vector<ThreadLog> logs(threads);
+    auto start = chrono::steady_clock::now();
+    auto stopAt = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(cfg.seconds));
+    
+    auto worker = [&](unsigned w) {
+        seed_seq seq{uint32_t(cfg.seed), uint32_t(cfg.seed >> 32), w};
+        mt19937_64 gen(seq);
+        discrete_distribution<int> kind(begin(weights), end(weights));
+        uniform_int_distribution<int> anyone(data.firstId, data.firstId + int(data.customers - 1));
+        uniform_int_distribution<int> province(0, data.provinces - 1);
+        ThreadLog& log = logs[w];
+        
+        for (auto now = chrono::steady_clock::now(); now < stopAt;) {
+            int op = kind(gen), id = anyone(gen);
+            bool ok = true;
+            switch (op) {
+                case LOOKUP:
+                    ok = bool(system.findById(id));
+                    break;
+                case SEARCH:
+                case PROVINCE_SEARCH: {
+                    // Half by last name (lots of matches), half by one customer's email
+                    string query = gen() % 2 ? string(GENERATOR_LAST_NAMES[gen() % size(GENERATOR_LAST_NAMES)])
+                                             : to_string(id) + "@";
+                    string prov = op == PROVINCE_SEARCH ? PROVINCES[province(gen)] : "";
+                    ok = !system.findCustomers(query, prov, cfg.pageSize).empty();
+                    break;
+                }
+                case USAGE:
+                    ok = system.useEnergy(id, uniform_real_distribution<>(0.1, 5)(gen));
+                    break;
+                case PAYMENT: {
+                    // Pay off their latest bill if it's still open
+                    Customer c = system.findById(id);
+                    int bills = c ? c.getBillCount() : 0;
+                    Payment last = bills > 0 ? c.getBill(bills - 1) : Payment(0);
+                    ok = bills > 0 && !last.isPaid &&
+                         system.makePayment(id, bills - 1, last.amount) != PaymentResult::REJECTED;
+                    break;
+                }
+                case REPORT:
+                    system.createMonthlyReport(cfg.reportFile);
+                    break;
+                case BILLING:
+                    system.doBilling();
+                    break;
+            }
+            auto done = chrono::steady_clock::now();
+            log.us[op].push_back(chrono::duration<float, micro>(done - now).count());
+            log.missed[op] += !ok;
+            now = done;
+        }
+    };
+    
+    // Reports and billing would print as they go - keep that out of the timings
+    streambuf* console = cout.rdbuf(nullptr);
+    vector<thread> pool;
+    for (unsigned w = 0; w < threads; w++)
+        pool.emplace_back(worker, w);
+    for (auto& t : pool) t.join();
+    cout.rdbuf(console);
+    cout.clear();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    for (int k = 0; k < KINDS; k++) {
+        LoadTestOp op;
+        op.name = names[k];
+        vector<float> all;
+        for (auto& log : logs) {
+            all.insert(all.end(), log.us[k].begin(), log.us[k].end());
+            op.missed += log.missed[k];
+        }
+        if (all.empty()) continue;
+        sort(all.begin(), all.end());
+        op.count = all.size();
+        op.totalMs = accumulate(all.begin(), all.end(), 0.0) / 1000;
+        op.p50Us = all[(all.size() - 1) / 2];
+        op.p99Us = all[(all.size() - 1) * 99 / 100];
+        op.maxUs = all.back();
+        result.total += op.count;
+        result.ops.push_back(op);
+    }
+    return result;
+}
+
+void printLoadTest(const LoadTestResult& r, ostream& out) {
+    out << "\nLoad test: " << r.total << " operations in " << fixed << setprecision(1) << r.seconds << " s ("
+        << setprecision(0) << r.total / max(r.seconds, 1e-9) << "/s)\n";
+    out << "  " << left << setw(16) << "Operation" << right << setw(10) << "Count" << setw(10) << "Missed"
+        << setw(12) << "Per sec" << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "Max us" << "\n";
+    for (auto& op : r.ops) {
+        out << "  " << left << setw(16) << op.name << right << setw(10) << op.count << setw(10) << op.missed
+            << setprecision(0) << setw(12) << op.count / max(r.seconds, 1e-9)
+            << setprecision(1) << setw(12) << op.p50Us << setw(12) << op.p99Us << setw(12) << op.maxUs << "\n";
+    }
+}
+
+// Network front end. Clients send one JSON object per line, e.g.
+//   {"id":1,"cmd":"search","q":"Smith","province":"Ontario","limit":20}
+// and get one JSON object per line back, in the order they asked, with
+// their "id" echoed so replies are easy to match up. Values can only be
+// strings, numbers or true/false/null - nothing nested.
+struct ServerRequest {
+    unordered_map<string, string> fields;   // strings unescaped, the rest as written
+    string id = "null";                     // raw JSON text, echoed back as is
+
+    bool parse(string_view s, string& error) {
+        size_t i = 0;
+        auto ws = [&] { while (i < s.size() && isspace((unsigned char)s[i])) i++; };
+        auto str = [&](string& out) {
+            if (i >= s.size() || s[i] != '"') return false;
+            for (i++; i < s.size(); i++) {
+                char c = s[i];
+                if (c == '"') {
+                    i++;
+                    return true;
+                }
+                if (c != '\\') {
+                    out += c;
+                    continue;
+                }
+                if (++i >= s.size()) return false;
+                switch (s[i]) {
+                    case '"': case '\\': case '/': out += s[i]; break;
+                    case 'n': out += '\n'; break;
+                    case 't': out += '\t'; break;
+                    case 'r': out += '\r'; break;
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'u': {
+                        unsigned cp = 0;
+                        if (i + 4 >= s.size() || from_chars(&s[i + 1], &s[i + 5], cp, 16).ptr != &s[i + 5])
+                            return false;
+                        i += 4;
+                        // UTF-8, surrogate pairs not handled - nobody's name needs them yet
+                        if (cp < 0x80) {
+                            out += char(cp);
+                        } else if (cp < 0x800) {
+                            out += char(0xc0 | cp >> 6);
+                            out += char(0x80 | (cp & 0x3f));
+                        } else {
+                            out += char(0xe0 | cp >> 12);
+                            out += char(0x80 | (cp >> 6 & 0x3f));
+                            out += char(0x80 | (cp & 0x3f));
+                        }
+                        break;
+                    }
+                    default: return false;
+                }
+            }
+            return false;
+        };
+
+        ws();
+        if (i >= s.size() || s[i] != '{') {
+            error = "expected a JSON object";
+            return false;
+        }
+        i++;
+        ws();
+        if (i < s.size() && s[i] == '}') {
+            i++;
+        } else {
+            for (;;) {
+                string key, value;
+                ws();
+                if (!str(key)) {
+                    error = "bad key";
+                    return false;
+                }
+                ws();
+                if (i >= s.size() || s[i] != ':') {
+                    error = "expected ':' after \"" + key + "\"";
+                    return false;
+                }
+                i++;
+                ws();
+                size_t start = i;
+                if (i < s.size() && s[i] == '"') {
+                    if (!str(value)) {
+                        error = "bad string for \"" + key + "\"";
+                        return false;
+                    }
+                } else {
+                    while (i < s.size() && s[i] != ',' && s[i] != '}' && !isspace((unsigned char)s[i])) i++;
+                    value = string(s.substr(start, i - start));
+                    char* end = nullptr;
+                    bool number = !value.empty() && (strtod(value.c_str(), &end), *end == '\0') &&
+                                  value.find_first_of("xXnN") == string::npos;   // no hex, inf or nan
+                    if (!number && value != "true" && value != "false" && value != "null") {
+                        error = "\"" + key + "\" has to be a string, number or true/false/null";
+                        return false;
+                    }
+                }
+                if (key == "id") id = string(s.substr(start, i - start));
+                fields[move(key)] = move(value);
+                ws();
+                if (i < s.size() && s[i] == ',') {
+                    i++;
+                    continue;
+                }
+                if (i < s.size() && s[i] == '}') {
+                    i++;
+                    break;
+                }
+                error = "expected ',' or '}'";
+                return false;
+            }
+        }
+        ws();
+        if (i != s.size()) {
+            error = "junk after the object";
+            return false;
+        }
+        return true;
+    }
+
+    string get(const string& key, const string& def = "") const {
+        auto it = fields.find(key);
+        return it == fields.end() ? def : it->second;
+    }
+
+    // NaN when it's there but not a number, so range checks catch it
+    double number(const string& key, double def) const {
+        auto it = fields.find(key);
+        if (it == fields.end()) return def;
+        char* end = nullptr;
+        double v = strtod(it->second.c_str(), &end);
+        return *end == '\0' && !it->second.empty() ? v : NAN;
+    }
+
+    bool flag(const string& key) const {
+        string v = get(key);
+        return v == "true" || v == "1";
+    }
+};
+
+// Appends one JSON reply to a string. Commas go in by themselves.
+class JsonLine {
+private:
+    string& out;
+    bool comma = false;
+
+    void sep() {
+        if (comma) out += ',';
+        comma = false;
+    }
+
+public:
+    explicit JsonLine(string& o) : out(o) {}
+
+    JsonLine& open(char c) {
+        sep();
+        out += c;
+        return *this;
+    }
+    JsonLine& close(char c) {
+        out += c;
+        comma = true;
+        return *this;
+    }
+    JsonLine& key(string_view k) {
+        value(k);
+        out += ':';
+        comma = false;
+        return *this;
+    }
+    JsonLine& raw(string_view v) {
+        sep();
+        out += v;
+        comma = true;
+        return *this;
+    }
+    JsonLine& value(string_view s) {
+        sep();
+        out += '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if ((unsigned char)c < 0x20) {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                out += esc;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+        comma = true;
+        return *this;
+    }
+    JsonLine& value(const char* s) { return value(string_view(s)); }
+    JsonLine& value(bool b) { return raw(b ? "true" : "false"); }
+    JsonLine& value(long long v) {
+        char buf[24];
+        return raw(string_view(buf, to_chars(buf, buf + sizeof(buf), v).ptr - buf));
+    }
+    JsonLine& value(int v) { return value((long long)v); }
+    JsonLine& value(size_t v) { return value((long long)v); }
+    JsonLine& value(double v) {
+        if (!isfinite(v)) return raw("null");   // JSON has no inf or nan
+        char buf[32];
+        return raw(string_view(buf, to_chars(buf, buf + sizeof(buf), v).ptr - buf));
+    }
+    template <typename T>
+    JsonLine& field(string_view k, const T& v) { return key(k).value(v); }
+};
+
+struct ServerConfig {
+    string host = "127.0.0.1";
+    int port = 7070;                    // 0 picks a free one - see CommandServer::port
+    unsigned workers = 0;               // 0 = one per core
+    size_t maxConnections = 10000;
+    size_t maxLine = 64 * 1024;         // longest request we take
+    size_t batch = 64;                  // requests a worker takes off one connection at a time
+    size_t maxPending = 1024;           // requests read but not answered before we stop reading
+    size_t maxUnsent = 4 << 20;         // reply bytes the client hasn't taken before we stop reading
+    string reportFile = "monthly_report.txt";
+    bool reportCustomers = false;
+    bool stopOnSignals = true;          // SIGINT/SIGTERM end run() - see blockStopSignals
+};
+
+// The command server. One thread runs an epoll loop over every connection
+// and only ever does non-blocking reads and writes; the requests themselves
+// run on a pool of workers. A connection's requests are handed over in
+// batches, one batch at a time, so a client can pipeline as many as it
+// likes and still get the replies back in order, while different
+// connections run side by side. Replies come back to the loop through a
+// list and an eventfd. A client that sends faster than it reads stops
+// being read from until it catches up.
+//
+// Commands (all but cmd are optional unless noted):
+//   ping
+//   search    q, province, limit (20, max 1000), offset
+//   customer  customer (ID, required) - details and bills
+//   overdue   limit (100), offset
+//   pay       customer, bill, amount (all required) - bill is "number" from
+//             customer, less than what's due part pays it
+//   billing   run a billing pass
+//   stats     totals overall and by province
+//   report    changes (true for a delta report), customers (a line each) -
+//             written to the server's report file
+//   metrics   the Prometheus text
+// "GET /metrics" (plain HTTP) gets the same text, so Prometheus can scrape
+// the port directly.
+class CommandServer {
+private:
+    struct Connection {
+        int fd = -1;
+        string in;                      // bytes read that don't make a whole line yet
+        deque<string> pending;          // whole requests waiting for a worker
+        string out;                     // replies, from 'sent' on still to go
+        size_t sent = 0;
+        bool busy = false;              // a worker has a batch of ours
+        bool eof = false;               // client is done sending
+        bool hangUp = false;            // close our side once the replies are out
+        bool shut = false;              // ...which we did - now we just wait for the client to go
+        uint32_t events = 0;            // what epoll is watching for
+    };
+    struct Job {
+        uint64_t conn;
+        vector<string> requests;
+    };
+    struct Done {
+        uint64_t conn;
+        string replies;
+    };
+
+    // epoll tags - connections count up from FIRST_CONN and are never reused,
+    // so a reply for a connection that's gone just finds nothing
+    static constexpr uint64_t LISTEN_TAG = 0, WAKE_TAG = 1, SIGNAL_TAG = 2, FIRST_CONN = 3;
+
+    EnergySystem& system;
+    ServerConfig cfg;
+    int listenFd = -1, epollFd = -1, wakeFd = -1, signalFd = -1;
+    unordered_map<uint64_t, Connection> conns;
+    uint64_t nextConn = FIRST_CONN;
+    BoundedQueue<Job> jobs;             // never more than one job per connection, so push can't block
+    vector<thread> workers;
+    mutex doneLock;
+    vector<Done> done;
+    atomic<bool> stopping{false};
+    mutex reportLock;                   // reports all go to the same file
+
+    void wake() {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            cerr << "Couldn't wake the server loop: " << strerror(errno) << endl;
+    }
+
+    void work() {
+        vector<Job> batch;
+        while (jobs.popBatch(batch, 1)) {
+            for (Job& job : batch) {
+                string replies;
+                for (const string& request : job.requests) handle(request, replies);
+                {
+                    lock_guard<mutex> lock(doneLock);
+                    done.push_back({job.conn, move(replies)});
+                }
+                wake();
+            }
+            batch.clear();
+        }
+    }
+
+    void acceptAll() {
+        for (;;) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    cerr << "Couldn't accept a connection: " << strerror(errno) << endl;
+                return;
+            }
+            if (conns.size() >= cfg.maxConnections) {
+                close(fd);
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            uint64_t id = nextConn++;
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = id;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                close(fd);
+                continue;
+            }
+            Connection& c = conns[id];
+            c.fd = fd;
+            c.events = ev.events;
+            metrics().add(Counter::CONNECTIONS);
+        }
+    }
+
+    void drop(uint64_t id) {
+        auto it = conns.find(id);
+        if (it == conns.end()) return;
+        close(it->second.fd);       // also takes it out of epoll
+        conns.erase(it);
+    }
+
+    // One read per wakeup, so a chatty client can't starve the others
+    bool readFrom(Connection& c) {
+        char buf[64 * 1024];
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n == 0) {
+            c.eof = true;
+            return true;
+        }
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (c.hangUp) return true;  // not taking any more requests
+
+        c.in.append(buf, n);
+        size_t start = 0;
+        for (size_t nl; !c.hangUp && (nl = c.in.find('\n', start)) != string::npos; start = nl + 1) {
+            size_t end = nl > start && c.in[nl - 1] == '\r' ? nl - 1 : nl;
+            if (end == start) continue;
+            c.pending.emplace_back(c.in, start, end - start);
+            // A scraper - answer it and hang up, the rest is just headers
+            if (c.pending.back().compare(0, 4, "GET ") == 0) c.hangUp = true;
+        }
+        c.in.erase(0, start);
+        if (!c.hangUp && c.in.size() > cfg.maxLine) {
+            c.pending.emplace_back();   // handle() turns this into an error
+            c.hangUp = true;
+        }
+        if (c.hangUp) c.in.clear();
+        return true;
+    }
+
+    bool flush(Connection& c) {
+        while (c.sent < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                c.sent += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return false;
+            }
+        }
+        if (c.sent == c.out.size()) {
+            c.out.clear();
+            c.sent = 0;
+        } else if (c.sent > (1 << 20)) {
+            c.out.erase(0, c.sent);
+            c.sent = 0;
+        }
+        return true;
+    }
+
+    // After anything happens on a connection: hand its next requests to a
+    // worker, close it if it's finished, and watch for what it needs next
+    void update(uint64_t id) {
+        auto it = conns.find(id);
+        if (it == conns.end()) return;
+        Connection& c = it->second;
+
+        if (!c.busy && !c.pending.empty()) {
+            Job job{id, {}};
+            while (!c.pending.empty() && job.requests.size() < cfg.batch) {
+                job.requests.push_back(move(c.pending.front()));
+                c.pending.pop_front();
+            }
+            c.busy = true;
+            jobs.push(move(job));
+        }
+
+        bool flushed = c.sent == c.out.size();
+        if (!c.busy && c.pending.empty() && flushed) {
+            if (c.eof) {
+                drop(id);
+                return;
+            }
+            // Let the client see the end of the replies, then wait for it to close
+            if (c.hangUp && !c.shut) {
+                shutdown(c.fd, SHUT_WR);
+                c.shut = true;
+            }
+        }
+
+        uint32_t want = 0;
+        bool backedUp = c.pending.size() >= cfg.maxPending || c.out.size() - c.sent >= cfg.maxUnsent;
+        if (!c.eof && !backedUp) want |= EPOLLIN | EPOLLRDHUP;
+        if (!flushed) want |= EPOLLOUT;
+        if (want != c.events) {
+            epoll_event ev{};
+            ev.events = want;
+            ev.data.u64 = id;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+            c.events = want;
+        }
+    }
+
+    void serve(uint64_t id, uint32_t events) {
+        auto it = conns.find(id);
+        if (it == conns.end()) return;
+        Connection& c = it->second;
+        if ((events & EPOLLERR) ||
+            ((events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) && !readFrom(c)) ||
+            ((events & EPOLLOUT) && !flush(c))) {
+            drop(id);
+            return;
+        }
+        // Both ends closed and nothing more will arrive
+        if ((events & EPOLLHUP) && !(events & EPOLLIN)) c.eof = true;
+        update(id);
     }
-    
-    // Helper function to pick a random energy type
-    EnergyType randType() {
-        vector<EnergyType> types = {
-            EnergyType::CRUDE_OIL, EnergyType::SOLAR, 
-            EnergyType::NUCLEAR, EnergyType::NATURAL_GAS
-        };
-        return types[uniform_int_distribution<>(0, 3)(rng)];
+
+    void finishJobs() {
+        uint64_t count;
+        while (read(wakeFd, &count, sizeof(count)) > 0) {}
+        vector<Done> finished;
+        {
+            lock_guard<mutex> lock(doneLock);
+            finished.swap(done);
+        }
+        for (Done& d : finished) {
+            auto it = conns.find(d.conn);
+            if (it == conns.end()) continue;
+            Connection& c = it->second;
+            c.busy = false;
+            c.out += d.replies;
+            if (!flush(c)) drop(d.conn);
+            else update(d.conn);
+        }
     }
 
-public:
-    // Constructor - set up initial energy rates
-    EnergySystem() {
-        // These rates are per unit (kWh, barrel, etc.)
-        rates = {
-            {EnergyType::CRUDE_OIL, 1.25},
-            {EnergyType::SOLAR, 0.18},
-            {EnergyType::NUCLEAR, 0.22},
-            {EnergyType::NATURAL_GAS, 0.85}
-        };
+    static void customerSummary(JsonLine& j, const Customer& c) {
+        j.open('{').field("id", c.getID()).field("name", c.getName()).field("email", c.getEmail())
+         .field("province", c.getProvince()).field("type", getEnergyName(c.getEnergyType()))
+         .field("owed", c.getTotalOwed()).field("overdue", c.hasOverdue()).close('}');
     }
-    
-    // Add a customer to the system
-    void addCustomer(const Customer& c) {
-        customers.push_back(c);
-        provinces[c.getProvince()].push_back(customers.size() - 1);
+
+    static bool whole(double v, double lo, double hi) {
+        return v >= lo && v <= hi && v == floor(v);
     }
-    
-    // Create test data - we need 500 customers total
-    void createTestData() {
-        vector<string> provs = {"Ontario", "Quebec", "Alberta", "British Columbia", "Manitoba"};
-        vector<string> fnames = {"John", "Jane", "Mike", "Emily", "Dave"};
-        vector<string> lnames = {"Smith", "Johnson", "Williams", "Jones", "Brown"};
-        vector<string> streets = {"Howard Ave", "Dougall Ave", "Walker Rd", "Ouellette Ave", "Lauzon Rd"};
-        
-        int id = 1001;
-        
-        // Make 100 customers for each of our 5 provinces
-        for (auto& prov : provs) {
-            for (int i = 0; i < 100; i++) {
-                // Pick random names
-                string first = fnames[uniform_int_distribution<>(0, fnames.size()-1)(rng)];
-                string last = lnames[uniform_int_distribution<>(0, lnames.size()-1)(rng)];
-                string name = first + " " + last;
-                
-                // Make an email - first initial + last name
-                string email = first.substr(0,1) + last + "@email.com";
-                transform(email.begin(), email.end(), email.begin(), ::tolower);
-                
-                // Random address
-                string street = streets[uniform_int_distribution<>(0, streets.size()-1)(rng)];
-                string address = to_string(uniform_int_distribution<>(100, 9999)(rng)) + " " + street + ", " + prov;
-                
-                // Assign random energy type and usage
-                EnergyType type = randType();
-                double alloc = randNum(250, 1000);
-                
-                Customer cust(id++, name, prov, email, address, type, alloc);
-                
-                // Add some random energy usage
-                cust.useEnergy(randNum(50, alloc * 0.8));
-                
-                // Some customers have bills (every 3rd one)
-                if (i % 3 == 0) {
-                    cust.createBill(rates[type]);
-                    
-                    // Make some bills overdue (every 9th one)
-                    if (i % 9 != 0) {
-                        // Pay bill for others
-                        cust.makePayment(0, cust.getTotalOwed());
-                    }
-                }
-                
-                // Add maintenance records to some customers
-                if (i % 15 == 0) {
-                    cust.addMaintenance("Equipment check", randNum(50, 200));
-                }
-                
-                // Add to our system
-                addCustomer(cust);
+
+    // Run one request and append its reply line
+    void handle(const string& line, string& out) {
+        MetricTimer timer(Timing::REQUEST);
+        metrics().add(Counter::REQUESTS);
+
+        if (line.compare(0, 4, "GET ") == 0) {
+            string path = line.substr(4, line.find(' ', 4) - 4);
+            string body = "Only /metrics here\n";
+            const char* status = "404 Not Found";
+            if (path == "/metrics") {
+                ostringstream text;
+                metrics().snapshot().writePrometheus(text);
+                body = text.str();
+                status = "200 OK";
             }
+            out += "HTTP/1.0 ";
+            out += status;
+            out += "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size()) +
+                   "\r\nConnection: close\r\n\r\n" + body;
+            return;
         }
-        
-        // Create some import/export entries
-        for (int i = 0; i < 30; i++) {
-            EnergyType type = randType();
-            double qty = randNum(1000, 10000);
-            double price = randNum(rates[type] * 0.7, rates[type] * 1.3);
-            trades.push_back(ImportExport(type, qty, price, i % 3 != 0)); // 2/3 are imports, 1/3 exports
+
+        ServerRequest r;
+        string error;
+        JsonLine j(out);
+        j.open('{');
+        if (line.empty()) {
+            error = "request too long";
+        } else if (r.parse(line, error)) {
+            j.key("id").raw(r.id);
+            error = run(r, j);
         }
+        if (error.empty()) {
+            j.field("ok", true);
+        } else {
+            metrics().add(Counter::REQUEST_ERRORS);
+            j.field("ok", false).field("error", error);
+        }
+        j.close('}');
+        out += '\n';
     }
-    
-    // Process billing for all customers
-    void doBilling() {
-        for (auto& c : customers)
-            if (c.getUsed() > 0)
-                c.createBill(rates[c.getEnergyType()]);
-    }
-    
-    // Send reminders to customers with overdue bills
-    void sendReminders() {
-        int sent = 0;
-        for (auto& c : customers) {
-            string email = c.sendReminder();
-            if (!email.empty()) {
-                // In real life we'd actually send the email here
-                cout << "Sent reminder to " << c.getName() << " (ID: " << c.getID() << ")\n";
-                sent++;
+
+    // The commands. Returns an error, or "" with the reply written to j.
+    string run(const ServerRequest& r, JsonLine& j) {
+        string cmd = r.get("cmd");
+
+        if (cmd == "ping") return "";
+
+        if (cmd == "search") {
+            double limit = r.number("limit", 20), offset = r.number("offset", 0);
+            if (!whole(limit, 1, 1000)) return "limit has to be 1 to 1000";
+            if (!whole(offset, 0, 1e12)) return "bad offset";
+            vector<Customer> found = system.findCustomers(r.get("q"), r.get("province"), size_t(limit) + 1, size_t(offset));
+            bool more = found.size() > limit;
+            if (more) found.pop_back();
+            j.key("customers").open('[');
+            for (auto& c : found) customerSummary(j, c);
+            j.close(']').field("more", more);
+            return "";
+        }
+
+        if (cmd == "customer") {
+            double id = r.number("customer", -1);
+            if (!whole(id, 0, numeric_limits<int>::max())) return "customer has to be an ID";
+            Customer c = system.findById(int(id));
+            if (!c) return "no such customer";
+            j.key("customer").open('{').field("id", c.getID()).field("name", c.getName())
+             .field("email", c.getEmail()).field("address", c.getAddress())
+             .field("province", c.getProvince()).field("type", getEnergyName(c.getEnergyType()))
+             .field("allocated", c.getAllocated()).field("used", c.getUsed()).field("plan", c.getPlan())
+             .field("owed", c.getTotalOwed()).field("overdue", c.hasOverdue());
+            j.key("bills").open('[');
+            for (const Payment& bill : c.getBills()) {
+                tm local;
+                localtime_r(&bill.date, &local);
+                char date[16];
+                strftime(date, sizeof(date), "%Y-%m-%d", &local);
+                j.open('{').field("number", bill.number).field("date", date).field("amount", bill.amount)
+                 .field("received", bill.paid).field("paid", bill.isPaid).field("overdue", bill.isOverdue())
+                 .close('}');
             }
+            j.close(']').close('}');
+            return "";
         }
-    }
-    
-    // Create a monthly report file
-    void createMonthlyReport(const string& filename) {
-        ofstream report(filename);
-        if (!report) {
-            cerr << "Couldn't open report file: " << filename << endl;
-            return;
+
+        if (cmd == "details") {
+            double id = r.number("customer", -1), bills = r.number("bills", 10), offset = r.number("offset", 0);
+            if (!whole(id, 0, numeric_limits<int>::max())) return "customer has to be an ID";
+            if (!whole(bills, 0, 1000)) return "bills has to be 0 to 1000";
+            if (!whole(offset, 0, 1e12)) return "bad offset";
+            Customer c = system.findById(int(id));
+            if (!c) return "no such customer";
+            DetailPage page;
+            page.bills = page.maintenance = size_t(bills);
+            page.billOffset = page.maintenanceOffset = size_t(offset);
+            thread_local DateCache dates;
+            thread_local string text;
+            text.clear();
+            bool more = c.renderDetails(text, dates, page, system.now());
+            j.field("text", text).field("more", more);
+            return "";
         }
-        
-        // Current date for the report
-        time_t now = time(nullptr);
-        struct tm *timeinfo = localtime(&now);
-        char dateBuffer[80];
-        strftime(dateBuffer, sizeof(dateBuffer), "%B %Y", timeinfo);
-        
-        report << "Energy Provider Monthly Report - " << dateBuffer << "\n\n";
-        
-        // Overall stats
-        double totalUnpaid = 0;
-        int overdueCount = 0;
-        for (auto& c : customers) {
-            totalUnpaid += c.getTotalOwed();
-            if (c.hasOverdue()) overdueCount++;
+
+        if (cmd == "overdue") {
+            double limit = r.number("limit", 100), offset = r.number("offset", 0);
+            if (!whole(limit, 1, 1000)) return "limit has to be 1 to 1000";
+            if (!whole(offset, 0, 1e12)) return "bad offset";
+            vector<Customer> all = system.getOverdueCustomers();
+            size_t from = min<size_t>(offset, all.size()), to = min<size_t>(from + limit, all.size());
+            j.field("total", all.size()).key("customers").open('[');
+            for (size_t i = from; i < to; i++) customerSummary(j, all[i]);
+            j.close(']').field("more", to < all.size());
+            return "";
         }
-        
-        report << "Overall Stats:\n"
-               << "Total Customers: " << customers.size() << "\n"
-               << "Total Unpaid: $" << fixed << setprecision(2) << totalUnpaid << "\n"
-               << "Overdue Customers: " << overdueCount << " ("
-               << fixed << setprecision(1) << (overdueCount * 100.0 / customers.size())
-               << "%)\n\n";
-        
-        // Province breakdown
-        report << "Province Breakdown:\n";
-        for (auto& [prov, ids] : provinces) {
-            double allocated = 0, used = 0, unpaid = 0;
-            int overdue = 0;
-            
-            for (int idx : ids) {
-                Customer& c = customers[idx];
-                allocated += c.getAllocated();
-                used += c.getUsed();
-                unpaid += c.getTotalOwed();
-                if (c.hasOverdue()) overdue++;
+
+        if (cmd == "pay") {
+            double id = r.number("customer", -1), bill = r.number("bill", -1), amount = r.number("amount", NAN);
+            if (!whole(id, 0, numeric_limits<int>::max())) return "customer has to be an ID";
+            if (!whole(bill, 0, numeric_limits<int>::max())) return "bill has to be a bill number";
+            if (!(amount > 0 && amount < 1e12)) return "amount has to be more than 0";
+            PaymentResult paid = system.makePayment(int(id), int(bill), amount);
+            if (paid == PaymentResult::REJECTED) return "payment not taken (unknown customer or bill, or already paid)";
+            if (paid == PaymentResult::NOT_SAVED)
+                return "payment applied but not saved to the log - don't send it again";
+            return "";
+        }
+
+        if (cmd == "billing") {
+            BillingSummary run = system.doBilling();
+            j.field("billsCreated", run.billsCreated).field("totalBilled", run.totalBilled)
+             .field("seconds", run.seconds).field("billsCompacted", run.billsCompacted);
+            return "";
+        }
+
+        if (cmd == "stats") {
+            SystemStats st = system.gatherStats();
+            auto totals = [&](const Totals& t) {
+                j.open('{').field("customers", t.customers).field("allocated", Totals::toDouble(t.allocated))
+                 .field("used", Totals::toDouble(t.used)).field("unpaid", Totals::toDouble(t.unpaid))
+                 .field("overdueCustomers", t.overdueCustomers)
+                 .field("overdueAmount", Totals::toDouble(t.overdueAmount)).close('}');
+            };
+            j.key("overall");
+            totals(st.overall);
+            j.key("provinces").open('{');
+            for (auto& [prov, t] : st.provinces) {
+                j.key(prov);
+                totals(t);
             }
-            
-            report << prov << ":\n"
-                   << "  Customers: " << ids.size() << "\n"
-                   << "  Energy Allocated: " << fixed << setprecision(2) << allocated << " units\n"
-                   << "  Energy Used: " << used << " (" << (used/allocated*100) << "%)\n"
-                   << "  Unpaid Bills: $" << unpaid << "\n"
-                   << "  Overdue: " << overdue << " (" << (overdue*100.0/ids.size()) << "%)\n\n";
+            double imports = 0, exports = 0;
+            for (double v : st.importsByType) imports += v;
+            for (double v : st.exportsByType) exports += v;
+            j.close('}').field("imports", imports).field("exports", exports);
+            return "";
         }
-        
-        // Import/Export summary
-        double imports = 0, exports = 0;
-        map<EnergyType, double> importsByType;
-        map<EnergyType, double> exportsByType;
-        
-        for (auto& t : trades) {
-            if (t.isImport) {
-                imports += t.getValue();
-                importsByType[t.type] += t.getValue();
+
+        if (cmd == "trades") {
+            double from = r.number("from", 0), to = r.number("to", 4e9);
+            if (!whole(from, 0, 1e12) || !whole(to, 0, 1e12)) return "from and to have to be unix times";
+            TradeLedger::Sums sums;
+            if (r.fields.count("type")) {
+                size_t t = 0;
+                while (t < ENERGY_TYPE_COUNT && r.get("type") != ENERGY_TYPES[t].name) t++;
+                if (t == ENERGY_TYPE_COUNT) return "unknown type: " + r.get("type");
+                sums = system.tradesBetween(typeAt(t), time_t(from), time_t(to));
             } else {
-                exports += t.getValue();
-                exportsByType[t.type] += t.getValue();
+                sums = system.tradesBetween(time_t(from), time_t(to));
             }
+            j.field("imports", sums.importValue()).field("exports", sums.exportValue())
+             .field("balance", sums.balance()).field("importTrades", sums.importCount)
+             .field("exportTrades", sums.exportCount);
+            return "";
         }
-        
-        report << "Import/Export Summary:\n"
-               << "Total Imports: $" << fixed << setprecision(2) << imports << "\n"
-               << "Total Exports: $" << fixed << setprecision(2) << exports << "\n"
-               << "Net Balance: $" << (imports - exports) << "\n\n";
-               
-        report << "Imports by Type:\n";
-        for (auto& [type, value] : importsByType) {
-            report << "  " << getEnergyName(type) << ": $" 
-                   << fixed << setprecision(2) << value << "\n";
+
+        if (cmd == "maintenance") {
+            double from = r.number("from", system.now()), to = r.number("to", system.now() + 7 * 86400);
+            double limit = r.number("limit", 100);
+            if (!whole(from, 0, 1e12) || !whole(to, 0, 1e12)) return "from and to have to be unix times";
+            if (!whole(limit, 1, 1000)) return "limit has to be 1 to 1000";
+            auto due = system.maintenanceDue(r.get("province"), time_t(from), time_t(to), r.get("task"), size_t(limit) + 1);
+            bool more = due.size() > limit;
+            if (more) due.pop_back();
+            j.key("orders").open('[');
+            for (auto& o : due) {
+                j.open('{').field("number", o.number).field("customer", o.customerId)
+                 .field("province", system.provinceName(o.province)).field("task", o.task)
+                 .field("due", (long long)o.due).field("priority", o.priority)
+                 .field("status", MaintenanceScheduler::WorkOrder::statusName(o.status));
+                if (o.crew >= 0) j.field("crew", system.crewName(o.crew));
+                j.close('}');
+            }
+            j.close(']').field("more", more);
+            return "";
         }
-        
-        report << "\nExports by Type:\n";
-        for (auto& [type, value] : exportsByType) {
-            report << "  " << getEnergyName(type) << ": $" 
-                   << fixed << setprecision(2) << value << "\n";
+
+        if (cmd == "schedule") {
+            double id = r.number("customer", -1), due = r.number("due", NAN), priority = r.number("priority", 5);
+            if (!whole(id, 0, numeric_limits<int>::max())) return "customer has to be an ID";
+            if (!whole(due, 0, 1e12)) return "due has to be a unix time";
+            if (!whole(priority, 0, 9)) return "priority has to be 0 to 9";
+            string task = r.get("task");
+            if (task.empty()) return "no task";
+            int number = system.scheduleMaintenance(int(id), task, time_t(due), int(priority));
+            if (number < 0) return "no such customer";
+            j.field("number", number);
+            return "";
         }
-               
-        report << "\n--- End of Report ---\n";
-        report.close();
-        
-        cout << "Report saved to " << filename << endl;
+
+        if (cmd == "complete" || cmd == "cancel") {
+            double number = r.number("order", -1), cost = r.number("cost", 0);
+            if (!whole(number, 0, numeric_limits<int>::max())) return "order has to be a work order number";
+            if (!(cost >= 0 && cost < 1e12)) return "bad cost";
+            bool ok = cmd == "complete" ? system.completeMaintenance(int(number), cost)
+                                        : system.cancelMaintenance(int(number));
+            if (!ok) return "no open work order with that number";
+            return "";
+        }
+
+        if (cmd == "report") {
+            bool withCustomers = r.fields.count("customers") ? r.flag("customers") : cfg.reportCustomers;
+            lock_guard<mutex> lock(reportLock);
+            if (r.flag("changes")) system.createDeltaReport(cfg.reportFile, withCustomers);
+            else system.createMonthlyReport(cfg.reportFile, withCustomers);
+            j.field("file", cfg.reportFile);
+            return "";
+        }
+
+        if (cmd == "metrics") {
+            ostringstream text;
+            metrics().snapshot().writePrometheus(text);
+            j.field("text", text.str());
+            return "";
+        }
+
+        return cmd.empty() ? "no cmd" : "unknown cmd: " + cmd;
     }
-    
-    // Search for customers
-    vector<Customer*> findCustomers(const string& query, const string& prov = "") {
-        vector<Customer*> results;
-        for (auto& c : customers) {
-            // Skip if province doesn't match (when specified)
-            if (!prov.empty() && c.getProvince() != prov) continue;
-            
-            // Match ID, name or email
-            if (to_string(c.getID()).find(query) != string::npos ||
-                c.getName().find(query) != string::npos ||
-                c.getEmail().find(query) != string::npos) {
-                results.push_back(&c);
+
+public:
+    CommandServer(EnergySystem& s, ServerConfig config)
+        : system(s), cfg(move(config)), jobs(max<size_t>(cfg.maxConnections, 1)) {}
+
+    ~CommandServer() {
+        jobs.close();
+        for (auto& t : workers) t.join();
+        for (auto& [id, c] : conns) close(c.fd);
+        for (int fd : {listenFd, epollFd, wakeFd, signalFd})
+            if (fd >= 0) close(fd);
+    }
+
+    CommandServer(const CommandServer&) = delete;
+    CommandServer& operator=(const CommandServer&) = delete;
+
+    // With stopOnSignals, SIGINT and SIGTERM have to be blocked in every
+    // thread, or one of them takes the signal and the process just dies.
+    // Call this before any threads start - new threads inherit it.
+    static void blockStopSignals() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+
+    // Open the port and start the workers
+    bool start() {
+        // Every connection is a file descriptor
+        rlimit files;
+        rlim_t want = cfg.maxConnections + 64;
+        if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < want) {
+            files.rlim_cur = min(want, files.rlim_max);
+            setrlimit(RLIMIT_NOFILE, &files);
+            getrlimit(RLIMIT_NOFILE, &files);
+            if (files.rlim_cur < want) {
+                cfg.maxConnections = files.rlim_cur > 128 ? files.rlim_cur - 64 : 64;
+                cerr << "Only room for " << cfg.maxConnections << " connections (open file limit)" << endl;
             }
         }
-        return results;
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(cfg.port);
+        if (inet_pton(AF_INET, cfg.host.c_str(), &addr.sin_addr) != 1) {
+            cerr << "Not an IPv4 address: " << cfg.host << endl;
+            return false;
+        }
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (listenFd < 0 || setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            ::bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+            cerr << "Couldn't listen on " << cfg.host << ":" << cfg.port << ": " << strerror(errno) << endl;
+            return false;
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(listenFd, (sockaddr*)&addr, &len);
+        cfg.port = ntohs(addr.sin_port);
+
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (cfg.stopOnSignals) {
+            sigset_t set;
+            sigemptyset(&set);
+            sigaddset(&set, SIGINT);
+            sigaddset(&set, SIGTERM);
+            signalFd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+        }
+        if (epollFd < 0 || wakeFd < 0 || (cfg.stopOnSignals && signalFd < 0)) {
+            cerr << "Couldn't set up the server loop: " << strerror(errno) << endl;
+            return false;
+        }
+        for (auto [fd, tag] : {pair{listenFd, LISTEN_TAG}, pair{wakeFd, WAKE_TAG}, pair{signalFd, SIGNAL_TAG}}) {
+            if (fd < 0) continue;
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = tag;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+        }
+
+        unsigned n = cfg.workers ? cfg.workers : max(1u, thread::hardware_concurrency());
+        for (unsigned i = 0; i < n; i++) workers.emplace_back(&CommandServer::work, this);
+        return true;
+    }
+
+    int port() const { return cfg.port; }
+    unsigned workerCount() const { return workers.size(); }
+
+    // The event loop - returns after stop() or a stop signal
+    bool run() {
+        epoll_event events[256];
+        while (!stopping) {
+            int n = epoll_wait(epollFd, events, size(events), -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                cerr << "Server loop failed: " << strerror(errno) << endl;
+                return false;
+            }
+            for (int i = 0; i < n; i++) {
+                uint64_t tag = events[i].data.u64;
+                if (tag == LISTEN_TAG) {
+                    acceptAll();
+                } else if (tag == WAKE_TAG) {
+                    finishJobs();
+                } else if (tag == SIGNAL_TAG) {
+                    signalfd_siginfo info;
+                    while (read(signalFd, &info, sizeof(info)) > 0) stopping = true;
+                } else {
+                    serve(tag, events[i].events);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Safe from any thread
+    void stop() {
+        stopping = true;
+        wake();
     }
+};
+
+// Times the report kernels against the plain loops they replace.
+// Run with: --bench-kernels [rows]
+void benchmarkKernels(size_t n) {
+    mt19937 gen(42);
+    uniform_real_distribution<> amount(0, 1000);
+    uniform_int_distribution<> prov(0, 12), type(0, ENERGY_TYPE_COUNT - 1), coin(0, 1);
     
-    // Get list of customers with overdue bills
-    vector<Customer*> getOverdueCustomers() {
-        vector<Customer*> results;
-        for (auto& c : customers)
-            if (c.hasOverdue())
-                results.push_back(&c);
-        return results;
+    // Customer-style columns (13 provinces) and trade-style rows
+    vector<double> values(n);
+    vector<uint8_t> provIdx(n), typeIdx(n), isImport(n);
+    vector<ImportExport> rows;
+    rows.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        values[i] = amount(gen);
+        provIdx[i] = prov(gen);
+        typeIdx[i] = type(gen);
+        isImport[i] = coin(gen);
+        rows.push_back(ImportExport(static_cast<EnergyType>(typeIdx[i]), values[i], 1.0, isImport[i]));
     }
     
-    // Show general system statistics
-    void showStats() {
-        cout << "+++ Energy Provider System Stats +++\n";
-        cout << "Total Customers: " << customers.size() << "\n\n";
+    // Best of a few runs so one hiccup doesn't skew things
+    auto time = [](auto&& fn) {
+        double best = 1e99;
+        for (int r = 0; r < 5; r++) {
+            auto start = chrono::steady_clock::now();
+            fn();
+            best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    };
+    
+    cout << "Kernel benchmark over " << n << " rows (using " << groupedSumKernelName() << ")\n";
+    
+    // Sum per province
+    double scalarOut[13], simdOut[13];
+    double scalarMs = time([&] {
+        fill(begin(scalarOut), end(scalarOut), 0.0);
+        groupedSumScalar(values.data(), provIdx.data(), nullptr, 0, n, scalarOut, 13);
+    });
+    double simdMs = time([&] {
+        fill(begin(simdOut), end(simdOut), 0.0);
+        groupedSum(values.data(), provIdx.data(), nullptr, 0, n, simdOut, 13);
+    });
+    double diff = 0;
+    for (int g = 0; g < 13; g++) diff = max(diff, fabs(scalarOut[g] - simdOut[g]) / max(1.0, scalarOut[g]));
+    cout << fixed << setprecision(2)
+         << "  Sum by province:    loop " << scalarMs << " ms, kernel " << simdMs << " ms ("
+         << scalarMs / simdMs << "x), max rel. diff " << scientific << diff << fixed << "\n";
+    
+    // Sum per province, only flagged rows (like "unpaid of overdue customers")
+    scalarMs = time([&] {
+        fill(begin(scalarOut), end(scalarOut), 0.0);
+        groupedSumScalar(values.data(), provIdx.data(), isImport.data(), 1, n, scalarOut, 13);
+    });
+    simdMs = time([&] {
+        fill(begin(simdOut), end(simdOut), 0.0);
+        groupedSum(values.data(), provIdx.data(), isImport.data(), 1, n, simdOut, 13);
+    });
+    cout << "  Masked by province: loop " << scalarMs << " ms, kernel " << simdMs << " ms ("
+         << scalarMs / simdMs << "x)\n";
+    
+    // Imports by energy type - the old map loop over ImportExport vs. the masked kernel
+    map<EnergyType, double> byTypeMap;
+    double mapMs = time([&] {
+        byTypeMap.clear();
+        for (auto& t : rows)
+            if (t.isImport) byTypeMap[t.type] += t.getValue();
+    });
+    double typeOut[ENERGY_TYPE_COUNT];
+    double maskedMs = time([&] {
+        fill(begin(typeOut), end(typeOut), 0.0);
+        groupedSum(values.data(), typeIdx.data(), isImport.data(), 1, n, typeOut, ENERGY_TYPE_COUNT);
+    });
+    cout << "  Imports by type:    loop " << mapMs << " ms, kernel " << maskedMs << " ms ("
+         << mapMs / maskedMs << "x)\n";
+}
+
+// Build with -DBENCH_ALLOC and every heap allocation in the program goes
+// through these, so the benchmarks can say how many allocations and bytes an
+// operation costs. It's two adds on shared counters on top of malloc - one
+// cache line every thread fights over - so normal builds leave it out.
+atomic<uint64_t> heapAllocs{0}, heapBytes{0};
+#ifdef BENCH_ALLOC
+const bool COUNTING_ALLOCS = true;
+
+void* operator new(size_t n) {
+    heapAllocs.fetch_add(1, memory_order_relaxed);
+    heapBytes.fetch_add(n, memory_order_relaxed);
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+void* operator new(size_t n, align_val_t al) {
+    size_t a = static_cast<size_t>(al);
+    heapAllocs.fetch_add(1, memory_order_relaxed);
+    heapBytes.fetch_add(n, memory_order_relaxed);
+    if (void* p = aligned_alloc(a, (max<size_t>(n, 1) + a - 1) / a * a)) return p;
+    throw bad_alloc();
+}
+// Kept out of line - gcc sees free() on memory from 'new' otherwise and warns
+[[gnu::noinline]] void heapFree(void* p) noexcept { free(p); }
+
+void* operator new[](size_t n) { return operator new(n); }
+void* operator new[](size_t n, align_val_t al) { return operator new(n, al); }
+void operator delete(void* p) noexcept { heapFree(p); }
+void operator delete[](void* p) noexcept { heapFree(p); }
+void operator delete(void* p, size_t) noexcept { heapFree(p); }
+void operator delete[](void* p, size_t) noexcept { heapFree(p); }
+void operator delete(void* p, align_val_t) noexcept { heapFree(p); }
+void operator delete[](void* p, align_val_t) noexcept { heapFree(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { heapFree(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { heapFree(p); }
+#else
+const bool COUNTING_ALLOCS = false;
+#endif
+
+// One benchmark case's numbers, per operation
+struct BenchResult {
+    string name;
+    size_t customers = 0;
+    long long iterations = 0;
+    double nsPerOp = 0, allocsPerOp = 0, bytesPerOp = 0;
+};
+
+// Run 'op' over and over until it's taken at least minSeconds (and at
+// least minIters times). 'setup' runs before each one, outside the timing
+// and the allocation counts - for ops that use up their own input.
+BenchResult benchCase(const string& name, size_t customers, const function<void()>& op,
+                      double minSeconds = 0.5, long long minIters = 1,
+                      const function<void()>& setup = nullptr) {
+    BenchResult r;
+    r.name = name;
+    r.customers = customers;
+    double ns = 0;
+    uint64_t allocs = 0, bytes = 0;
+    while (r.iterations < minIters || ns < minSeconds * 1e9) {
+        if (setup) setup();
+        uint64_t a0 = heapAllocs.load(), b0 = heapBytes.load();
+        auto start = chrono::steady_clock::now();
+        op();
+        ns += chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        allocs += heapAllocs.load() - a0;
+        bytes += heapBytes.load() - b0;
+        r.iterations++;
+    }
+    r.nsPerOp = ns / r.iterations;
+    r.allocsPerOp = double(allocs) / r.iterations;
+    r.bytesPerOp = double(bytes) / r.iterations;
+    return r;
+}
+
+// Times the EnergySystem hot paths on generated data of each size and
+// writes the results as JSON (if jsonFile isn't empty), so runs from two
+// releases can be diffed. The data comes from a fixed seed, so every run
+// measures the same customers.
+// Run with: --bench [sizes, e.g. 1000,100000] [--bench-json <file>]
+void runBenchmarks(const vector<size_t>& sizes, const string& jsonFile) {
+    vector<BenchResult> results;
+    auto show = [&](const BenchResult& r) {
+        cout << "  " << left << setw(34) << r.name << right << setw(14) << fixed << setprecision(0) << r.nsPerOp
+             << " ns/op";
+        if (COUNTING_ALLOCS)
+            cout << setw(12) << setprecision(1) << r.allocsPerOp << " allocs/op" << setw(14)
+                 << setprecision(0) << r.bytesPerOp << " B/op";
+        cout << setw(10) << r.iterations << " runs\n";
+        results.push_back(r);
+    };
+    
+    for (size_t n : sizes) {
+        GeneratorConfig data;
+        data.customers = n;
+        data.billMonths = 3;
+        data.seed = 42;
+        data.trades = max<size_t>(30, n / 100);
+        EnergySystem system;
+        system.setReminderRelay([](const vector<ReminderJob>&) { return true; }, 0);
+        auto start = chrono::steady_clock::now();
+        if (!system.generateData(data)) return;
+        cout << "\n" << n << " customers (generated in " << fixed << setprecision(0)
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms)\n";
+        string size = "/" + to_string(n);
         
-        // By province
-        cout << "By Province:\n";
-        for (auto& [prov, list] : provinces)
-            cout << "  " << prov << ": " << list.size() << " customers\n";
+        // Queries for real customers, picked up front and taken in turn
+        const size_t QUERIES = 64;
+        mt19937_64 gen(7);
+        uniform_int_distribution<int> anyone(data.firstId, data.firstId + int(n - 1));
+        vector<string> ids, names, emails, provs;
+        for (size_t q = 0; q < QUERIES; q++) {
+            Customer c = system.findById(anyone(gen));
+            ids.push_back(to_string(c.getID()));
+            names.push_back(c.getName());
+            emails.push_back(c.getEmail());
+            provs.push_back(c.getProvince());
+        }
+        system.findCustomers("warm up the search index");
         
-        // Energy rates
-        cout << "\nEnergy Rates:\n";
-        for (auto& [type, rate] : rates)
-            cout << "  " << getEnergyName(type) << ": $" 
-                 << fixed << setprecision(2) << rate << " per unit\n";
+        // Searches, a page at a time like the menu
+        size_t next = 0;
+        auto search = [&](const vector<string>& queries, bool byProvince) {
+            return [&, byProvince] {
+                size_t q = next++ % QUERIES;
+                system.findCustomers(queries[q], byProvince ? provs[q] : "", 20);
+            };
+        };
+        show(benchCase("findCustomers/id" + size, n, search(ids, false)));
+        show(benchCase("findCustomers/name" + size, n, search(names, false)));
+        show(benchCase("findCustomers/email" + size, n, search(emails, false)));
+        show(benchCase("findCustomers/id/province" + size, n, search(ids, true)));
+        show(benchCase("findCustomers/name/province" + size, n, search(names, true)));
+        show(benchCase("findCustomers/email/province" + size, n, search(emails, true)));
         
-        // Overdue stats
-        int overdueCount = 0;
-        double overdueAmount = 0;
-        for (auto& c : customers) {
-            if (c.hasOverdue()) {
-                overdueCount++;
-                overdueAmount += c.getTotalOwed();
-            }
-        }
+        show(benchCase("getOverdueCustomers" + size, n, [&] { system.getOverdueCustomers(); }));
+        show(benchCase("showStats" + size, n, [&] { system.gatherStats(); }));
         
-        cout << "\nOverdue Payments:\n";
-        cout << "  Customers with overdue bills: " << overdueCount 
-             << " (" << fixed << setprecision(1) 
-             << (static_cast<double>(overdueCount) / customers.size() * 100.0) 
-             << "%)\n";
-        cout << "  Total overdue amount: $" << fixed << setprecision(2) << overdueAmount << "\n";
+        // Reports say where they went on the console - keep that out of it
+        streambuf* console = cout.rdbuf(nullptr);
+        BenchResult report = benchCase("createMonthlyReport" + size, n,
+                                       [&] { system.createMonthlyReport("/dev/null"); });
+        BenchResult withRows = benchCase("createMonthlyReport/customers" + size, n,
+                                         [&] { system.createMonthlyReport("/dev/null", true); });
+        cout.rdbuf(console);
+        cout.clear();
+        show(report);
+        show(withRows);
         
-        // Import/Export numbers
-        double importTotal = 0, exportTotal = 0;
-        for (auto& t : trades) {
-            if (t.isImport) importTotal += t.getValue();
-            else exportTotal += t.getValue();
-        }
+        // A customer only gets one reminder until they pay, so this is a
+        // single run over everyone overdue
+        show(benchCase("sendReminders" + size, n, [&] { system.sendReminders(); }, 0, 1));
         
-        cout << "\nImport/Export:\n";
-        cout << "  Total imports: $" << fixed << setprecision(2) << importTotal << "\n";
-        cout << "  Total exports: $" << fixed << setprecision(2) << exportTotal << "\n";
-        cout << "  Balance: $" << (importTotal - exportTotal) << "\n\n";
+        // Billing uses up the usage it bills, so each run gets a fresh month
+        // of usage first (not timed)
+        auto refill = [&] {
+            for (size_t k = 0; k < n; k++) system.useEnergy(data.firstId + k, 10);
+        };
+        show(benchCase("doBilling" + size, n, [&] { system.doBilling(); }, 0.5, 3, refill));
     }
-};
+    
+    if (jsonFile.empty()) return;
+    ofstream out(jsonFile);
+    time_t t = time(nullptr);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+    out << "{\n  \"context\": {\"date\": \"" << date << "\", \"threads\": " << thread::hardware_concurrency()
+        << ", \"kernel\": \"" << groupedSumKernelName() << "\"},\n  \"benchmarks\": [";
+    for (size_t k = 0; k < results.size(); k++) {
+        const BenchResult& r = results[k];
+        out << (k ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"customers\": " << r.customers
+            << ", \"iterations\": " << r.iterations << fixed << setprecision(1)
+            << ", \"ns_per_op\": " << r.nsPerOp;
+        if (COUNTING_ALLOCS)
+            out << ", \"allocs_per_op\": " << r.allocsPerOp << ", \"bytes_per_op\": " << r.bytesPerOp;
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    if (!out) cerr << "Couldn't write benchmark results to " << jsonFile << endl;
+    else cout << "\nResults saved to " << jsonFile << endl;
+}
+
+// Ask a yes/no question on the console
+bool askYes(const char* question) {
+    cout << question << " (y/n): ";
+    string answer;
+    getline(cin, answer);
+    return answer == "y" || answer == "Y";
+}
+
+// Page back through one customer's whole history, 20 bills at a time
+void browseHistory(const Customer& c, time_t now, DateCache& dates) {
+    DetailPage page;
+    page.bills = page.maintenance = 20;
+    for (string text;; page.billOffset += page.bills, page.maintenanceOffset += page.maintenance) {
+        text.clear();
+        bool more = c.renderDetails(text, dates, page, now);
+        cout << text;
+        if (!more || !askYes("Show older history?")) break;
+    }
+}
 
 // Simple menu system
-void showMenu(EnergySystem& system) {
+void showMenu(EnergySystem& system, const string& reportFile = "monthly_report.txt",
+              bool reportCustomers = false) {
     int choice;
+    DateCache dates;     // shared by every listing, so bill dates get formatted once
+    string text;
     
     do {
         cout << "\n===== Energy Provider System =====\n";
@@ -515,6 +8230,14 @@ void showMenu(EnergySystem& system) {
         cout << "4. Run billing process\n";
         cout << "5. View system stats\n";
         cout << "6. Generate monthly report\n";
+        cout << "7. Ingest meter readings (simulated feed)\n";
+        cout << "8. Save snapshot\n";
+        cout << "9. Write-ahead log stats\n";
+        cout << "10. Report changes since the last report\n";
+        cout << "11. Show metrics\n";
+        cout << "12. Post a remittance file\n";
+        cout << "13. Maintenance work orders\n";
+        cout << "14. Capacity planning what-ifs\n";
         cout << "0. Exit\n";
         cout << "Your choice: ";
         cin >> choice;
@@ -523,7 +8246,7 @@ void showMenu(EnergySystem& system) {
         cin.ignore(numeric_limits<streamsize>::max(), '\n'); // Clear input buffer
         
         string query, province;
-        vector<Customer*> results;
+        vector<Customer> results;
         
         switch(choice) {
             case 1: // Search for customers
@@ -533,46 +8256,107 @@ void showMenu(EnergySystem& system) {
                 cout << "Filter by province (optional): ";
                 getline(cin, province);
                 
-                results = system.findCustomers(query, province);
+                // Plain numbers go straight to the ID index
+                if (!query.empty() && all_of(query.begin(), query.end(), [](unsigned char c) { return isdigit(c); }) && query.size() < 10) {
+                    Customer c = system.findById(stoi(query));
+                    if (c && (province.empty() || c.getProvince() == province))
+                        results.push_back(c);
+                }
                 
-                cout << "\nFound " << results.size() << " customers:\n";
-                for (auto* c : results) {
-                    c->printDetails();
-                    cout << "-------------------------\n";
+                // No exact hit - fall back to the normal search (partial IDs, names, emails).
+                // Results come a page at a time so a common name doesn't flood the screen.
+                if (results.empty()) {
+                    const size_t pageSize = 20;
+                    for (size_t offset = 0;; offset += pageSize) {
+                        results = system.findCustomers(query, province, pageSize + 1, offset);
+                        bool more = results.size() > pageSize;
+                        if (more) results.pop_back();
+                        
+                        if (results.empty()) {
+                            cout << "\nNo customers found.\n";
+                            break;
+                        }
+                        
+                        cout << "\nShowing customers " << offset + 1 << "-" << offset + results.size() << ":\n";
+                        text.clear();
+                        for (auto& c : results) {
+                            c.renderDetails(text, dates, DetailPage(), system.now());
+                            text += "-------------------------\n";
+                        }
+                        cout << text;
+                        
+                        if (!more || !askYes("Show the next page?")) break;
+                    }
+                } else {
+                    cout << "\nFound " << results.size() << " customers:\n";
+                    for (auto& c : results) {
+                        browseHistory(c, system.now(), dates);
+                        cout << "-------------------------\n";
+                    }
                 }
                 
                 cout << "\nPress Enter to continue...";
                 cin.get();
                 break;
                 
-            case 2: // Show overdue customers
+            case 2: { // Show overdue customers - a short summary each, a page at a time
                 results = system.getOverdueCustomers();
-                
                 cout << "Found " << results.size() << " customers with overdue bills:\n";
-                for (auto* c : results) {
-                    c->printDetails();
-                    cout << "-------------------------\n";
+                
+                DetailPage summary;
+                summary.bills = 3;
+                summary.maintenance = 0;
+                const size_t pageSize = 20;
+                for (size_t from = 0; from < results.size(); from += pageSize) {
+                    text.clear();
+                    for (size_t k = from; k < min(from + pageSize, results.size()); k++) {
+                        results[k].renderDetails(text, dates, summary, system.now());
+                        text += "-------------------------\n";
+                    }
+                    cout << text;
+                    if (from + pageSize >= results.size() || !askYes("Show the next page?")) break;
+                }
+                
+                if (!results.empty()) {
+                    cout << "\nCustomer ID for their full history (Enter to go back): ";
+                    getline(cin, query);
+                    Customer c = query.empty() ? Customer() : system.findById(atoi(query.c_str()));
+                    if (c) browseHistory(c, system.now(), dates);
+                    else if (!query.empty()) cout << "No such customer.\n";
                 }
                 
                 cout << "\nPress Enter to continue...";
                 cin.get();
                 break;
+            }
                 
             case 3: // Send reminders
-                system.sendReminders();
-                cout << "Payment reminders have been sent!\n";
+            {
+                ReminderStats rs = system.sendReminders();
+                cout << "Payment reminders have been sent!\n"
+                     << "Sent: " << rs.sent << ", failed: " << rs.failed
+                     << ", retries: " << rs.retries << "\n" << fixed << setprecision(1)
+                     << "Rate: " << rs.sentPerSec() << "/sec, peak queue: " << rs.maxQueueDepth
+                     << ", p99 latency: " << setprecision(2) << rs.p99Ms << " ms\n";
+            }
                 
                 cout << "\nPress Enter to continue...";
                 cin.get();
                 break;
                 
-            case 4: // Process billing
-                system.doBilling();
-                cout << "Billing completed for all customers.\n";
+            case 4: { // Process billing
+                BillingSummary run = system.doBilling();
+                cout << "Billing completed for all customers.\n"
+                     << "Bills created: " << run.billsCreated << "\n"
+                     << "Total billed: $" << fixed << setprecision(2) << run.totalBilled << "\n"
+                     << "Time: " << setprecision(3) << run.seconds * 1000 << " ms ("
+                     << run.threads << " threads)\n"
+                     << "Old bills moved to cold storage: " << run.billsCompacted << "\n";
                 
                 cout << "\nPress Enter to continue...";
                 cin.get();
                 break;
+            }
                 
             case 5: // View statistics
                 system.showStats();
@@ -582,11 +8366,191 @@ void showMenu(EnergySystem& system) {
                 break;
                 
             case 6: // Generate report
-                system.createMonthlyReport("monthly_report.txt");
+                system.createMonthlyReport(reportFile, reportCustomers);
+                
+                cout << "\nPress Enter to continue...";
+                cin.get();
+                break;
+                
+            case 7: { // Push a fake smart meter feed through the ingestion pipeline
+                IngestionPipeline pipeline(system);
+                mt19937 gen{random_device{}()};
+                // A few IDs past the end on purpose so we see some rejects
+                uniform_int_distribution<> ids(1001, 1000 + system.customerCount() + 10);
+                uniform_real_distribution<> amount(0.1, 5.0);
+                time_t now = time(nullptr);
+                
+                for (int i = 0; i < 200000; i++)
+                    pipeline.submit({ids(gen), amount(gen), now + i});
+                
+                IngestStats st = pipeline.finish();
+                cout << "Readings received: " << st.received << "\n"
+                     << "Applied: " << st.applied << "\n"
+                     << "Rejected (over allocation): " << st.overAllocation << "\n"
+                     << "Rejected (unknown ID): " << st.unknownId << "\n"
+                     << "Throughput: " << fixed << setprecision(0) << st.readingsPerSec()
+                     << " readings/sec\n";
+                
+                cout << "\nPress Enter to continue...";
+                cin.get();
+                break;
+            }
+                
+            case 8: // Save everything to disk
+                if (system.saveSnapshot("energy_snapshot.bin"))
+                    cout << "Snapshot saved to energy_snapshot.bin\n";
+                
+                cout << "\nPress Enter to continue...";
+                cin.get();
+                break;
+                
+            case 9: { // How the write-ahead log is keeping up
+                if (!system.hasLog()) {
+                    cout << "No write-ahead log open (start with --wal <file>).\n";
+                } else {
+                    LogStats st = system.getLogStats();
+                    cout << "Records logged: " << st.records << " (" << st.bytes << " bytes)\n"
+                         << "Fsyncs: " << st.syncs << " (" << fixed << setprecision(1)
+                         << st.recordsPerSync() << " records each)\n"
+                         << "Average fsync: " << setprecision(3) << st.avgSyncMs() << " ms, worst "
+                         << st.maxSyncMs << " ms\n"
+                         << "Throughput: " << setprecision(0) << st.recordsPerSec() << " records/sec\n";
+                    if (st.failures)
+                        cout << "Failed writes: " << st.failures << " - nothing since the first is on disk, take a snapshot\n";
+                }
+                
+                cout << "\nPress Enter to continue...";
+                cin.get();
+                break;
+            }
+                
+            case 10: { // Delta report, next to the normal one with _changes on the name
+                string file = reportFile;
+                size_t dot = file.rfind('.'), slash = file.rfind('/');
+                if (dot == string::npos || (slash != string::npos && dot < slash)) dot = file.size();
+                file.insert(dot, "_changes");
+                system.createDeltaReport(file, reportCustomers);
+                
+                cout << "\nPress Enter to continue...";
+                cin.get();
+                break;
+            }
+                
+            case 11: // Counters and latency histograms, as a scraper would see them
+#ifdef HAVE_METRICS
+                metrics().snapshot().writePrometheus(cout);
+#else
+                cout << "Metrics were compiled out (NO_METRICS).\n";
+#endif
+                cout << "\nPress Enter to continue...";
+                cin.get();
+                break;
+                
+            case 12: { // Bank payments in bulk, then what didn't line up
+                cout << "Remittance file (customer id,amount,reference per line): ";
+                string file;
+                getline(cin, file);
+                vector<Remittance> batch;
+                if (readRemittances(file, batch)) {
+                    PostingReport r = system.postPayments(batch);
+                    printPostingReport(r, cout);
+                    if (!r.issues.empty() && writeReconciliation(r, "reconciliation.csv"))
+                        cout << "All of them are in reconciliation.csv\n";
+                }
+                
+                cout << "\nPress Enter to continue...";
+                cin.get();
+                break;
+            }
+                
+            case 13: { // What's coming up, booking it and signing it off
+                cout << "1. Work due soon\n2. Book work\n3. Sign off work\n4. Cancel work\nYour choice: ";
+                string pick, line;
+                getline(cin, pick);
+                
+                if (pick == "1") {
+                    cout << "Province (Enter for all): ";
+                    getline(cin, province);
+                    cout << "Task (Enter for any): ";
+                    string task;
+                    getline(cin, task);
+                    cout << "Due within how many days? ";
+                    getline(cin, line);
+                    int days = line.empty() ? 7 : atoi(line.c_str());
+                    auto due = system.maintenanceDue(province, system.now(), system.now() + days * 86400, task, 100);
+                    cout << "\n" << due.size() << (due.size() == 100 ? "+" : "") << " work orders due:\n";
+                    for (auto& o : due) {
+                        cout << "  #" << o.number << " " << dates.format(o.due) << " " << system.provinceName(o.province)
+                             << " - customer " << o.customerId << ": " << o.task << " (priority " << o.priority;
+                        if (o.status == MaintenanceScheduler::DISPATCHED) cout << ", " << system.crewName(o.crew) << " is on it";
+                        cout << ")\n";
+                    }
+                } else if (pick == "2") {
+                    cout << "Customer ID: ";
+                    getline(cin, line);
+                    int id = atoi(line.c_str());
+                    cout << "Task: ";
+                    string task;
+                    getline(cin, task);
+                    cout << "Due in how many days? ";
+                    getline(cin, line);
+                    time_t due = system.now() + atoi(line.c_str()) * 86400;
+                    cout << "Priority (0 = emergency, 9 = whenever): ";
+                    getline(cin, line);
+                    int number = system.scheduleMaintenance(id, task.empty() ? "Equipment check" : task, due,
+                                                            line.empty() ? 5 : atoi(line.c_str()));
+                    if (number < 0) cout << "No such customer.\n";
+                    else cout << "Booked as work order #" << number << ".\n";
+                } else if (pick == "3" || pick == "4") {
+                    cout << "Work order number: ";
+                    getline(cin, line);
+                    int number = atoi(line.c_str());
+                    bool ok;
+                    if (pick == "3") {
+                        cout << "What did it cost? $";
+                        string cost;
+                        getline(cin, cost);
+                        ok = system.completeMaintenance(number, atof(cost.c_str()));
+                    } else {
+                        ok = system.cancelMaintenance(number);
+                    }
+                    cout << (ok ? "Done.\n" : "No open work order with that number.\n");
+                }
+                
+                cout << "\nPress Enter to continue...";
+                cin.get();
+                break;
+            }
+                
+            case 14: { // The usual what-ifs, or one of your own next to the baseline
+                cout << "1. Standard scenarios\n2. Your own\nYour choice: ";
+                string pick, line;
+                getline(cin, pick);
+                vector<Scenario> scenarios = defaultScenarios();
+                if (pick == "2") {
+                    auto percent = [&](const string& prompt) {
+                        cout << prompt << " (%, Enter for no change): ";
+                        getline(cin, line);
+                        return atof(line.c_str()) / 100;
+                    };
+                    Scenario own;
+                    own.name = "Your scenario";
+                    own.demandGrowth = percent("Demand growth");
+                    own.rateChange.fill(percent("Rate change"));
+                    own.priceElasticity = -0.3;
+                    own.supplyChange = percent("Supply change");
+                    cout << "Province with its own supply change (Enter for none): ";
+                    getline(cin, province);
+                    if (!province.empty()) own.provinceSupply = {{province, percent("Its supply change")}};
+                    own.importChange = percent("Import change");
+                    scenarios = {Scenario(), own};
+                }
+                printCapacityPlan(system.planCapacity(scenarios), cout);
                 
                 cout << "\nPress Enter to continue...";
                 cin.get();
                 break;
+            }
                 
             case 0: // Exit
                 cout << "Thanks for using the Energy Provider System!\n";
@@ -602,17 +8566,202 @@ void showMenu(EnergySystem& system) {
     } while (choice != 0);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     // Create our system
     EnergySystem system;
     
-    // Generate some test data
-    cout << "Setting up test data...\n";
-    system.createTestData();
-    cout << "Done! 500 customers created in 5 provinces.\n";
+    string snapshotFile, logFile, reportFile = "monthly_report.txt";
+    bool reportCustomers = false;
+    double logBudgetMs = 2;
+    GeneratorConfig data;       // test data, when there's no snapshot or log to start from
+    data.seed = random_device{}();
+    LoadTestConfig loadTest;
+    bool runLoad = false;
+    bool runPlan = false;
+    unsigned planThreads = 0;
+    vector<size_t> benchSizes;
+    string benchJson = "benchmarks.json";
+    string metricsFile;
+    double metricsEvery = 15;
+    ServerConfig server;
+    bool serve = false;
+    int crews = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        
+        // --load <file>: start from a saved snapshot instead of test data
+        if (arg == "--load" && i + 1 < argc)
+            snapshotFile = argv[++i];
+        
+        // --wal <file>: log every change, replaying what's already in it
+        if (arg == "--wal" && i + 1 < argc)
+            logFile = argv[++i];
+        
+        // --tier-days <n>: pack paid bills older than n days (0 = never)
+        if (arg == "--tier-days" && i + 1 < argc)
+            system.setBillTiering(stoi(argv[++i]));
+        
+        // --wal-budget <ms>: how long a change may wait for its fsync
+        if (arg == "--wal-budget" && i + 1 < argc)
+            logBudgetMs = stod(argv[++i]);
+        
+        // --report <file>: where menu reports go - .csv, .json or .col for
+        // those formats, anything else is text
+        if (arg == "--report" && i + 1 < argc)
+            reportFile = argv[++i];
+        
+        // --report-customers: add a line per customer to reports
+        if (arg == "--report-customers")
+            reportCustomers = true;
+        
+        // --generate <n>: make n test customers instead of 500, with
+        // --provinces <n> (up to 13), --history <months> of bills,
+        // --trades <n> and --seed <n> for the same data every time
+        if (arg == "--generate" && i + 1 < argc)
+            data.customers = stoull(argv[++i]);
+        if (arg == "--provinces" && i + 1 < argc)
+            data.provinces = stoi(argv[++i]);
+        if (arg == "--history" && i + 1 < argc)
+            data.billMonths = stoi(argv[++i]);
+        if (arg == "--trades" && i + 1 < argc)
+            data.trades = stoull(argv[++i]);
+        if (arg == "--seed" && i + 1 < argc)
+            data.seed = stoull(argv[++i]);
+        
+        // --load-test <seconds>: hammer the system with a mix of searches,
+        // payments, usage, billing and reports on --load-threads <n>
+        // threads, print how it went and quit. Customers are picked using
+        // the --generate settings, so pass the same ones with --load.
+        if (arg == "--load-test" && i + 1 < argc) {
+            runLoad = true;
+            loadTest.seconds = stod(argv[++i]);
+        }
+        if (arg == "--load-threads" && i + 1 < argc)
+            loadTest.threads = stoul(argv[++i]);
+        
+        // --bench [sizes]: time the hot paths at each size (comma separated,
+        // default 1000,100000,10000000), save them to --bench-json <file>
+        // and quit
+        if (arg == "--bench") {
+            string list = i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]) ? argv[++i] : "1000,100000,10000000";
+            stringstream in(list);
+            for (string item; getline(in, item, ',');) benchSizes.push_back(stoull(item));
+        }
+        if (arg == "--bench-json" && i + 1 < argc)
+            benchJson = argv[++i];
+        
+        // --metrics <file>: keep the counters and latency histograms in
+        // this file (Prometheus text format), rewritten every
+        // --metrics-every <seconds>
+        if (arg == "--metrics" && i + 1 < argc)
+            metricsFile = argv[++i];
+        if (arg == "--metrics-every" && i + 1 < argc)
+            metricsEvery = stod(argv[++i]);
+        
+        // --serve <port>: answer JSON requests on that port instead of showing
+        // the menu, with --serve-host <address> (default 127.0.0.1) and
+        // --serve-workers <n> threads running them, until Ctrl-C
+        if (arg == "--serve" && i + 1 < argc) {
+            serve = true;
+            server.port = stoi(argv[++i]);
+        }
+        if (arg == "--serve-host" && i + 1 < argc)
+            server.host = argv[++i];
+        if (arg == "--serve-workers" && i + 1 < argc)
+            server.workers = stoul(argv[++i]);
+        
+        // --crews <n>: put n maintenance crews on shift (they go anywhere)
+        if (arg == "--crews" && i + 1 < argc)
+            crews = stoi(argv[++i]);
+        
+        // --plan [threads]: run the standard capacity what-ifs, print them
+        // and quit (threads default to one per core)
+        if (arg == "--plan") {
+            runPlan = true;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) planThreads = stoul(argv[++i]);
+        }
+        
+        // --check-totals: double check the cached stats against a full recount
+        if (arg == "--check-totals")
+            system.setTotalsCheck(true);
+        
+        // --bench-kernels [rows]: time the report kernels and quit
+        if (arg == "--bench-kernels") {
+            size_t rows = 10000000;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) rows = stoul(argv[++i]);
+            benchmarkKernels(rows);
+            return 0;
+        }
+    }
+    
+    if (!benchSizes.empty()) {
+        runBenchmarks(benchSizes, benchJson);
+        return 0;
+    }
+    
+    // Before any threads start, so Ctrl-C reaches the server loop
+    if (serve) CommandServer::blockStopSignals();
+    
+    unique_ptr<MetricsDumper> dumper;
+    if (!metricsFile.empty())
+        dumper = make_unique<MetricsDumper>(metricsFile, chrono::milliseconds(llround(max(0.1, metricsEvery) * 1000)));
+    
+    if (!snapshotFile.empty()) {
+        auto start = chrono::steady_clock::now();
+        if (!system.loadSnapshot(snapshotFile)) return 1;
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Loaded " << system.customerCount() << " customers from " << snapshotFile
+             << " in " << fixed << setprecision(1) << ms << " ms.\n";
+    }
+    
+    // A log that already has changes in it gets replayed on top of the
+    // snapshot (or an empty system). Otherwise we make test data - logged, if
+    // there's a log, so the next run can rebuild it.
+    bool restoring = !logFile.empty() && EnergySystem::logHasRecords(logFile);
+    auto budget = chrono::microseconds(llround(logBudgetMs * 1000));
+    if (restoring && !system.openLog(logFile, budget)) return 1;
+    
+    if (snapshotFile.empty() && !restoring) {
+        if (!logFile.empty() && !system.openLog(logFile, budget)) return 1;
+        
+        // Generate some test data
+        cout << "Setting up test data...\n";
+        auto start = chrono::steady_clock::now();
+        if (!system.generateData(data)) return 1;
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Done! " << data.customers << " customers created in " << data.provinces << " provinces in "
+             << fixed << setprecision(1) << ms << " ms.\n";
+    } else if (!logFile.empty() && !system.hasLog()) {
+        if (!system.openLog(logFile, budget)) return 1;
+    }
+    
+    for (int k = 0; k < crews; k++) system.addCrew("Crew " + to_string(k + 1));
+    
+    if (runLoad) {
+        loadTest.seed = data.seed;
+        printLoadTest(runLoadTest(system, data, loadTest), cout);
+        return 0;
+    }
+    
+    if (runPlan) {
+        printCapacityPlan(system.planCapacity(defaultScenarios(), planThreads), cout);
+        return 0;
+    }
+    
+    if (serve) {
+        server.reportFile = reportFile;
+        server.reportCustomers = reportCustomers;
+        CommandServer commands(system, server);
+        if (!commands.start()) return 1;
+        cout << "Serving on " << server.host << ":" << commands.port() << " with "
+             << commands.workerCount() << " workers (Ctrl-C to stop)\n";
+        bool ok = commands.run();
+        cout << "Server stopped.\n";
+        return ok ? 0 : 1;
+    }
     
     // Show the menu
-    showMenu(system);
+    showMenu(system, reportFile, reportCustomers);
     
     return 0;
 }
\ No newline at end of file